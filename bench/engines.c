@@ -0,0 +1,116 @@
+// Instructions-per-second benchmark for the execution engines, bare and
+// with a narrow plugin that only asks for CALL events.
+// inputs: test/gcd.asm, test/firstnsum.asm; bench/sum.asm is firstnsum with
+// n = 3000000 for a run long enough to hide the per-run setup
+// build: cc -O2 -o engines bench/engines.c
+// usage: ./engines <runs> <file-path>...
+
+#include <time.h>
+#include <stdlib.h>
+
+#define BIPCA_IMPLEMENTATION
+#include "../bipca.h"
+
+static size_t executed = 0;
+
+static void CountBeforeExecution(void* userData, Command cmd) {
+    (void) userData;
+    (void) cmd;
+    executed++;
+}
+
+static Plugin CounterPlugin = {
+    .name = "Counter",
+    .InitPlugin = PLUGIN_INIT_DUMMY,
+    .BeforeExecution = CountBeforeExecution,
+    .AfterExecution = PLUGIN_AFTER_EXEC_DUMMY,
+};
+
+static size_t calls = 0;
+
+static void CountCall(void* userData, Word from, Word to) {
+    (void) userData;
+    (void) from;
+    (void) to;
+    calls++;
+}
+
+static Plugin CallsPlugin = {
+    .name = "Calls",
+    .OnCall = CountCall,
+};
+
+static Word* snapshot;
+static Instr* decodedSnapshot;
+static Word programSize;
+
+static void Restore(void) {
+    memcpy(M, snapshot, (size_t) programSize * sizeof(Word));
+    memcpy(BIPCA_DECODED.code, decodedSnapshot, (size_t) BIPCA_DECODED.size * sizeof(Instr));
+    registers.IP = RESERVED;
+    registers.SP = SIZE;
+    registers.FP = UNDEF;
+    registers.RV = UNDEF;
+}
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <runs> <file-path>...\n", argv[0]);
+        return 1;
+    }
+    long runs = atol(argv[1]);
+    if (TranslateFromFiles(argc - 2, argv + 2)) return 1;
+    if (GetProgramSize(&programSize)) return 1;
+    snapshot = malloc((size_t) programSize * sizeof(Word));
+    memcpy(snapshot, M, (size_t) programSize * sizeof(Word));
+    decodedSnapshot = malloc((size_t) BIPCA_DECODED.size * sizeof(Instr) + 1);
+    memcpy(decodedSnapshot, BIPCA_DECODED.code, (size_t) BIPCA_DECODED.size * sizeof(Instr));
+
+    // count instructions once with the reference engine
+    AddPlugin(&CounterPlugin);
+    Word expected = Interpret((InterpretParams) { .engine = ENGINE_SWITCH });
+    BIPCA_PLUGINS.size = 0;
+
+    static const struct { const char* name; Engine engine; bool noSuper; bool calls; } engines[] = {
+        { "switch",         ENGINE_SWITCH,   false, false },
+        { "threaded/plain", ENGINE_THREADED, true,  false },
+        { "threaded",       ENGINE_THREADED, false, false },
+        { "decoded/plain",  ENGINE_DECODED,  true,  false },
+        { "decoded",        ENGINE_DECODED,  false, false },
+        { "tos/plain",      ENGINE_TOS,      true,  false },
+        { "tos",            ENGINE_TOS,      false, false },
+        { "jit",            ENGINE_JIT,      false, false },
+        { "trace",          ENGINE_TRACE,    false, false },
+        { "switch+calls",   ENGINE_SWITCH,   false, true },
+        { "threaded+calls", ENGINE_THREADED, false, true },
+        { "decoded+calls",  ENGINE_DECODED,  false, true },
+        { "tos+calls",      ENGINE_TOS,      false, true },
+    };
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        BIPCA_PLUGINS.size = 0;
+        if (engines[e].calls) AddPlugin(&CallsPlugin);
+        double start = Now();
+        for (long r = 0; r < runs; r++) {
+            Restore();
+            Word result = Interpret((InterpretParams) {
+                .engine = engines[e].engine,
+                .noSuperinstructions = engines[e].noSuper,
+            });
+            if (result != expected) {
+                fprintf(stderr, "%s: result %d, expected %d\n", engines[e].name, result, expected);
+                return 1;
+            }
+        }
+        double elapsed = Now() - start;
+        printf("%-16s %6zu instr/run %8.3f s %8.1f Minstr/s\n",
+               engines[e].name, executed, elapsed,
+               (double) executed * (double) runs / elapsed / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Translation time of a label-heavy program: a generated file with a
+// label every three words, each line referencing a label defined later
+// and one defined earlier.
+// build: cc -O2 -o labels bench/labels.c
+// usage: ./labels <runs> [labels], 150000 labels by default
+
+#include <time.h>
+#include <stdlib.h>
+
+#define BIPCA_IMPLEMENTATION
+#include "../bipca.h"
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <runs> [labels]\n", argv[0]);
+        return 1;
+    }
+    long runs = atol(argv[1]);
+    long n = argc > 2 ? atol(argv[2]) : 150000;
+
+    char path[] = "/tmp/bipca-labels-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out) {
+        fprintf(stderr, "unable to create a temporary file\n");
+        return 1;
+    }
+    fprintf(out, "main JMP\n");
+    for (long i = 0; i < n; i++) {
+        fprintf(out, ":label_%ld_entry %ld label_%ld_entry DROP label_%ld_entry DROP\n",
+                i, i, (i + n / 2) % n, i / 2);
+    }
+    fprintf(out, ":main 0 HALT\n");
+    long bytes = ftell(out);
+    fclose(out);
+
+    char* paths[] = {path};
+    double best = 0;
+    for (long r = 0; r < runs; r++) {
+        BipcaVM* vm = NewVM();
+        if (!vm || (8 * n > DEFAULT_SIZE && VMSetMemorySize(vm, (Word) (8 * n)))) {
+            unlink(path);
+            return 1;
+        }
+        BipcaSetActiveVM(vm);
+        double start = Now();
+        bool err = TranslateFromFiles(1, paths);
+        double elapsed = Now() - start;
+        BipcaSetActiveVM(NULL);
+        FreeVM(vm);
+        if (err) {
+            unlink(path);
+            return 1;
+        }
+        if (r == 0 || elapsed < best) best = elapsed;
+    }
+    unlink(path);
+    printf("%ld labels, %ld bytes: best %.2f ms, %.2f Mlabels/s, %.1f MB/s\n",
+           n, bytes, best * 1e3, (double) n / best / 1e6, (double) bytes / best / 1e6);
+    return 0;
+}
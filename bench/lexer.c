@@ -0,0 +1,121 @@
+// Lexing throughput of the scanners on generated inputs: long idents,
+// indented code under comment lines and short numbers. Reports the lexer
+// alone, SkipUnnecessary() and the token scan, and the whole translation.
+// build: cc -O2 -o lexer bench/lexer.c
+// usage: ./lexer <runs> [lines], 200000 lines by default
+
+#include <time.h>
+#include <stdlib.h>
+
+#define BIPCA_IMPLEMENTATION
+#include "../bipca.h"
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void WriteIdents(FILE* out, long n) {
+    for (long i = 0; i < n; i++) {
+        fprintf(out, ":counter_of_the_outer_loop_%ld label_of_the_function_entry_%ld DROP\n", i, i);
+        fprintf(out, ":label_of_the_function_entry_%ld counter_of_the_outer_loop_%ld DROP\n", i, i);
+    }
+}
+
+static void WriteComments(FILE* out, long n) {
+    for (long i = 0; i < n; i++) {
+        fprintf(out, "    ; keeps the running total of the loop on top of the stack\n");
+        fprintf(out, "        %ld DUP ADD DROP\n", i);
+    }
+}
+
+static void WriteNumbers(FILE* out, long n) {
+    for (long i = 0; i < n; i++) fprintf(out, "%ld -1 +2 ADD DROP DROP\n", i % 1000);
+}
+
+// tokens of the source text, a token runs from its first byte over ident bytes
+static size_t LexOnly(void) {
+    SourceText* source = &BIPCA_SOURCE;
+    size_t tokens = 0;
+    while (source->observed < source->size) {
+        SkipUnnecessary();
+        if (source->observed >= source->size) break;
+        source->observed = source->scan->SkipIdent(source->text, source->observed + 1, source->size);
+        tokens++;
+    }
+    return tokens;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <runs> [lines]\n", argv[0]);
+        return 1;
+    }
+    long runs = atol(argv[1]);
+    long n = argc > 2 ? atol(argv[2]) : 200000;
+
+    static const struct { const char* name; void (*Write)(FILE*, long); } inputs[] = {
+        { "idents",   WriteIdents },
+        { "comments", WriteComments },
+        { "numbers",  WriteNumbers },
+    };
+    static const Lexer lexers[] = { LEXER_SCALAR, LEXER_SSE2, LEXER_AVX2 };
+
+    for (size_t in = 0; in < sizeof(inputs) / sizeof(inputs[0]); in++) {
+        char path[] = "/tmp/bipca-lexer-XXXXXX";
+        int fd = mkstemp(path);
+        FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!out) {
+            fprintf(stderr, "unable to create a temporary file\n");
+            return 1;
+        }
+        fprintf(out, "main JMP\n");
+        inputs[in].Write(out, n);
+        fprintf(out, ":main 0 HALT\n");
+        long bytes = ftell(out);
+        fclose(out);
+
+        char* paths[] = {path};
+        size_t expected = 0;
+        for (size_t l = 0; l < sizeof(lexers) / sizeof(lexers[0]); l++) {
+            const LexerScanners* scan = GetLexerScanners(lexers[l]);
+            if (l > 0 && scan == GetLexerScanners(lexers[l - 1])) continue; // not on this CPU
+            double bestLex = 0, bestTranslate = 0;
+            for (long r = 0; r < runs; r++) {
+                BipcaVM* vm = NewVM();
+                if (!vm || VMSetMemorySize(vm, (Word) (8 * n + DEFAULT_SIZE))) {
+                    unlink(path);
+                    return 1;
+                }
+                vm->lexer = lexers[l];
+                BipcaSetActiveVM(vm);
+
+                bool err = ReadProgram(path);
+                double start = Now();
+                size_t tokens = err ? 0 : LexOnly();
+                double lexed = Now() - start;
+                CloseProgram();
+
+                start = Now();
+                err = err || TranslateFromFiles(1, paths);
+                double translated = Now() - start;
+                BipcaSetActiveVM(NULL);
+                FreeVM(vm);
+                if (err || (expected && tokens != expected)) {
+                    fprintf(stderr, "%s: %s lexer failed\n", inputs[in].name, scan->name);
+                    unlink(path);
+                    return 1;
+                }
+                expected = tokens;
+                if (r == 0 || lexed < bestLex) bestLex = lexed;
+                if (r == 0 || translated < bestTranslate) bestTranslate = translated;
+            }
+            printf("%-8s %-6s %9ld bytes: lex %7.1f MB/s, translate %6.1f MB/s\n",
+                   inputs[in].name, scan->name, bytes,
+                   (double) bytes / bestLex / 1e6, (double) bytes / bestTranslate / 1e6);
+        }
+        unlink(path);
+    }
+    return 0;
+}
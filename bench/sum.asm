@@ -0,0 +1,56 @@
+GETSP _MEMORY_SIZE SWAP SAVE
+_main CALL
+GETRV HALT
+:_MEMORY_SIZE 0
+:_PROGRAM_SIZE PROGRAM_SIZE
+:_f 
+GETFP GETSP SETFP 
+GETSP 2 SUB SETSP 
+
+GETFP 2 SUB 
+0 
+SAVE 
+GETFP 1 SUB 
+1 
+SAVE 
+:c__while_loop_1 
+GETFP 1 SUB 
+LOAD 
+GETFP 2 ADD 
+LOAD 
+CMP c__if_cond_2 JLT c__end_while_3 JMP 
+:c__if_cond_2 
+GETFP 2 SUB 
+GETFP 2 SUB 
+LOAD 
+GETFP 1 SUB 
+LOAD 
+ADD 
+SAVE 
+GETFP 1 SUB 
+GETFP 1 SUB 
+LOAD 
+1 
+ADD 
+SAVE 
+c__while_loop_1 JMP 
+:c__end_while_3 
+GETFP 2 SUB 
+LOAD 
+SETRV 
+c__f0 JMP 
+
+:c__f0 
+GETFP SETSP SETFP SDROP RET 
+:_main 
+GETFP GETSP SETFP 
+GETSP 0 SUB SETSP 
+
+3000000 
+_f CALL GETRV 
+SETRV 
+c__main4 JMP 
+
+:c__main4 
+GETFP SETSP SETFP RET 
+
@@ -8,11 +8,26 @@
 
 #include <stdint.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <inttypes.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#define BIPCA_THREADS 1
+#else
+#define BIPCA_THREADS 0
+#endif
 
 #define DEBUG 0
 #define LOG_DEBUG(fmt, ...) \
@@ -26,8 +41,7 @@
 #define TEXT_BOLD_GREEN(text) "\033[1;32m" text "\033[0m"
 #define TEXT_BOLD(text)       "\033[1m" text "\033[0m"
 
-#define SIZE (2 << 20) // min 10^6; 1 MiB
-#define PROGRAM_TEXT_SIZE (2 << 23) // 8 MiB
+#define DEFAULT_SIZE (2 << 20) // words of memory unless SetMemorySize() says otherwise
 #define RESERVED 256
 
 #define N_MAX_PLUGINS 64
@@ -38,14 +52,12 @@ typedef int32_t Word;
 
 #define UNDEF 0xDEADBEEF 
 #define MAX_IDENT_LENGTH (64 - 1) // one char reserved for '\0'
-#define MAX_N_IDENT (2 << 14)
-// max memory for storing idents is 64 * (2 << 14) = 1 MiB
+#define IDENT_MIN_CAPACITY 128
+#define IDENT_MAX_LOAD_PERCENT 70 // the table doubles above it
 
 #define MAX_FILENAME_LENGTH (256 - 1)
 #define MAX_N_FILES 256 
 
-Word M[SIZE] = {0};
-
 typedef enum {
     ADD    = -1,
     SUB    = -2,
@@ -99,6 +111,93 @@ typedef enum {
     HALT   = -37,
 } Command;
 
+// every distinct command code once, SETIP and RET are aliases of JMP
+#define BIPCA_COMMANDS(X) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(NEG) \
+    X(BITAND) X(BITOR) X(BITXOR) X(BITNOT) X(LSHIFT) X(RSHIFT) \
+    X(DUP) X(DROP) X(SWAP) X(ROT) X(OVER) X(SDROP) X(DROP2) \
+    X(LOAD) X(SAVE) \
+    X(GETIP) X(GETSP) X(GETFP) X(GETRV) X(SETSP) X(SETFP) X(SETRV) \
+    X(CMP) X(JMP) X(JLT) X(JGT) X(JEQ) X(JLE) X(JGE) X(JNE) \
+    X(CALL) X(RET2) \
+    X(IN) X(OUT) X(HALT)
+
+#define MAX_COMMAND_CODE 44 // -OUT, the most negative command
+
+// fused sequences of commands, see the superinstructions table
+#define BIPCA_SUPERINSTRUCTIONS(X) \
+    X(LOAD_FP_ADD) X(LOAD_FP_SUB) X(ALLOC) \
+    X(CMP_JLT) X(CMP_JGT) X(CMP_JEQ) X(CMP_JLE) X(CMP_JGE) X(CMP_JNE) \
+    X(GETFP_ADD) X(GETFP_SUB) \
+    X(JMP_IMM) X(CALL_IMM) \
+    X(JLT_IMM) X(JGT_IMM) X(JEQ_IMM) X(JLE_IMM) X(JGE_IMM) X(JNE_IMM) \
+    X(ADD_IMM) X(SUB_IMM)
+
+// Slots written by OptimizeProgram(), never by the decode stage. SKIP
+// covers len words with no effect, CONST pushes imm for len words of
+// constant arithmetic.
+#define BIPCA_OPTIMIZER_OPS(X) X(SKIP) X(CONST)
+
+// dense internal opcodes, the decoded form of a memory word
+typedef enum {
+    OP_UNKNOWN, // negative word that is not a command
+    OP_PUSH,    // non-negative word, pushes itself
+#define X(cmd) OP_##cmd,
+    BIPCA_COMMANDS(X)
+    BIPCA_SUPERINSTRUCTIONS(X)
+    BIPCA_OPTIMIZER_OPS(X)
+#undef X
+    N_OPS,
+} Op;
+
+typedef struct {
+    Word imm;     // literal for OP_PUSH and superinstructions, code for OP_UNKNOWN
+    uint8_t op;   // Op, possibly a superinstruction
+    uint8_t base; // Op of the single word, patterns never start with an
+                  // unknown word and keep imm for a leading literal, so
+                  // imm stays valid for a base OP_PUSH or OP_UNKNOWN
+    uint16_t len; // number of words covered, more than 1 for superinstructions
+} Instr;
+
+#define MAX_PATTERN_LENGTH 4
+#define PATTERN_LITERAL INT32_MAX // matches any literal word
+
+// Sequences fused into one instruction by the decode stage. The first
+// matching row wins, so longer patterns go first. A pattern may contain
+// one PATTERN_LITERAL, it becomes the immediate of the superinstruction.
+// To add a superinstruction, list it in BIPCA_SUPERINSTRUCTIONS, add a
+// row here and give it a body in BIPCA_OP_BODIES.
+typedef struct {
+    Op op;
+    Word length;
+    Word pattern[MAX_PATTERN_LENGTH];
+} Superinstruction;
+
+Superinstruction superinstructions[] = {
+    {OP_LOAD_FP_ADD, 4, {GETFP, PATTERN_LITERAL, ADD, LOAD}},
+    {OP_LOAD_FP_SUB, 4, {GETFP, PATTERN_LITERAL, SUB, LOAD}},
+    {OP_ALLOC,       4, {GETSP, PATTERN_LITERAL, SUB, SETSP}},
+    {OP_CMP_JLT,     3, {CMP, PATTERN_LITERAL, JLT}},
+    {OP_CMP_JGT,     3, {CMP, PATTERN_LITERAL, JGT}},
+    {OP_CMP_JEQ,     3, {CMP, PATTERN_LITERAL, JEQ}},
+    {OP_CMP_JLE,     3, {CMP, PATTERN_LITERAL, JLE}},
+    {OP_CMP_JGE,     3, {CMP, PATTERN_LITERAL, JGE}},
+    {OP_CMP_JNE,     3, {CMP, PATTERN_LITERAL, JNE}},
+    {OP_GETFP_ADD,   3, {GETFP, PATTERN_LITERAL, ADD}},
+    {OP_GETFP_SUB,   3, {GETFP, PATTERN_LITERAL, SUB}},
+    {OP_JMP_IMM,     2, {PATTERN_LITERAL, JMP}},
+    {OP_CALL_IMM,    2, {PATTERN_LITERAL, CALL}},
+    {OP_JLT_IMM,     2, {PATTERN_LITERAL, JLT}},
+    {OP_JGT_IMM,     2, {PATTERN_LITERAL, JGT}},
+    {OP_JEQ_IMM,     2, {PATTERN_LITERAL, JEQ}},
+    {OP_JLE_IMM,     2, {PATTERN_LITERAL, JLE}},
+    {OP_JGE_IMM,     2, {PATTERN_LITERAL, JGE}},
+    {OP_JNE_IMM,     2, {PATTERN_LITERAL, JNE}},
+    {OP_ADD_IMM,     2, {PATTERN_LITERAL, ADD}},
+    {OP_SUB_IMM,     2, {PATTERN_LITERAL, SUB}},
+};
+#define N_SUPERINSTRUCTIONS (sizeof(superinstructions) / sizeof(superinstructions[0]))
+
 typedef enum {
     NO_ERROR,
     
@@ -108,7 +207,6 @@ typedef enum {
     ERR_TOO_MANY_IDENTS,
     ERR_IDENT_TOO_LONG,
 
-    ERR_PROGRAM_TOO_LONG,
     ERR_FILENAME_TOO_LONG,
 
     ERR_UNEXPECTED_CHARACTER,
@@ -120,8 +218,14 @@ typedef enum {
     ERR_CANT_READ_FILE,
 
     ERR_NUMBER_TOO_BIG,
+    ERR_NOT_CONSTANT,
 
     ERR_TOO_MANY_PLUGINS,
+
+    ERR_OUT_OF_MEMORY,
+    ERR_PROGRAM_TOO_BIG,
+    ERR_TOO_MANY_FILES,
+    ERR_BAD_IMAGE,
 } Error;
 
 typedef struct {
@@ -134,64 +238,400 @@ typedef struct {
     size_t filenameIndex;
 } Coord;
 
-char files[MAX_FILENAME_LENGTH + 1][MAX_N_FILES] = {0};
+// Source locations of the program words, a row per run of consecutive
+// words on one source line. The columns are kept per word as LEB128
+// deltas from the previous word of the row, the first one from column 0,
+// so a word costs a byte or two instead of a Coord.
+typedef struct {
+    Word address;      // first word of the row
+    uint16_t file;     // index into files
+    uint32_t row;
+    uint32_t colIndex; // first byte of the row in cols
+} LineRow;
+
+typedef struct {
+    LineRow* rows;
+    size_t nRows;
+    size_t rowCapacity;
+    uint8_t* cols;
+    size_t nCols;
+    size_t colCapacity;
+    Word end;          // address past the last word
+    size_t lastCol;    // column of the last word
+    char files[MAX_N_FILES][MAX_FILENAME_LENGTH + 1];
+    size_t nFiles;
+    size_t file;       // file being translated
+} LineTable;
+
+// Translated program as written by EmitImage(): this header, then the
+// sections at the offsets it gives, each aligned to IMAGE_ALIGN. The
+// words are M[RESERVED..programSize), the symbols the labels of identMap,
+// files, rows and cols are the line table and decoded the decoded program,
+// used when nOps says it was decoded into the same opcodes. Integers are
+// in the byte order of the writer, byteOrder tells a reader with another
+// one to give up.
+#define IMAGE_MAGIC "BIPCAIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_BYTE_ORDER 0x01020304u
+#define IMAGE_ALIGN 16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    Word programSize;
+    uint32_t nSymbols;
+    uint32_t nFiles;
+    uint32_t nRows;
+    uint64_t nCols;
+    uint32_t nOps;
+    uint64_t wordsOffset;
+    uint64_t symbolsOffset;
+    uint64_t filesOffset;
+    uint64_t rowsOffset;
+    uint64_t colsOffset;
+    uint64_t decodedOffset;
+    uint64_t size;
+} ImageHeader;
+
+typedef struct {
+    char key[MAX_IDENT_LENGTH + 1];
+    Word address;
+    uint32_t row;
+    uint32_t col;
+} ImageSymbol;
+
+#define TRANSLATION_CACHE_BYTES ((uint64_t) 256 << 20)
 
-Coord coords[SIZE] = {0};
+// Images of translated programs kept by TranslateFromFilesCached(), named
+// after a hash of the file names and contents they were translated from.
+typedef struct {
+    const char* dir;    // NULL for $XDG_CACHE_HOME/bipca or ~/.cache/bipca
+    uint64_t maxBytes;  // least recently used images go above it, 0 for TRANSLATION_CACHE_BYTES
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} TranslationCache;
 
 typedef struct {
     Word address;
     bool isUserDefined;
+    bool isConstant;   // user defined with '=', address is its value
     Position position;
 } IdentInfo;
 
-struct {
-    struct {
-        char key[MAX_IDENT_LENGTH + 1];
-        IdentInfo value;
-        bool occupied;
-    } table[MAX_N_IDENT];
-} identMap = {0};
+// A word naming an ident not defined yet when the translator wrote it,
+// or a label where it was defined. The name is the length bytes of the
+// source text ending at observed, position is where the term or the
+// label starts.
+typedef struct {
+    Word address;      // the value of a constant
+    uint32_t length;
+    size_t observed;
+    Position position;
+    bool negative;     // the ident is subtracted from the word
+    bool isConstant;   // a label defined with '='
+} Fixup;
 
-struct {
-    char fileName[MAX_FILENAME_LENGTH + 1];
-    char text[PROGRAM_TEXT_SIZE];
+typedef struct {
+    Fixup* list;
     size_t size;
+    size_t capacity;
+} Fixups;
+
+typedef struct {
+    Error err;
     size_t observed;
     Position position;
-} program = {0};
+} UnitError;
+
+// What the per-file phase of TranslateFromFiles() makes of one file, on
+// any thread: its words as if the file started at address 0, and what the
+// link needs to place them at their base address and report the errors
+// in file order.
+typedef struct {
+    const char* fileName;
+    const char* text;       // mapped until the link, names and errors point into it
+    size_t size;
+    Error fatal;            // the file could not be read or translated at all
+    Word* words;            // the first min(nWords, memory size) of them
+    Word nWords;
+    size_t wordCapacity;
+    LineRow* rows;          // line table of the words, file 0
+    size_t nRows;
+    uint8_t* cols;
+    size_t nCols;
+    Fixups labels;          // labels defined, address is the offset in the file, and constants
+    Fixups externs;         // idents left to the link, PROGRAM_SIZE among them
+    Fixups constants;       // idents of constants left to the link, address is the index in labels
+    Word* relocations;      // offsets of the words holding a label of the file, ~offset if subtracted
+    size_t nRelocations;
+    size_t relocationCapacity;
+    UnitError* errors;
+    size_t nErrors;
+    size_t errorCapacity;
+} TranslationUnit;
+
+typedef struct {
+    uint32_t hash;     // _Hash() of the key, 0 for an empty slot
+    uint32_t key;      // offset of the key in arena, '\0' terminated
+    uint32_t length;
+    IdentInfo value;
+} IdentSlot;
+
+// Open addressing with linear probing over a power of two of slots. Keys
+// are interned in one arena, a probe compares the cached hashes before
+// the keys.
+typedef struct {
+    IdentSlot* table;
+    size_t capacity;   // 0 until the first NewIdent()
+    size_t size;
+    char* arena;
+    size_t arenaSize;
+    size_t arenaCapacity;
+} IdentMap;
+
+// Scanners of the lexer. LEXER_AUTO picks the widest the CPU has, one
+// the CPU lacks falls back to the widest it has.
+typedef enum {
+    LEXER_AUTO,
+    LEXER_SCALAR, // a byte at a time
+    LEXER_SSE2,   // 16 bytes at a time, x86-64
+    LEXER_AVX2,   // 32 bytes at a time, x86-64 with AVX2
+} Lexer;
+
+// Each scanner goes over text[i..size) and returns the index it stops at,
+// size if it runs out of text.
+typedef struct {
+    const char* name;
+    // first byte that is not blank, counting the newlines passed into
+    // *row and moving *lineStart past the last of them
+    size_t (*SkipBlank)(const char* text, size_t i, size_t size, size_t* row, size_t* lineStart);
+    size_t (*SkipLine)(const char* text, size_t i, size_t size);  // the next '\n'
+    size_t (*SkipIdent)(const char* text, size_t i, size_t size); // first byte not in an ident
+} LexerScanners;
 
-Word current = RESERVED;
-Word oldCurrent = RESERVED;
+// The column of observed is worked out from lineStart when a position is
+// needed, see CurrentPosition().
+typedef struct {
+    char fileName[MAX_FILENAME_LENGTH + 1];
+    const char* text; // mapped by ReadProgram(), size bytes with no terminator
+    size_t size;
+    size_t observed;
+    size_t row;       // row of observed
+    size_t lineStart; // first byte of that row
+    const LexerScanners* scan;
+} SourceText;
 
+// Callbacks of a plugin, any of them may be NULL. BeforeExecution and
+// AfterExecution run around the words whose base opcode is in opcodes,
+// around every word if it is 0. The events are reported after the word
+// at `from` did what they tell:
+//   OnMemoryWrite  SAVE of value at addr
+//   OnCall         CALL to `to`
+//   OnReturn       RET2 to `to`, RET is JMP: a plugin keeping its own
+//                  call stack tells one by the target
+//   OnJump         JMP or a conditional jump taken, to `to`
+//   OnIO           IN with the word read, OUT with the word written
+// Interpret() calls a plugin only for the opcodes it asked for, and
+// FinishPlugin once the run is over, before freeing the user data.
 typedef struct {
     char name[PLUGIN_NAME_MAX_LENGTH + 1];
     bool (*InitPlugin)(void**);
     void (*BeforeExecution)(void*, Command);
     void (*AfterExecution)(void*, Command);
+    uint64_t opcodes;  // PLUGIN_OP() of base opcodes
+    void (*OnMemoryWrite)(void*, Word addr, Word value);
+    void (*OnCall)(void*, Word from, Word to);
+    void (*OnReturn)(void*, Word from, Word to);
+    void (*OnJump)(void*, Word from, Word to);
+    void (*OnIO)(void*, Command cmd, Word value);
+    void (*FinishPlugin)(void*);
 } Plugin;
 
-struct {
-    Plugin plugins[N_MAX_PLUGINS];
+#define PLUGIN_OP(op) ((uint64_t) 1 << (op))
+
+// The plugins and, per base opcode, the ones to call around its words,
+// built by Interpret() from their opcodes and events.
+typedef struct {
+    Plugin list[N_MAX_PLUGINS];
     size_t size;
     void* userDataPointers[N_MAX_PLUGINS];
-} plugins = {0};
+    bool hooked[N_OPS];                   // some plugin is called for the opcode
+    bool unfuse[N_OPS];                   // superinstruction covering a hooked opcode
+    uint8_t before[N_OPS][N_MAX_PLUGINS]; // indices into list
+    uint8_t after[N_OPS][N_MAX_PLUGINS];
+    uint8_t events[N_OPS][N_MAX_PLUGINS];
+    uint8_t nBefore[N_OPS];
+    uint8_t nAfter[N_OPS];
+    uint8_t nEvents[N_OPS];
+    Word eventAt;                         // word being run, with its SAVE or OUT operands
+    Word eventAddr;
+    Word eventValue;
+} PluginSet;
 
-struct {
+typedef struct {
     Word IP;
     Word SP;
     Word FP;
     Word RV;
-} registers = {
-    .IP = RESERVED,
-    .SP = SIZE,
-    .FP = UNDEF,
-    .RV = UNDEF,
-};
+} Registers;
+
+#if defined(__GNUC__)
+#define BIPCA_COMPUTED_GOTO 1
+#else
+#define BIPCA_COMPUTED_GOTO 0
+#endif
+
+#if defined(__x86_64__) && defined(__linux__)
+#define BIPCA_JIT 1
+#include <sys/mman.h>
+#else
+#define BIPCA_JIT 0
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BIPCA_SIMD_LEXER 1
+#include <immintrin.h>
+#else
+#define BIPCA_SIMD_LEXER 0
+#endif
+
+// Decoded copy of the program region: decoded.code[addr - RESERVED] is
+// the instruction at M[addr]. Instructions and words map one to one, so
+// GETIP, CALL and jump targets keep using plain M addresses.
+// OptimizeProgram() may rewrite slots further, linked marks the words
+// its rewrites depend on beyond the window a SAVE re-decodes.
+typedef struct {
+    Instr* code;
+    Word size;
+    int level;       // OptimizeProgram() level, 0 for plain decoding
+    uint8_t* linked;
+} DecodedProgram;
+
+// Write barrier over the program region: one bit per page of
+// CODE_PAGE_WORDS words, set once compiled code was generated from the
+// page. A SAVE into a marked page drops the compiled code covering the
+// written word, a SAVE anywhere else (data, code never compiled) only
+// stores. The decoded copy is cheap to patch and is refreshed per word.
+// Pages are single words: globals sit right next to the code that writes
+// them (g_is_inside_word in wordcount.asm), and a trace leaves on every
+// store into a marked page.
+#define CODE_PAGE_SHIFT 0
+#define CODE_PAGE_WORDS (1 << CODE_PAGE_SHIFT)
+
+typedef struct {
+    uint64_t* bits;
+    Word nPages;
+} CodePages;
+
+typedef enum {
+    ENGINE_SWITCH,   // one big switch over M[IP], the reference engine
+    ENGINE_THREADED, // direct-threaded dispatch, needs GCC computed goto
+    ENGINE_DECODED,  // switch over the dense opcodes of the decoded program
+    ENGINE_TOS,      // threaded, with registers and top of stack in locals
+    ENGINE_JIT,      // x86-64 code per basic block, interprets the rest
+    ENGINE_TRACE,    // ENGINE_JIT plus native traces of hot loops
+} Engine;
+
+typedef struct {
+    uint64_t executed[N_OPS]; // dispatches per opcode
+} InterpretStats;
+
+typedef struct {
+    uint64_t traces;     // traces formed
+    uint64_t guardExits; // times a trace was left before closing its loop
+    uint64_t traced;     // words executed inside traces
+    uint64_t untraced;   // words executed outside of them
+} TraceStats;
 
 typedef struct {
     bool stepByStepInterpretation;
+    Engine engine;
+    bool noSuperinstructions; // run the decoded engines word by word
+    InterpretStats* stats;    // count dispatches if not NULL
+    TraceStats* traceStats;   // filled by ENGINE_TRACE if not NULL
 } InterpretParams;
 
+#if BIPCA_JIT
+typedef Word (*JitBlock)(void);
+
+// compiled code of ENGINE_JIT and ENGINE_TRACE, see _InterpretJit()
+typedef struct {
+    uint8_t* buffer;
+    size_t used;
+    JitBlock* blocks;     // blocks[addr - RESERVED] starts at addr
+    Word* blockEnd;       // first address after the block
+    uint8_t* unsupported; // the word at addr can't start a block
+    Word size;
+    Word codeWrite;       // address written by the last block or -1
+    JitBlock* traces;     // traces[addr - RESERVED] loops back to addr
+    int32_t* hot;         // backward jumps to addr, negative once given up
+    Word* traceWords;     // words of trace k from k * TRACE_MAX_WORDS
+    Word* traceHeads;
+    Word* traceLengths;
+    Word nTraces;
+    TraceStats stats;
+} JitState;
+#endif
+
+// Everything one program lives in: memory and registers, what the
+// translator builds, the loaded plugins and the engines' caches. The API
+// works on the VM active on the calling thread, bipcaDefaultVM unless
+// BipcaSetActiveVM() was called, and the VM* functions run on the VM
+// given to them. M, registers and the BIPCA_ names below are the
+// fields of the active VM.
+typedef struct BipcaVM {
+    Word* memory;          // size + 1 words, one guard word above the stack for ENGINE_TOS
+    Word size;             // memory words, SP starts here
+    Registers regs;
+    LineTable lineTable;
+    IdentMap idents;
+    SourceText source;
+    Word cursor;           // next word written by the translator
+    Word oldCursor;        // cursor when the current file was started
+    TranslationUnit* translationUnit; // file being translated, on the VMs of TranslateFromFiles()
+    int translateJobs;     // threads of TranslateFromFiles(), 0 for one per CPU
+    Lexer lexer;           // scanners of the translation
+    PluginSet pluginSet;
+    FILE* input;           // read by IN, stdin when NULL
+    FILE* output;          // written by OUT, stdout when NULL
+    DecodedProgram decodedProgram;
+    CodePages codePageSet;
+#if BIPCA_JIT
+    JitState jitState;
+#endif
+} BipcaVM;
+
+#if BIPCA_JIT
+#define BIPCA_JIT_INITIALIZER .jitState = {.codeWrite = -1},
+#else
+#define BIPCA_JIT_INITIALIZER
+#endif
+#define BIPCA_VM_INITIALIZER { \
+    .size = DEFAULT_SIZE, \
+    .regs = {.IP = RESERVED, .SP = DEFAULT_SIZE, .FP = UNDEF, .RV = UNDEF}, \
+    .cursor = RESERVED, \
+    .oldCursor = RESERVED, \
+    BIPCA_JIT_INITIALIZER \
+}
+
+BipcaVM bipcaDefaultVM = BIPCA_VM_INITIALIZER;
+_Thread_local BipcaVM* bipcaActiveVM = &bipcaDefaultVM;
+
+// Memory and registers of the active VM keep their old names, the rest of
+// it goes by BIPCA_ names, so that a local named lines or program in a
+// plugin stays a local. The short names are the implementation's only.
+#define M          (bipcaActiveVM->memory)
+#define SIZE       (bipcaActiveVM->size)
+#define registers  (bipcaActiveVM->regs)
+#define BIPCA_LINES   (bipcaActiveVM->lineTable)
+#define BIPCA_FILES   (bipcaActiveVM->lineTable.files)
+#define BIPCA_IDENTS  (bipcaActiveVM->idents)
+#define BIPCA_SOURCE  (bipcaActiveVM->source)
+#define BIPCA_PLUGINS (bipcaActiveVM->pluginSet)
+#define BIPCA_DECODED (bipcaActiveVM->decodedProgram)
+
 /*
 user-unfriendly API: if one wants to shoot themselves 
 in the leg, one very well could. Every function is a part
@@ -199,12 +639,25 @@ of a public API, so use them wisely
 */
 
 void PrintInstructionCoords(Word instructionIndex);
-size_t _Hash(char* str);
+void ResetLineTable(void);
+Error InternFile(const char* fileName);
+Error AddLineWord(Word address, Position pos);
+bool GetCoord(Word address, Coord* c);
+uint32_t _Hash(const char* key, size_t length);
+Error _InternIdent(const char* key, size_t length, IdentSlot** slot, bool* added);
+Error _NewIdent(const char* key, size_t length, IdentInfo value);
+bool _GetIdent(const char* key, size_t length, IdentInfo* value);
+void _ForgetIdent(const char* key, size_t length);
 Error NewIdent(const char* key, IdentInfo value);
 bool GetIdent(const char* key, IdentInfo* value);
+Error _CopyIdentMap(IdentMap* to, const IdentMap* from);
 void InitIdentMap(void);
 void ResetPosition(void);
+Position CurrentPosition(void);
+bool LexerFromName(const char* name, Lexer* lexer);
+const LexerScanners* GetLexerScanners(Lexer lexer);
 Error ReadProgram(const char *filename);
+void CloseProgram(void);
 bool IsDigit(char c);
 bool IsLetter(char c);
 bool IsAlphaNumeric(char c);
@@ -216,76 +669,320 @@ void ShowIdents(void);
 void _PrintLocationAndError();
 void _PrintError(void);
 void ReportError(Error err);
-void RestoreCurrentAfterFirstPass();
 Error ParseIdent(char* identBuffer);
-Error FirstPass(void);
+Error SinglePass(void);
+Error ResolveFixups(void);
 bool GetProgramSize(Word* ProgramSize);
-Error SecondPass(void);
 bool PrintProgram(void);
+Op DecodeWord(Word w);
+Instr DecodeInstr(Word w);
+void DecodeRange(Word from, Word to);
+Error DecodeProgram(void);
+typedef bool (*TailCallCheck)(Word entry, void* data);
+Error OptimizeProgram(int level, TailCallCheck canTailCall, void* data);
+void RedecodeWord(Word addr, Word* from, Word* to);
+const char* OpName(Op op);
+bool EmitC(FILE* out);
+bool EmitImage(FILE* out);
+bool LoadImage(const char* path);
+const char* _MapFile(const char* path, size_t* size);
+void _UnmapFile(const char* p, size_t size);
 bool TranslateProgram(void);
 bool TranslateFromFile(char *filename);
 bool TranslateFromFiles(int nFiles, char *filenames[]);
+bool TranslateFromFilesCached(int nFiles, char *filenames[], TranslationCache* cache);
 Error AddPlugin(Plugin* p);
 bool PLUGIN_INIT_DUMMY(void** addr);
 void PLUGIN_BEFORE_EXEC_DUMMY(void* addr, Command cmd);
 void PLUGIN_AFTER_EXEC_DUMMY(void* addr, Command cmd);
+bool EngineFromName(const char* name, Engine* engine);
+Word _InterpretSwitch(InterpretParams p);
+Word _InterpretThreaded(InterpretParams p);
+Word _InterpretDecoded(InterpretParams p);
+Word _InterpretTos(InterpretParams p);
+bool _InterpretStep(Word* result);
+bool ResetCodePages(Word size);
+void MarkCodePages(Word from, Word to);
+bool IsCodePage(Word addr);
+void _JitCodeWrite(Word addr);
+Word _InterpretJit(InterpretParams p);
 Word Interpret(InterpretParams p);
+void PrintDispatchReport(const InterpretStats* stats);
+void PrintTraceReport(const TraceStats* stats);
+BipcaVM* BipcaActiveVM(void);
+BipcaVM* BipcaSetActiveVM(BipcaVM* vm);
+BipcaVM* NewVM(void);
+void FreeVM(BipcaVM* vm);
+bool VMTranslateFromFiles(BipcaVM* vm, int nFiles, char *filenames[]);
+Word VMInterpret(BipcaVM* vm, InterpretParams p);
+Error VMAddPlugin(BipcaVM* vm, Plugin* p);
+Error VMNewIdent(BipcaVM* vm, const char* key, IdentInfo value);
+bool VMGetIdent(BipcaVM* vm, const char* key, IdentInfo* value);
+void VMInitIdentMap(BipcaVM* vm);
+Error SetMemorySize(Word words);
+Error VMSetMemorySize(BipcaVM* vm, Word words);
+Error VMLoadProgram(BipcaVM* vm, const BipcaVM* from);
+void _ZeroWords(Word* words, size_t n);
+void VMRestart(BipcaVM* vm, const BipcaVM* from);
 
 #endif // BIPCA_H
 
 #ifdef BIPCA_IMPLEMENTATION
 #undef BIPCA_IMPLEMENTATION
 
+#define lines      BIPCA_LINES
+#define files      BIPCA_FILES
+#define identMap   BIPCA_IDENTS
+#define program    BIPCA_SOURCE
+#define current    (bipcaActiveVM->cursor)
+#define oldCurrent (bipcaActiveVM->oldCursor)
+#define unit       (bipcaActiveVM->translationUnit)
+#define plugins    BIPCA_PLUGINS
+#define decoded    BIPCA_DECODED
+#define codePages  (bipcaActiveVM->codePageSet)
+#define jit        (bipcaActiveVM->jitState)
+#define vmStdin    (bipcaActiveVM->input ? bipcaActiveVM->input : stdin)
+#define vmStdout   (bipcaActiveVM->output ? bipcaActiveVM->output : stdout)
+
 void PrintInstructionCoords(Word instructionIndex) {
-    Coord c = coords[instructionIndex];
+    Coord c;
+    if (!GetCoord(instructionIndex, &c)) {
+        printf(TEXT_BOLD("<no source>: "));
+        return;
+    }
     printf(TEXT_BOLD("%s:%zu:%zu: "), files[c.filenameIndex], c.pos.row + 1, c.pos.col + 1);
 }
 
-size_t _Hash(char* str) {
-    size_t hash = 5381;
-    int c;
-    while ((c = (int) *str++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-    return hash % MAX_N_IDENT;
+// forgets the rows, files stay interned
+void ResetLineTable(void) {
+    lines.nRows = 0;
+    lines.nCols = 0;
+    lines.end = 0;
+    lines.lastCol = 0;
 }
 
-Error NewIdent(const char* key, IdentInfo value) {
-    size_t idx = _Hash((char*)key);
-    size_t original_idx = idx;
-    
-    while (identMap.table[idx].occupied) {
-        if (strcmp(identMap.table[idx].key, key) == 0) {
-            identMap.table[idx].value = value;
+// makes fileName the file of the words added next
+Error InternFile(const char* fileName) {
+    for (size_t i = 0; i < lines.nFiles; i++) {
+        if (strcmp(files[i], fileName) == 0) {
+            lines.file = i;
             return NO_ERROR;
         }
-        idx = (idx + 1) % MAX_N_IDENT;
-        if (idx == original_idx) {
-            return ERR_TOO_MANY_IDENTS;
+    }
+    if (lines.nFiles >= MAX_N_FILES) return ERR_TOO_MANY_FILES;
+    strncpy(files[lines.nFiles], fileName, MAX_FILENAME_LENGTH);
+    files[lines.nFiles][MAX_FILENAME_LENGTH] = '\0';
+    lines.file = lines.nFiles++;
+    return NO_ERROR;
+}
+
+// records that the word at address comes from pos of the current file
+Error AddLineWord(Word address, Position pos) {
+    LineRow* last = lines.nRows ? &lines.rows[lines.nRows - 1] : NULL;
+    if (!last || address != lines.end || last->file != lines.file || last->row != pos.row) {
+        if (lines.nRows == lines.rowCapacity) {
+            size_t capacity = lines.rowCapacity ? 2 * lines.rowCapacity : 1024;
+            LineRow* rows = (LineRow*) realloc(lines.rows, capacity * sizeof(LineRow));
+            if (!rows) return ERR_OUT_OF_MEMORY;
+            lines.rows = rows;
+            lines.rowCapacity = capacity;
         }
+        lines.rows[lines.nRows++] = (LineRow) {
+            .address = address,
+            .file = (uint16_t) lines.file,
+            .row = (uint32_t) pos.row,
+            .colIndex = (uint32_t) lines.nCols,
+        };
+        lines.lastCol = 0;
     }
-    strncpy(identMap.table[idx].key, key, MAX_IDENT_LENGTH);
-    identMap.table[idx].key[MAX_IDENT_LENGTH] = '\0';
-    identMap.table[idx].value = value;
-    identMap.table[idx].occupied = 1;
+    if (lines.nCols + 10 > lines.colCapacity) {
+        size_t capacity = lines.colCapacity ? 2 * lines.colCapacity : 4096;
+        uint8_t* cols = (uint8_t*) realloc(lines.cols, capacity);
+        if (!cols) return ERR_OUT_OF_MEMORY;
+        lines.cols = cols;
+        lines.colCapacity = capacity;
+    }
+    size_t delta = pos.col - lines.lastCol;
+    while (delta >= 0x80) {
+        lines.cols[lines.nCols++] = (uint8_t) (delta | 0x80);
+        delta >>= 7;
+    }
+    lines.cols[lines.nCols++] = (uint8_t) delta;
+    lines.lastCol = pos.col;
+    lines.end = address + 1;
     return NO_ERROR;
 }
 
-// to just check for the occurence pass NULL as a value
-bool GetIdent(const char* key, IdentInfo* value) {
-    size_t idx = _Hash((char*) key);
-    size_t original_idx = idx;
-    
-    while (identMap.table[idx].occupied) {
-        if (strcmp(identMap.table[idx].key, key) == 0) {
-            if (value != NULL) { *value = identMap.table[idx].value; }
-            return true;
+// Where the word at address was translated from: a binary search for its
+// row, then the column deltas of the row up to the word. Returns false
+// for words the translator did not write.
+bool GetCoord(Word address, Coord* c) {
+    if (lines.nRows == 0 || address < lines.rows[0].address || address >= lines.end) {
+        return false;
+    }
+    size_t low = 0, high = lines.nRows;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (lines.rows[mid].address <= address) low = mid;
+        else high = mid;
+    }
+    const LineRow* row = &lines.rows[low];
+    Word rowEnd = low + 1 < lines.nRows ? lines.rows[low + 1].address : lines.end;
+    if (address >= rowEnd) return false;
+    const uint8_t* p = lines.cols + row->colIndex;
+    size_t col = 0;
+    for (Word i = row->address; i <= address; i++) {
+        size_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = *p++;
+            delta |= (size_t) (byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        col += delta;
+    }
+    *c = (Coord) {.pos = {.row = row->row, .col = col}, .filenameIndex = row->file};
+    return true;
+}
+
+// FNV-1a, never 0 that marks empty slots
+uint32_t _Hash(const char* key, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// slot of key, or the empty one it would go to
+static size_t _IdentSlot(const char* key, size_t length, uint32_t hash) {
+    size_t mask = identMap.capacity - 1;
+    size_t idx = hash & mask;
+    while (identMap.table[idx].hash) {
+        const IdentSlot* slot = &identMap.table[idx];
+        if (slot->hash == hash && slot->length == length
+            && memcmp(identMap.arena + slot->key, key, length) == 0) {
+            return idx;
         }
-        idx = (idx + 1) % MAX_N_IDENT;
-        if (idx == original_idx) {
-            break;
+        idx = (idx + 1) & mask;
+    }
+    return idx;
+}
+
+// makes room for n idents in all, rehashing at most once
+static Error _ReserveIdents(size_t n) {
+    size_t capacity = identMap.capacity ? identMap.capacity : IDENT_MIN_CAPACITY;
+    while (n * 100 > capacity * IDENT_MAX_LOAD_PERCENT) capacity *= 2;
+    if (capacity == identMap.capacity) return NO_ERROR;
+    IdentSlot* table = (IdentSlot*) calloc(capacity, sizeof(IdentSlot));
+    if (!table) return ERR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < identMap.capacity; i++) {
+        if (!identMap.table[i].hash) continue;
+        size_t idx = identMap.table[i].hash & (capacity - 1);
+        while (table[idx].hash) idx = (idx + 1) & (capacity - 1);
+        table[idx] = identMap.table[i];
+    }
+    free(identMap.table);
+    identMap.table = table;
+    identMap.capacity = capacity;
+    return NO_ERROR;
+}
+
+// Slot of key, added with a zeroed value if it was not there, so that a
+// definition checks for an earlier one in the same probe.
+Error _InternIdent(const char* key, size_t length, IdentSlot** slot, bool* added) {
+    Error err = _ReserveIdents(identMap.size + 1);
+    if (err) return err;
+    uint32_t hash = _Hash(key, length);
+    *slot = &identMap.table[_IdentSlot(key, length, hash)];
+    *added = !(*slot)->hash;
+    if (!*added) return NO_ERROR;
+    if (identMap.arenaSize + length + 1 > UINT32_MAX) return ERR_TOO_MANY_IDENTS;
+    if (identMap.arenaSize + length + 1 > identMap.arenaCapacity) {
+        size_t capacity = identMap.arenaCapacity ? 2 * identMap.arenaCapacity : 4096;
+        while (identMap.arenaSize + length + 1 > capacity) capacity *= 2;
+        char* arena = (char*) realloc(identMap.arena, capacity);
+        if (!arena) return ERR_OUT_OF_MEMORY;
+        identMap.arena = arena;
+        identMap.arenaCapacity = capacity;
+    }
+    memcpy(identMap.arena + identMap.arenaSize, key, length);
+    identMap.arena[identMap.arenaSize + length] = '\0';
+    **slot = (IdentSlot) {
+        .hash = hash,
+        .key = (uint32_t) identMap.arenaSize,
+        .length = (uint32_t) length,
+    };
+    identMap.arenaSize += length + 1;
+    identMap.size++;
+    return NO_ERROR;
+}
+
+Error _NewIdent(const char* key, size_t length, IdentInfo value) {
+    IdentSlot* slot;
+    bool added;
+    Error err = _InternIdent(key, length, &slot, &added);
+    if (err) return err;
+    slot->value = value;
+    return NO_ERROR;
+}
+
+bool _GetIdent(const char* key, size_t length, IdentInfo* value) {
+    if (!identMap.capacity) return false;
+    const IdentSlot* slot = &identMap.table[_IdentSlot(key, length, _Hash(key, length))];
+    if (!slot->hash) return false;
+    if (value != NULL) { *value = slot->value; }
+    return true;
+}
+
+// Removes key, shifting back the slots that probed past it. Its bytes
+// stay in the arena.
+void _ForgetIdent(const char* key, size_t length) {
+    if (!identMap.capacity) return;
+    size_t mask = identMap.capacity - 1;
+    size_t hole = _IdentSlot(key, length, _Hash(key, length));
+    if (!identMap.table[hole].hash) return;
+    for (size_t j = (hole + 1) & mask; identMap.table[j].hash; j = (j + 1) & mask) {
+        size_t home = identMap.table[j].hash & mask;
+        // j can fill the hole if the hole lies on its probe from home
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            identMap.table[hole] = identMap.table[j];
+            hole = j;
         }
     }
-    return false; 
+    identMap.table[hole].hash = 0;
+    identMap.size--;
+}
+
+// keys longer than MAX_IDENT_LENGTH are cut, as the lexer does
+Error NewIdent(const char* key, IdentInfo value) {
+    size_t length = strlen(key);
+    if (length > MAX_IDENT_LENGTH) length = MAX_IDENT_LENGTH;
+    return _NewIdent(key, length, value);
+}
+
+// to just check for the occurence pass NULL as a value
+bool GetIdent(const char* key, IdentInfo* value) {
+    size_t length = strlen(key);
+    if (length > MAX_IDENT_LENGTH) length = MAX_IDENT_LENGTH;
+    return _GetIdent(key, length, value);
+}
+
+Error _CopyIdentMap(IdentMap* to, const IdentMap* from) {
+    IdentSlot* table = (IdentSlot*) realloc(to->table, (from->capacity + 1) * sizeof(IdentSlot));
+    if (table) to->table = table;
+    char* arena = (char*) realloc(to->arena, from->arenaSize + 1);
+    if (arena) to->arena = arena;
+    if (!table || !arena) return ERR_OUT_OF_MEMORY;
+    if (from->capacity) memcpy(table, from->table, from->capacity * sizeof(IdentSlot));
+    if (from->arenaSize) memcpy(arena, from->arena, from->arenaSize);
+    *to = *from;
+    to->table = table;
+    to->arena = arena;
+    to->arenaCapacity = from->arenaSize + 1;
+    return NO_ERROR;
 }
 
 #define ADD_KEYWORD_IDENT(cmd) \
@@ -342,42 +1039,62 @@ void InitIdentMap(void) {
 }
 
 void ResetPosition(void) {
-    program.position = (Position) {0, 0};
     program.observed = 0;
+    program.row = 0;
+    program.lineStart = 0;
+}
+
+Position CurrentPosition(void) {
+    return (Position) {.row = program.row, .col = program.observed - program.lineStart};
+}
+
+// places observed at pos, which is where it is in the text
+static void _SetPosition(Position pos) {
+    program.row = pos.row;
+    program.lineStart = program.observed - pos.col;
 }
 
+// Maps filename read-only and lexes it in place, the text stays mapped
+// until CloseProgram() or the next file
 Error ReadProgram(const char *filename) {
     if (strlen(filename) > MAX_FILENAME_LENGTH) {
         return ERR_FILENAME_TOO_LONG;
     }
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        return ERR_CANT_READ_FILE;
-    }
-
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    rewind(file);
-
-    if (fileSize > PROGRAM_TEXT_SIZE) {
+    CloseProgram();
+    size_t size = 0;
+    const char* text = _MapFile(filename, &size);
+    if (!text) {
+        // nothing to map in an empty file
+        FILE* file = fopen(filename, "r");
+        if (!file) {
+            return ERR_CANT_READ_FILE;
+        }
+        bool empty = fgetc(file) == EOF;
         fclose(file);
-        return ERR_PROGRAM_TOO_LONG;
+        if (!empty) return ERR_CANT_READ_FILE;
     }
-
-    program.size = fread(program.text, 1, fileSize, file);
-    fclose(file);
+    program.text = text;
+    program.size = size;
 
     strncpy(program.fileName, filename, MAX_FILENAME_LENGTH);
     program.fileName[MAX_FILENAME_LENGTH] = '\0';
 
+    program.scan = GetLexerScanners(bipcaActiveVM->lexer);
     program.observed = 0;
-    program.position.row = 0;
-    program.position.col = 0;
+    program.row = 0;
+    program.lineStart = 0;
 
     return NO_ERROR;
 }
 
+void CloseProgram(void) {
+    if (program.text) _UnmapFile(program.text, program.size);
+    program.text = NULL;
+    program.size = 0;
+    ResetPosition();
+}
+
 bool IsDigit(char c) { return c >= '0' && c <= '9'; }
 bool IsLetter(char c) { 
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
@@ -391,55 +1108,213 @@ bool IsAllowedChar(char c) {
            || c == '+'
            || c == '-'
            || c == '_'
+           || c == '='
            || c == ';';
 }
 char CurrentChar() { return program.text[program.observed]; }
 
-void SkipUnnecessary() {
-    bool IndexChanged = true; 
-    while (program.observed < program.size && IndexChanged) {
-        IndexChanged = false;
-        // skip whitespaces
-        while (
-            program.observed < program.size
-            && IsWhitespace(CurrentChar())
-        ) {
-            if (CurrentChar() == '\n') {
-                program.position.row++;
-                program.position.col = 0;
-            } else {
-                program.position.col++;
-            }
-            IndexChanged = true;
-            program.observed++;
+static bool _IsIdentChar(char c) { return IsAlphaNumeric(c) || c == '-' || c == '_'; }
+
+// moves *row and *lineStart over the newlines of mask, bit k for text[i + k]
+static inline void _CountNewlines(uint32_t mask, size_t i, size_t* row, size_t* lineStart) {
+    if (!mask) return;
+    *row += (size_t) __builtin_popcount(mask);
+    *lineStart = i + 32 - (size_t) __builtin_clz(mask);
+}
+
+static size_t _SkipBlankScalar(const char* text, size_t i, size_t size, size_t* row, size_t* lineStart) {
+    for (; i < size && IsWhitespace(text[i]); i++) {
+        if (text[i] == '\n') {
+            (*row)++;
+            *lineStart = i + 1;
         }
+    }
+    return i;
+}
 
-        if (program.observed >= program.size) { return; }
+static size_t _SkipLineScalar(const char* text, size_t i, size_t size) {
+    while (i < size && text[i] != '\n') i++;
+    return i;
+}
 
-        // skip comments
-        if (CurrentChar() == ';') {
-            while (
-                program.observed < program.size
-                &&
-                CurrentChar() != '\n'
-            ) {
-                program.observed++;
-            }
-            program.observed++;
-            program.position.row++;
-            program.position.col = 0;
-            IndexChanged = true;
+static size_t _SkipIdentScalar(const char* text, size_t i, size_t size) {
+    while (i < size && _IsIdentChar(text[i])) i++;
+    return i;
+}
+
+static const LexerScanners _scalarScanners = {
+    "scalar", _SkipBlankScalar, _SkipLineScalar, _SkipIdentScalar,
+};
+
+#if BIPCA_SIMD_LEXER
+// The vector scanners classify a block of bytes into a bit mask and stop
+// at its lowest clear bit, the tail shorter than a block goes to the
+// scalar ones. Bytes above 0x7f are negative to the signed compares, so
+// they are never letters or digits.
+//
+// The AVX2 ones clear the upper halves before they leave, the rest of
+// the program is legacy SSE code that would stall on them.
+//
+// Most blanks between tokens and most tokens are a few bytes, so the
+// first LEXER_PROBE of them are looked at one by one before any block.
+#define LEXER_PROBE 4
+
+static inline size_t _ProbeEnd(size_t i, size_t size) {
+    return size - i > LEXER_PROBE ? i + LEXER_PROBE : size;
+}
+#define BIPCA_LEX_BLANK(P, B, v) \
+    P##_or_si##B(P##_or_si##B(P##_cmpeq_epi8(v, P##_set1_epi8(' ')), \
+                              P##_cmpeq_epi8(v, P##_set1_epi8('\t'))), \
+                 P##_cmpeq_epi8(v, P##_set1_epi8('\n')))
+#define BIPCA_LEX_RANGE(P, B, v, lo, hi) \
+    P##_and_si##B(P##_cmpgt_epi8(v, P##_set1_epi8((lo) - 1)), \
+                  P##_cmpgt_epi8(P##_set1_epi8((hi) + 1), v))
+// setting 0x20 maps the capitals onto the small letters and nothing else
+#define BIPCA_LEX_IDENT(P, B, v) \
+    P##_or_si##B( \
+        P##_or_si##B(BIPCA_LEX_RANGE(P, B, P##_or_si##B(v, P##_set1_epi8(0x20)), 'a', 'z'), \
+                     BIPCA_LEX_RANGE(P, B, v, '0', '9')), \
+        P##_or_si##B(P##_cmpeq_epi8(v, P##_set1_epi8('_')), \
+                     P##_cmpeq_epi8(v, P##_set1_epi8('-'))))
+
+static size_t _SkipBlankSse2(const char* text, size_t i, size_t size, size_t* row, size_t* lineStart) {
+    size_t end = _ProbeEnd(i, size);
+    i = _SkipBlankScalar(text, i, end, row, lineStart);
+    if (i < end || i == size) return i;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (text + i));
+        uint32_t newlines = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        uint32_t stop = ~(uint32_t) _mm_movemask_epi8(BIPCA_LEX_BLANK(_mm, 128, v)) & 0xffff;
+        if (stop) {
+            uint32_t at = (uint32_t) __builtin_ctz(stop);
+            _CountNewlines(newlines & ((1u << at) - 1), i, row, lineStart);
+            return i + at;
+        }
+        _CountNewlines(newlines, i, row, lineStart);
+    }
+    return _SkipBlankScalar(text, i, size, row, lineStart);
+}
+
+static size_t _SkipLineSse2(const char* text, size_t i, size_t size) {
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (text + i));
+        uint32_t newlines = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        if (newlines) return i + (size_t) __builtin_ctz(newlines);
+    }
+    return _SkipLineScalar(text, i, size);
+}
+
+static size_t _SkipIdentSse2(const char* text, size_t i, size_t size) {
+    size_t end = _ProbeEnd(i, size);
+    i = _SkipIdentScalar(text, i, end);
+    if (i < end || i == size) return i;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (text + i));
+        uint32_t stop = ~(uint32_t) _mm_movemask_epi8(BIPCA_LEX_IDENT(_mm, 128, v)) & 0xffff;
+        if (stop) return i + (size_t) __builtin_ctz(stop);
+    }
+    return _SkipIdentScalar(text, i, size);
+}
+
+__attribute__((target("avx2")))
+static size_t _SkipBlankAvx2(const char* text, size_t i, size_t size, size_t* row, size_t* lineStart) {
+    size_t end = _ProbeEnd(i, size);
+    i = _SkipBlankScalar(text, i, end, row, lineStart);
+    if (i < end || i == size) return i;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (text + i));
+        uint32_t newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(BIPCA_LEX_BLANK(_mm256, 256, v));
+        if (stop) {
+            uint32_t at = (uint32_t) __builtin_ctz(stop);
+            _CountNewlines(newlines & ((1u << at) - 1), i, row, lineStart);
+            return i + at;
         }
+        _CountNewlines(newlines, i, row, lineStart);
+    }
+    _mm256_zeroupper();
+    return _SkipBlankScalar(text, i, size, row, lineStart);
+}
+
+__attribute__((target("avx2")))
+static size_t _SkipLineAvx2(const char* text, size_t i, size_t size) {
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (text + i));
+        uint32_t newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        if (newlines) return i + (size_t) __builtin_ctz(newlines);
+    }
+    _mm256_zeroupper();
+    return _SkipLineScalar(text, i, size);
+}
+
+__attribute__((target("avx2")))
+static size_t _SkipIdentAvx2(const char* text, size_t i, size_t size) {
+    size_t end = _ProbeEnd(i, size);
+    i = _SkipIdentScalar(text, i, end);
+    if (i < end || i == size) return i;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (text + i));
+        uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(BIPCA_LEX_IDENT(_mm256, 256, v));
+        if (stop) return i + (size_t) __builtin_ctz(stop);
+    }
+    _mm256_zeroupper();
+    return _SkipIdentScalar(text, i, size);
+}
+
+static const LexerScanners _sse2Scanners = {
+    "sse2", _SkipBlankSse2, _SkipLineSse2, _SkipIdentSse2,
+};
+static const LexerScanners _avx2Scanners = {
+    "avx2", _SkipBlankAvx2, _SkipLineAvx2, _SkipIdentAvx2,
+};
+#endif // BIPCA_SIMD_LEXER
+
+const LexerScanners* GetLexerScanners(Lexer lexer) {
+#if BIPCA_SIMD_LEXER
+    if ((lexer == LEXER_AUTO || lexer == LEXER_AVX2) && __builtin_cpu_supports("avx2")) {
+        return &_avx2Scanners;
+    }
+    if (lexer != LEXER_SCALAR) return &_sse2Scanners;
+#else
+    (void) lexer;
+#endif
+    return &_scalarScanners;
+}
+
+bool LexerFromName(const char* name, Lexer* lexer) {
+    if (strcmp(name, "auto") == 0) {
+        *lexer = LEXER_AUTO;
+    } else if (strcmp(name, "scalar") == 0) {
+        *lexer = LEXER_SCALAR;
+    } else if (strcmp(name, "sse2") == 0) {
+        *lexer = LEXER_SSE2;
+    } else if (strcmp(name, "avx2") == 0) {
+        *lexer = LEXER_AVX2;
+    } else {
+        return true;
+    }
+    return false;
+}
+
+void SkipUnnecessary() {
+    const LexerScanners* scan = program.scan;
+    while (program.observed < program.size) {
+        program.observed = scan->SkipBlank(program.text, program.observed, program.size,
+                                           &program.row, &program.lineStart);
+        if (program.observed >= program.size || CurrentChar() != ';') return;
+        // a comment runs to the end of the line
+        program.observed = scan->SkipLine(program.text, program.observed, program.size);
     }
 }
 
 void ShowIdents(void) {
-    for (size_t i = 0; i < MAX_N_IDENT; i++) {
-        if (identMap.table[i].occupied) {
-            printf("Ident: %s\n", identMap.table[i].key);
+    for (size_t i = 0; i < identMap.capacity; i++) {
+        if (identMap.table[i].hash) {
+            printf("Ident: %s\n", identMap.arena + identMap.table[i].key);
             printf(
                 "%s\n",
-                identMap.table[i].value.isUserDefined ? "User defined" : "Keyword");
+                identMap.table[i].value.isConstant ? "Constant"
+                : identMap.table[i].value.isUserDefined ? "User defined" : "Keyword");
             printf(
                 "Defined at %s:%zu:%zu\n", 
                 program.fileName,
@@ -452,8 +1327,8 @@ void ShowIdents(void) {
 }
 
 void _PrintLocationAndError() {
-    fprintf(stderr, TEXT_BOLD("%s:%zu:%zu: "), 
-            program.fileName, program.position.row + 1, program.position.col + 1);
+    Position pos = CurrentPosition();
+    fprintf(stderr, TEXT_BOLD("%s:%zu:%zu: "), program.fileName, pos.row + 1, pos.col + 1);
     fprintf(stderr, TEXT_BOLD_RED("error: "));
 }
 
@@ -461,6 +1336,11 @@ void _PrintError(void) {
     fprintf(stderr, TEXT_BOLD_RED("error: "));
 }
 
+// the text is not terminated, reads outside of it see whitespace
+static bool _IsBlankAt(size_t i) {
+    return i >= program.size || IsWhitespace(program.text[i]);
+}
+
 void ReportError(Error err) {
     // When error occured position may point to the: 
     // 1) first whitespace after the lexem;
@@ -477,24 +1357,26 @@ void ReportError(Error err) {
     size_t wordStart = program.observed;
     size_t wordEnd = program.observed;
     // seek left to start 
-    if (IsWhitespace(program.text[program.observed])) {
+    if (_IsBlankAt(program.observed)) {
         wordStart--;
     }
-    while (!IsWhitespace(program.text[wordStart])) {
+    while (!_IsBlankAt(wordStart)) {
         wordStart--;
     }
     wordStart++;
 
     // seek to the right or decrement right pos
-    if (IsWhitespace(program.text[program.observed])) {
+    if (_IsBlankAt(program.observed)) {
         wordEnd--;
     }
-    while (!IsWhitespace(program.text[wordEnd])) {
+    while (!_IsBlankAt(wordEnd)) {
         wordEnd++;
     }
     wordEnd--;
+    // a blank run, nothing to underline past the caret
+    if (wordEnd < wordStart) wordEnd = wordStart;
 
-    size_t start = program.observed - program.position.col;
+    size_t start = program.lineStart;
     size_t end = program.observed;
     while (
         end < program.size &&
@@ -515,6 +1397,22 @@ void ReportError(Error err) {
         _PrintError();
         fprintf(stderr, "too many plugins (limit is %d)\n", N_MAX_PLUGINS);
         break;
+    case ERR_OUT_OF_MEMORY:
+        _PrintError();
+        fprintf(stderr, "out of memory\n");
+        return;
+    case ERR_BAD_IMAGE:
+        _PrintError();
+        fprintf(stderr, "not a program image of version %d\n", IMAGE_VERSION);
+        return;
+    case ERR_TOO_MANY_FILES:
+        _PrintError();
+        fprintf(stderr, "too many files (limit is %d)\n", MAX_N_FILES);
+        return;
+    case ERR_PROGRAM_TOO_BIG:
+        _PrintError();
+        fprintf(stderr, "program does not fit in memory (limit is %d words)\n", SIZE);
+        return;
     case ERR_UNEXPECTED_CHARACTER:
         _PrintLocationAndError();
         fprintf(stderr, "unexpected character\n");
@@ -527,10 +1425,6 @@ void ReportError(Error err) {
         _PrintLocationAndError();
         fprintf(stderr, "empty label\n");
         break;
-    case ERR_PROGRAM_TOO_LONG:
-        _PrintError();
-        fprintf(stderr, "file size is too big (limit is %d KiB)\n", PROGRAM_TEXT_SIZE/1024);
-        break;
     case ERR_FILENAME_TOO_LONG:
         _PrintError();
         fprintf(stderr, "filename is too long (limit is %d)\n", MAX_FILENAME_LENGTH);
@@ -559,22 +1453,22 @@ void ReportError(Error err) {
         _PrintLocationAndError();
         fprintf(stderr, "number constant exceeds 32-bit limit (%d)\n", INT32_MAX);
         break;
+    case ERR_NOT_CONSTANT:
+        _PrintLocationAndError();
+        fprintf(stderr, "constant expression expected, labels and idents defined later are not\n");
+        break;
     default:
         _PrintError();
         fprintf(stderr, "error\n");
         return;
     }
-    fprintf(stderr, "%5zu | %.*s\n", program.position.row + 1, (int) (end - start), program.text + start);
-    fprintf(stderr, "      | " "%*s", (int) (program.position.col - (program.observed - wordStart)), "");
+    fprintf(stderr, "%5zu | %.*s\n", program.row + 1, (int) (end - start), program.text + start);
+    fprintf(stderr, "      | " "%*s", (int) (wordStart - start), "");
     fprintf(stderr, TEXT_BOLD_RED("^"));
     for (size_t i = 0; i < wordEnd - wordStart; i++) fprintf(stderr, TEXT_BOLD_RED("~"));
     fprintf(stderr, "\n");
 }
 
-void RestoreCurrentAfterFirstPass() {
-    current = oldCurrent;
-}
-
 Error ParseIdent(char* identBuffer) {
     if (!(program.observed < program.size) || IsWhitespace(CurrentChar())) {
         return ERR_EMPTY_LABEL;
@@ -585,186 +1479,250 @@ Error ParseIdent(char* identBuffer) {
     if (!IsLetter(CurrentChar()) && !(CurrentChar() == '_')) {
         return ERR_UNEXPECTED_CHARACTER;
     }
-    size_t idx = 0;
-    identBuffer[idx] = CurrentChar();
-    idx++;
-    program.observed++;
-    program.position.col++;
-    while (
-        program.observed < program.size
-        &&
-        idx < MAX_IDENT_LENGTH + 1
-        &&
-        (IsAlphaNumeric(CurrentChar())
-        || CurrentChar() == '-'
-        || CurrentChar() == '_')
-    ) {
-        identBuffer[idx] = CurrentChar();
-        idx++;
-        program.observed++;
-        program.position.col++;
-    } 
-    if (idx == MAX_IDENT_LENGTH + 1) return ERR_IDENT_TOO_LONG;
-    identBuffer[idx] = '\0';
+    size_t start = program.observed;
+    // one byte past the limit tells a too long ident
+    size_t limit = program.size - start > MAX_IDENT_LENGTH + 1 ? start + MAX_IDENT_LENGTH + 1 : program.size;
+    program.observed = program.scan->SkipIdent(program.text, start + 1, limit);
+    size_t length = program.observed - start;
+    if (length == MAX_IDENT_LENGTH + 1) return ERR_IDENT_TOO_LONG;
+    memcpy(identBuffer, program.text + start, length);
+    identBuffer[length] = '\0';
     return NO_ERROR;
 }
 
-Error FirstPass(void) {
-    char ident[MAX_IDENT_LENGTH + 1];
-    Error err = NO_ERROR;
-    IdentInfo identInfo = {0};
-    while (program.observed < program.size) {
-        SkipUnnecessary();
-        if (program.observed >= program.size) {
-            break;
+// doubles the capacity of *list of itemSize items, true if out of memory
+static bool _Grow(void** list, size_t* capacity, size_t itemSize) {
+    size_t grown = *capacity ? 2 * *capacity : 1024;
+    void* p = realloc(*list, grown * itemSize);
+    if (!p) return true;
+    *list = p;
+    *capacity = grown;
+    return false;
+}
+
+// writes w at current, the program is found too big by the link
+static Error _EmitWord(Word w, Position pos) {
+    if (current < SIZE) {
+        if ((size_t) current == unit->wordCapacity
+            && _Grow((void**) &unit->words, &unit->wordCapacity, sizeof(Word))) {
+            return ERR_OUT_OF_MEMORY;
         }
+        unit->words[current] = w;
+        Error err = AddLineWord(current, pos);
+        if (err) return err;
+    }
+    current++;
+    return NO_ERROR;
+}
 
-        // label
-        if (CurrentChar() == ':') {
-            Position identPos = program.position;
-            program.observed++;
-            program.position.col++;
-            err = ParseIdent(ident);
-            if (err) return err;
-            if (GetIdent(ident, &identInfo)) {
-                return identInfo.isUserDefined 
-                       ? ERR_LABEL_REDEFINITION
-                       : ERR_KEYWORD_REDEFINITION;
-            }
+// a fixup of the word at current named by the text before observed,
+// NULL if out of memory
+static Fixup* _AddFixup(Fixups* to, Position pos, size_t length) {
+    if (to->size == to->capacity && _Grow((void**) &to->list, &to->capacity, sizeof(Fixup))) {
+        return NULL;
+    }
+    to->list[to->size] = (Fixup) {
+        .address = current,
+        .length = (uint32_t) length,
+        .observed = program.observed,
+        .position = pos,
+    };
+    return &to->list[to->size++];
+}
 
-            NewIdent(ident, (IdentInfo) {
-                .isUserDefined = true,
-                .address = current,
-                .position = identPos,
-            });
-            // LOG_INFO("%d\n", program.observed);
-            continue;
-        }
+// the word at offset holds a label of the file, the link adds the base,
+// or takes it off for a negative one
+static Error _AddRelocation(Word offset, bool negative) {
+    if (unit->nRelocations == unit->relocationCapacity
+        && _Grow((void**) &unit->relocations, &unit->relocationCapacity, sizeof(Word))) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    unit->relocations[unit->nRelocations++] = negative ? ~offset : offset;
+    return NO_ERROR;
+}
 
-        // number
-        if (
-            CurrentChar() == '-'
-            || CurrentChar() == '+'
-            || IsDigit(CurrentChar())
-        ) {
-            current++;
+static const char* _FixupName(const char* text, Fixup f) {
+    return text + f.observed - f.length;
+}
+
+// adds the value of f to the word at *w, true if the sum leaves the Word range
+static bool _ApplyFixup(Word* w, Fixup f, Word value) {
+    int64_t sum = f.negative ? (int64_t) *w - value : (int64_t) *w + value;
+    *w = (Word) (uint32_t) sum;
+    return sum < INT32_MIN || sum > INT32_MAX;
+}
+
+// Reads the expression at observed into *value: numbers and idents, each
+// after the first one after a '+' or '-' and maybe another '-'. A '-'
+// right after an ident is a part of it, so label minus 2 is label+-2.
+// A lone sign is 0, as it always was. The idents not defined yet are left
+// in unit->externs for the word at current. A constant takes numbers,
+// keywords and constants defined before it, those of the files before it
+// too: its idents the file does not know go to unit->constants for the
+// link, under the index its label will have.
+static Error _ParseExpression(bool constant, Word* value) {
+    char ident[MAX_IDENT_LENGTH + 1];
+    size_t start = program.observed;
+    Position startPos = CurrentPosition();
+    size_t nExterns = unit->externs.size;
+    size_t nConstants = unit->constants.size;
+    size_t nRelocations = unit->nRelocations;
+    int64_t sum = 0;
+    Error err = NO_ERROR;
+    while (!err) {
+        size_t termStart = program.observed;
+        bool negative = false;
+        if (program.observed < program.size && (CurrentChar() == '-' || CurrentChar() == '+')) {
+            negative = CurrentChar() == '-';
             program.observed++;
-            program.position.col++;
-            if (CurrentChar() == '-') current++;
-            while (program.observed < program.size && IsDigit(CurrentChar())) {
+            if (termStart > start && program.observed < program.size && CurrentChar() == '-') {
+                negative = !negative;
                 program.observed++;
-                program.position.col++;
             }
-            if (!(program.observed == program.size) && !IsWhitespace(CurrentChar())) {
-                return ERR_UNEXPECTED_CHARACTER;
-            }
-            continue;
         }
-
-        // ident
-        if (
-            IsLetter(CurrentChar())
-            || CurrentChar() == '_'
-        ) {
-            current++;
+        if (_IsBlankAt(program.observed)) {
+            if (termStart == start && program.observed == start + 1) break;
+            err = ERR_UNEXPECTED_CHARACTER;
+            break;
+        }
+        if (IsDigit(CurrentChar())) {
+            uint32_t number = 0;
+            while (program.observed < program.size && IsDigit(CurrentChar())) {
+                uint32_t digit = (uint32_t) (CurrentChar() - '0');
+                if (number > (INT32_MAX - digit) / 10) {
+                    err = ERR_NUMBER_TOO_BIG;
+                    break;
+                }
+                number = 10 * number + digit;
+                program.observed++;
+            }
+            sum = negative ? sum - (int64_t) number : sum + (int64_t) number;
+        } else if (IsLetter(CurrentChar()) || CurrentChar() == '_') {
+            size_t nameStart = program.observed;
             err = ParseIdent(ident);
-            if (err) return err;
-            if (!(program.observed == program.size) && !IsWhitespace(CurrentChar())) {
-                return ERR_UNEXPECTED_CHARACTER;
+            if (err) break;
+            IdentInfo identInfo;
+            if (!GetIdent(ident, &identInfo)) {
+                if (constant && strcmp(ident, "PROGRAM_SIZE") == 0) {
+                    err = ERR_NOT_CONSTANT;
+                    break;
+                }
+                Position pos = {.row = startPos.row, .col = startPos.col + nameStart - start};
+                Fixup* f = _AddFixup(constant ? &unit->constants : &unit->externs, pos, program.observed - nameStart);
+                if (!f) {
+                    err = ERR_OUT_OF_MEMORY;
+                } else {
+                    f->negative = negative;
+                    if (constant) f->address = (Word) unit->labels.size;
+                }
+            } else {
+                bool isLabel = identInfo.isUserDefined && !identInfo.isConstant;
+                if (constant && isLabel) {
+                    err = ERR_NOT_CONSTANT;
+                    break;
+                }
+                sum = negative ? sum - identInfo.address : sum + identInfo.address;
+                if (isLabel) err = _AddRelocation(current, negative);
             }
-            continue;
+        } else {
+            err = ERR_UNEXPECTED_CHARACTER;
         }
-
-        return ERR_UNEXPECTED_CHARACTER;
+        if (err || _IsBlankAt(program.observed)) break;
+        if (CurrentChar() != '+' && CurrentChar() != '-') err = ERR_UNEXPECTED_CHARACTER;
     }
-
-    err = NewIdent("PROGRAM_SIZE", (IdentInfo) {.address = current, .isUserDefined = false});
-    if (err) return err;
+    // the terms known here fold into one word, as a literal it must fit
+    if (!err && (sum < INT32_MIN || sum > INT32_MAX)) err = ERR_NUMBER_TOO_BIG;
+    if (err) {
+        unit->externs.size = nExterns;
+        unit->constants.size = nConstants;
+        unit->nRelocations = nRelocations;
+        return err;
+    }
+    *value = (Word) (uint32_t) sum;
     return NO_ERROR;
 }
 
-bool GetProgramSize(Word* ProgramSize) {
-    IdentInfo ii;
-    bool found = GetIdent("PROGRAM_SIZE", &ii);
-    if (!found) return true;
-    *ProgramSize = ii.address;
-    return false; 
-}
-
-Error SecondPass(void) {
+// Defines labels and constants and writes words into unit in one go over
+// the text. Idents not defined yet are left out of their words for
+// ResolveFixups(), so is PROGRAM_SIZE, known only to the link.
+Error SinglePass(void) {
     char ident[MAX_IDENT_LENGTH + 1];
     Error err = NO_ERROR;
-    IdentInfo identInfo = {0};
     while (program.observed < program.size) {
         SkipUnnecessary();
         if (program.observed >= program.size) {
             break;
         }
 
-        Position startPos = program.position;
-
-        // label
-        if (CurrentChar() == ':') {
-            while (program.observed < program.size && !IsWhitespace(CurrentChar())) {
-                program.observed++;
-                program.position.col++;
-            }
-            continue;
-        }
-
-        // number
-        if (
-            CurrentChar() == '-'
-            || CurrentChar() == '+'
-            || IsDigit(CurrentChar())
-        ) {
-            bool isNeg = CurrentChar() == '-';
-            Word number = 0;
+        Position startPos = CurrentPosition();
 
-            if (CurrentChar() == '-' || CurrentChar() == '+') {
-                program.observed++;
-                program.position.col++;
-            }
-            
-            while (program.observed < program.size && IsDigit(CurrentChar())) {
-                int digit = CurrentChar() - '0';
-                if (number > (INT32_MAX - digit) / 10) {
-                    return ERR_NUMBER_TOO_BIG;
+        // label, or constant with '='
+        if (CurrentChar() == ':' || CurrentChar() == '=') {
+            bool isConstant = CurrentChar() == '=';
+            program.observed++;
+            err = ParseIdent(ident);
+            if (err) return err;
+            size_t length = strlen(ident);
+            size_t nameEnd = program.observed;
+            size_t nConstants = unit->constants.size;
+            Word value = current;
+            if (isConstant) {
+                IdentInfo defined;
+                if (_GetIdent(ident, length, &defined)) {
+                    return defined.isUserDefined ? ERR_LABEL_REDEFINITION : ERR_KEYWORD_REDEFINITION;
                 }
-                number = 10 * number + digit;
-                program.observed++;
-                program.position.col++;
+                if (!_IsBlankAt(program.observed)) return ERR_UNEXPECTED_CHARACTER;
+                Position namePos = CurrentPosition();
+                SkipUnnecessary();
+                if (program.observed >= program.size) {
+                    // no value up to the end of the file, the name is what is wrong
+                    program.observed = nameEnd;
+                    _SetPosition(namePos);
+                    return ERR_NOT_CONSTANT;
+                }
+                err = _ParseExpression(true, &value);
+                if (err) return err;
             }
+            // a constant over idents of other files is known from the link on,
+            // its uses here are left to it as well
+            if (unit->constants.size == nConstants) {
+                IdentSlot* slot;
+                bool added;
+                err = _InternIdent(ident, length, &slot, &added);
+                if (err) return err;
+                if (!added) {
+                    return slot->value.isUserDefined 
+                           ? ERR_LABEL_REDEFINITION
+                           : ERR_KEYWORD_REDEFINITION;
+                }
 
-            M[current] = isNeg ? -number : number;
-            coords[current] = (Coord) {.pos = startPos};
-            strncpy(files[coords[current].filenameIndex], program.fileName, MAX_FILENAME_LENGTH + 1);
-            current++;
-
-            if (!(program.observed == program.size) && !IsWhitespace(CurrentChar())) {
-                return ERR_UNEXPECTED_CHARACTER;
+                slot->value = (IdentInfo) {
+                    .isUserDefined = true,
+                    .isConstant = isConstant,
+                    .address = value,
+                    .position = startPos,
+                };
             }
+            Fixup* label = _AddFixup(&unit->labels, startPos, length);
+            if (!label) return ERR_OUT_OF_MEMORY;
+            label->address = value;
+            label->observed = nameEnd;
+            label->isConstant = isConstant;
             continue;
         }
 
-        // ident
+        // number, ident or an expression over them
         if (
-            IsLetter(CurrentChar())
+            CurrentChar() == '-'
+            || CurrentChar() == '+'
+            || IsDigit(CurrentChar())
+            || IsLetter(CurrentChar())
             || CurrentChar() == '_'
         ) {
-            err = ParseIdent(ident);
+            Word value;
+            err = _ParseExpression(false, &value);
+            if (!err) err = _EmitWord(value, startPos);
             if (err) return err;
-            bool found = GetIdent(ident, &identInfo);
-            if (!found) {
-                return ERR_UNKNOWN_IDENT;
-            }
-            M[current] = identInfo.address;
-            coords[current] = (Coord) {.pos = startPos};
-            strncpy(files[coords[current].filenameIndex], program.fileName, MAX_FILENAME_LENGTH + 1);   
-            current++;
-            if (!(program.observed == program.size) && !IsWhitespace(CurrentChar())) {
-                return ERR_UNEXPECTED_CHARACTER;
-            }
             continue;
         }
 
@@ -774,344 +1732,3496 @@ Error SecondPass(void) {
     return NO_ERROR;
 }
 
+static void _AddUnitError(Error err) {
+    if (unit->nErrors == unit->errorCapacity
+        && _Grow((void**) &unit->errors, &unit->errorCapacity, sizeof(UnitError))) {
+        unit->fatal = ERR_OUT_OF_MEMORY;
+        return;
+    }
+    unit->errors[unit->nErrors++] = (UnitError) {
+        .err = err,
+        .observed = program.observed,
+        .position = CurrentPosition(),
+    };
+}
+
+// Patches the references to labels defined later in the file, the
+// others stay in unit->externs for the link.
+Error ResolveFixups(void) {
+    IdentInfo identInfo = {0};
+    size_t kept = 0;
+    for (size_t i = 0; i < unit->externs.size; i++) {
+        Fixup f = unit->externs.list[i];
+        if (_GetIdent(_FixupName(program.text, f), f.length, &identInfo) && identInfo.isUserDefined) {
+            if (f.address < SIZE && _ApplyFixup(&unit->words[f.address], f, identInfo.address)) {
+                program.observed = f.observed;
+                _SetPosition((Position) {.row = f.position.row, .col = f.position.col + f.length});
+                _AddUnitError(ERR_NUMBER_TOO_BIG);
+            }
+            Error err = identInfo.isConstant ? NO_ERROR : _AddRelocation(f.address, f.negative);
+            if (err) return err;
+            continue;
+        }
+        unit->externs.list[kept++] = f;
+    }
+    unit->externs.size = kept;
+    return NO_ERROR;
+}
+
+bool GetProgramSize(Word* ProgramSize) {
+    IdentInfo ii;
+    bool found = GetIdent("PROGRAM_SIZE", &ii);
+    if (!found) return true;
+    *ProgramSize = ii.address;
+    return false; 
+}
+
 bool PrintProgram(void) {
     IdentInfo ii;
     bool err = GetIdent("PROGRAM_SIZE", &ii);
     if (err) { return err; }
     for (Word i = RESERVED; i < ii.address; i++) {
-        printf("%3d %4d    %s:%zu:%zu\n", i, M[i], files[coords[i].filenameIndex],
-               coords[i].pos.row + 1, coords[i].pos.col + 1);
+        Coord c = {0};
+        GetCoord(i, &c);
+        printf("%3d %4d    %s:%zu:%zu\n", i, M[i], files[c.filenameIndex],
+               c.pos.row + 1, c.pos.col + 1);
     }
     return false;
 }
 
-bool TranslateProgram(void) {
-    bool errOccured = false;
-    Error err = NO_ERROR;
-    do {
-        err = FirstPass();
-        if (err) {
-            errOccured = true;
-            ReportError(err);
-            while (program.observed < program.size && !IsWhitespace(CurrentChar())) {
-                program.observed++;
-                program.position.col++;
+Op DecodeWord(Word w) {
+    static const uint8_t ops[MAX_COMMAND_CODE + 1] = {
+#define X(cmd) [-(cmd)] = OP_##cmd,
+        BIPCA_COMMANDS(X)
+#undef X
+    };
+    if (w >= 0) return OP_PUSH;
+    if (w < -MAX_COMMAND_CODE) return OP_UNKNOWN;
+    return (Op) ops[-w];
+}
+
+Instr DecodeInstr(Word w) {
+    Op op = DecodeWord(w);
+    return (Instr) {.imm = w, .op = op, .base = op, .len = 1};
+}
+
+// decodes slots [from, to) of decoded.code, fusing superinstructions
+void DecodeRange(Word from, Word to) {
+    // rows of superinstructions by the first word of their pattern: [0]
+    // for a literal, [-cmd] for a command, so most words try none
+    uint32_t startsWith[MAX_COMMAND_CODE + 1] = {0};
+    _Static_assert(N_SUPERINSTRUCTIONS <= 32, "one bit per superinstruction");
+    for (size_t k = 0; k < N_SUPERINSTRUCTIONS; k++) {
+        Word first = superinstructions[k].pattern[0];
+        startsWith[first == PATTERN_LITERAL ? 0 : -first] |= 1u << k;
+    }
+    // locals: a store to code could alias decoded and M for the compiler
+    Instr* code = decoded.code;
+    const Word* region = M + RESERVED;
+    Word size = decoded.size;
+    if (from < 0) from = 0;
+    if (to > size) to = size;
+    for (Word i = from; i < to; i++) {
+        const Word* words = region + i;
+        code[i] = DecodeInstr(words[0]);
+        uint32_t rows = words[0] >= 0 ? startsWith[0]
+                        : words[0] >= -MAX_COMMAND_CODE ? startsWith[-words[0]] : 0;
+        for (; rows; rows &= rows - 1) {
+            const Superinstruction* si = &superinstructions[__builtin_ctz(rows)];
+            if (i + si->length > size) continue;
+            Word imm = 0;
+            Word j = 0;
+            for (; j < si->length; j++) {
+                if (si->pattern[j] == PATTERN_LITERAL) {
+                    if (words[j] < 0) break;
+                    imm = words[j];
+                } else if (si->pattern[j] != words[j]) {
+                    break;
+                }
             }
-            if (program.observed == program.size) break;            
-        }
-    } while (err);
-    RestoreCurrentAfterFirstPass();
-    ResetPosition();
-    do {
-        err = SecondPass();
-        if (err) {
-            errOccured = true;
-            ReportError(err);
-            while (program.observed < program.size && !IsWhitespace(CurrentChar())) {
-                program.observed++;
-                program.position.col++;
+            if (j == si->length) {
+                code[i].imm = imm;
+                code[i].op = si->op;
+                code[i].len = si->length;
+                break;
             }
-            if (program.observed == program.size) break;
         }
-    } while (err);
+    }
+}
 
-    return errOccured;
+Error DecodeProgram(void) {
+    Word programSize = RESERVED;
+    GetProgramSize(&programSize);
+    Word size = programSize > RESERVED ? programSize - RESERVED : 0;
+    Instr* code = (Instr*) realloc(decoded.code, (size + 1) * sizeof(Instr));
+    if (!code) return ERR_OUT_OF_MEMORY;
+    decoded.code = code;
+    decoded.size = size;
+    decoded.level = 0;
+    DecodeRange(0, size);
+    return NO_ERROR;
 }
 
-bool TranslateFromFile(char *filename) {
-    InitIdentMap();
-    Error err = ReadProgram(filename);
-    if (err) {
-        ReportError(err);
-        return true;
+// folds `x y cmd` into x, false when cmd is no foldable arithmetic
+static bool _FoldConstant(Word* x, Word y, Word cmd) {
+    switch (cmd) {
+    case ADD:    *x = (Word) ((uint32_t) *x + (uint32_t) y); return true;
+    case SUB:    *x = (Word) ((uint32_t) *x - (uint32_t) y); return true;
+    case MUL:    *x = (Word) ((uint32_t) *x * (uint32_t) y); return true;
+    case DIV:    if (y == 0) return false; *x /= y; return true;
+    case MOD:    if (y == 0) return false; *x %= y; return true;
+    case BITAND: *x &= y; return true;
+    case BITOR:  *x |= y; return true;
+    case BITXOR: *x ^= y; return true;
+    default:     return false;
     }
-    return TranslateProgram();
 }
 
-bool TranslateFromFiles(int nFiles, char *filenames[]) {
-    bool errOccured = false;
-    InitIdentMap();
-    for (int i = 0; i < nFiles; i++) {
-        Error err = ReadProgram(filenames[i]);
-        if (err) {
-            ReportError(err);
-            return true;
-        };    
-        errOccured = errOccured || TranslateProgram();
-        oldCurrent = current;
+// final target of a jump to target, following `<label> JMP` chains and
+// skipped slots; the words passed through are marked linked
+static Word _FollowJumps(Word target) {
+    for (int hops = 0; hops < 16; hops++) {
+        Word i = target - RESERVED;
+        if ((uint32_t) i >= (uint32_t) decoded.size) break;
+        Instr in = decoded.code[i];
+        if (in.op != OP_JMP_IMM && in.op != OP_SKIP) break;
+        memset(decoded.linked + i, 1, in.len);
+        target = in.op == OP_SKIP ? target + in.len : in.imm;
     }
-    return errOccured;
+    return target;
 }
 
-Error AddPlugin(Plugin* p) {
-    if (plugins.size >= N_MAX_PLUGINS) return ERR_TOO_MANY_PLUGINS;
-    plugins.plugins[plugins.size++] = *p; 
+static bool _IsJumpImm(Op op) {
+    switch (op) {
+    case OP_JMP_IMM: case OP_CALL_IMM:
+    case OP_JLT_IMM: case OP_JGT_IMM: case OP_JEQ_IMM:
+    case OP_JLE_IMM: case OP_JGE_IMM: case OP_JNE_IMM:
+    case OP_CMP_JLT: case OP_CMP_JGT: case OP_CMP_JEQ:
+    case OP_CMP_JLE: case OP_CMP_JGE: case OP_CMP_JNE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Load-time peephole pass over the decoded program. M is left alone, so
+// addresses, GETIP and coords stay as translated, and every rewrite is a
+// slot covering the same words: a jump into the middle of one still runs
+// the words from there. Level 1 folds constant arithmetic, drops `0 ADD`,
+// `0 SUB` and `GETSP 0 SUB SETSP` and sends jumps to the end of
+// `<label> JMP` chains. Level 2 also turns `<label> CALL RET` into a jump
+// to the callee, where canTailCall(callee, data) says the callee never
+// reaches below its return address: arguments on the stack would be one
+// word off without it. A NULL canTailCall leaves every call.
+// Only the fused slots are rewritten, plain runs re-decode first.
+Error OptimizeProgram(int level, TailCallCheck canTailCall, void* data) {
+    uint8_t* linked = (uint8_t*) realloc(decoded.linked, (size_t) decoded.size + 1);
+    if (!linked) return ERR_OUT_OF_MEMORY;
+    memset(linked, 0, (size_t) decoded.size + 1);
+    decoded.linked = linked;
+    decoded.level = level;
+    if (level <= 0) return NO_ERROR;
+    for (Word i = 0; i < decoded.size; i++) {
+        Instr* in = &decoded.code[i];
+        const Word* words = M + RESERVED + i;
+        Word left = decoded.size - i;
+        if (in->base == OP_PUSH && left >= 3 && words[1] >= 0) {
+            Word value = words[0];
+            Word len = 1;
+            while (len + 2 <= left && words[len] >= 0
+                   && _FoldConstant(&value, words[len], words[len + 1])) {
+                len += 2;
+            }
+            if (len > 1) {
+                in->op = OP_CONST;
+                in->imm = value;
+                in->len = (uint16_t) len;
+                // a SAVE re-decodes the MAX_PATTERN_LENGTH slots before it
+                for (Word j = MAX_PATTERN_LENGTH; j < len; j++) linked[i + j] = 1;
+                continue;
+            }
+        }
+        if ((in->op == OP_ADD_IMM || in->op == OP_SUB_IMM || in->op == OP_ALLOC)
+            && in->imm == 0) {
+            in->op = OP_SKIP;
+            continue;
+        }
+        // the slot takes in the RET, so a SAVE to it re-decodes the call
+        if (level >= 2 && canTailCall && in->op == OP_CALL_IMM && in->len < left
+            && words[in->len] == RET && canTailCall(in->imm, data)) {
+            in->op = OP_JMP_IMM;
+            in->len++;
+        }
+        if (_IsJumpImm((Op) in->op)) {
+            in->imm = _FollowJumps(in->imm);
+            if (in->op == OP_JMP_IMM && in->imm == RESERVED + i + in->len) {
+                in->op = OP_SKIP;
+            }
+        }
+    }
     return NO_ERROR;
 }
 
-bool PLUGIN_INIT_DUMMY(void** addr) {
-    (void) addr;
+// Re-decodes the slots a SAVE to the program word addr can change and
+// returns them as [from, to). A word an optimized jump chain or constant
+// depends on drops the optimizations of the whole program.
+void RedecodeWord(Word addr, Word* from, Word* to) {
+    Word i = addr - RESERVED;
+    if (decoded.level > 0 && decoded.linked[i]) {
+        decoded.level = 0;
+        *from = 0;
+        *to = decoded.size;
+    } else {
+        *from = i - (MAX_PATTERN_LENGTH - 1) < 0 ? 0 : i - (MAX_PATTERN_LENGTH - 1);
+        *to = i + 1;
+    }
+    DecodeRange(*from, *to);
+}
+
+// unmarks every page of a program region of size words
+bool ResetCodePages(Word size) {
+    Word nPages = (size + CODE_PAGE_WORDS - 1) >> CODE_PAGE_SHIFT;
+    size_t n = ((size_t) nPages + 63) / 64 + 1;
+    uint64_t* bits = (uint64_t*) realloc(codePages.bits, n * sizeof(uint64_t));
+    if (!bits) return true;
+    memset(bits, 0, n * sizeof(uint64_t));
+    codePages.bits = bits;
+    codePages.nPages = nPages;
     return false;
 }
 
-void PLUGIN_BEFORE_EXEC_DUMMY(void* addr, Command cmd) {
-    (void) addr;
-    (void) cmd;
+// marks the pages holding the words [from, to)
+void MarkCodePages(Word from, Word to) {
+    if (from < RESERVED) from = RESERVED;
+    for (Word page = (from - RESERVED) >> CODE_PAGE_SHIFT;
+         page < codePages.nPages && (page << CODE_PAGE_SHIFT) < to - RESERVED;
+         page++) {
+        codePages.bits[page / 64] |= (uint64_t) 1 << (page % 64);
+    }
 }
 
-void PLUGIN_AFTER_EXEC_DUMMY(void* addr, Command cmd) {
-    (void) addr;
-    (void) cmd;
+bool IsCodePage(Word addr) {
+    Word page = (addr - RESERVED) >> CODE_PAGE_SHIFT;
+    if (addr < RESERVED || page >= codePages.nPages) return false;
+    return (codePages.bits[page / 64] >> (page % 64)) & 1;
 }
 
-Word Interpret(InterpretParams p) {
-    Word x, y, z, v, a, c;
-    Word returnValue;
+const char* OpName(Op op) {
+    static const char* const names[N_OPS] = {
+        [OP_UNKNOWN] = "UNKNOWN",
+        [OP_PUSH]    = "PUSH",
+#define X(cmd) [OP_##cmd] = #cmd,
+        BIPCA_COMMANDS(X)
+        BIPCA_SUPERINSTRUCTIONS(X)
+        BIPCA_OPTIMIZER_OPS(X)
+#undef X
+    };
+    return op < N_OPS ? names[op] : "?";
+}
 
-    // plugins
-    for (size_t i = 0; i < plugins.size; i++) {
-        Plugin p = plugins.plugins[i];
-        bool err = p.InitPlugin(plugins.userDataPointers + i);
-        if (err) {
-            _PrintError();
-            fprintf(stderr, "plugin \"%s\" falied to initialize\n", p.name);
-            return -1;
-        } else {
-            LOG_DEBUG("plugin \"%s\" initialized\n", p.name);
-        }
+// jumps to a label known at translation time go straight to its C label
+static void _EmitCGoto(FILE* out, Word target) {
+    if ((uint32_t) (target - RESERVED) < (uint32_t) decoded.size) {
+        fprintf(out, "goto L%d;", target);
+    } else {
+        fprintf(out, "{ a = %d; goto indirect; }", target);
     }
+}
 
-    size_t step = 1;
-    while (true) {
-        Word cmd = M[registers.IP++];
+// false for the words whose C code jumps or stops instead of going on
+// with the next word
+static bool _EmitCFallsThrough(Instr in) {
+    if (in.len > 1) return false;
+    switch ((Op) in.op) {
+    case OP_UNKNOWN: case OP_JMP: case OP_CALL: case OP_RET2: case OP_HALT:
+        return false;
+    default:
+        return true;
+    }
+}
 
-        // plugins
-        for (size_t i = 0; i < plugins.size; i++) {
-            Plugin p = plugins.plugins[i];
-            p.BeforeExecution(plugins.userDataPointers[i], cmd);
-        }
+// What the C of a program refers to, so that it declares nothing unused
+typedef struct {
+    bool fp;       // reads FP, a SETFP alone just pops
+    bool rv;
+    bool indirect; // jumps to an address known only at run time
+    bool save;
+    bool halt;     // stops with a result, HALT or an error
+} _EmitCUses;
 
-        switch (cmd) {
-        case ADD:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x + y;
-            break;
-        case SUB:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x - y;
-            break;
-        case MUL:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x * y;
-            break;
-        case DIV:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x / y;
-            break;
-        case MOD:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x % y;
+static _EmitCUses _EmitCScan(void) {
+    _EmitCUses uses = {0};
+    for (Word i = 0; i < decoded.size; i++) {
+        Instr in = decoded.code[i];
+        switch ((Op) in.op) {
+        case OP_GETFP: case OP_LOAD_FP_ADD: case OP_LOAD_FP_SUB: case OP_GETFP_ADD: case OP_GETFP_SUB:
+            uses.fp = true;
             break;
-        case NEG:
-            M[registers.SP] = -M[registers.SP];
+        case OP_GETRV:
+            uses.rv = true;
             break;
-        case BITAND:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x & y;
+        case OP_JMP: case OP_JLT: case OP_JGT: case OP_JEQ: case OP_JLE: case OP_JGE: case OP_JNE:
+        case OP_CALL: case OP_RET2:
+            uses.indirect = true;
             break;
-        case BITOR:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x | y;
+        case OP_SAVE:
+            uses.save = true;
             break;
-        case BITXOR:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x ^ y;
+        case OP_PUSH: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_NEG:
+        case OP_BITAND: case OP_BITOR: case OP_BITXOR: case OP_BITNOT: case OP_LSHIFT: case OP_RSHIFT:
+        case OP_DUP: case OP_DROP: case OP_SWAP: case OP_ROT: case OP_OVER: case OP_SDROP: case OP_DROP2:
+        case OP_LOAD: case OP_GETIP: case OP_GETSP: case OP_SETSP: case OP_CMP: case OP_IN: case OP_OUT:
+        case OP_ALLOC: case OP_ADD_IMM: case OP_SUB_IMM: case OP_SKIP: case OP_CONST:
+        case OP_SETFP: case OP_SETRV:
             break;
-        case BITNOT:
-            M[registers.SP] = ~M[registers.SP];
+        case OP_JMP_IMM: case OP_CALL_IMM:
+        case OP_CMP_JLT: case OP_CMP_JGT: case OP_CMP_JEQ: case OP_CMP_JLE: case OP_CMP_JGE: case OP_CMP_JNE:
+        case OP_JLT_IMM: case OP_JGT_IMM: case OP_JEQ_IMM: case OP_JLE_IMM: case OP_JGE_IMM: case OP_JNE_IMM:
+            // _EmitCGoto() leaves the program through indirect
+            if ((uint32_t) (in.imm - RESERVED) >= (uint32_t) decoded.size) uses.indirect = true;
             break;
-        case LSHIFT:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x << y;
+        default: // HALT, unknown and unsupported words
+            uses.halt = true;
             break;
-        case RSHIFT:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x >> y;
-            break;
-        case DUP:
-            x = M[registers.SP];
-            M[--registers.SP] = x;
-            break;
-        case DROP:
-            registers.SP++;
-            break;
-        case SWAP:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = y;
-            M[--registers.SP] = x;
-            break;
-        case ROT:
-            z = M[registers.SP++];
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = y;
-            M[--registers.SP] = z;
-            M[--registers.SP] = x;
-            break;
-        case OVER:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x;
-            M[--registers.SP] = y;
-            M[--registers.SP] = x;
-            break;
-        case SDROP:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = y;
-            break;
-        case DROP2:
-            registers.SP++;
-            registers.SP++;
-            break;
-        case LOAD:
-            a = M[registers.SP++];
-            M[--registers.SP] = M[a];
-            break;
-        case SAVE:
-            v = M[registers.SP++];
-            a = M[registers.SP++];
-            M[a] = v;
-            break;
-        case GETIP:
-            M[--registers.SP] = registers.IP;
-            break;
-        case GETSP:
-            x = registers.SP;
-            M[--registers.SP] = x;
-            break;
-        case GETFP:
-            M[--registers.SP] = registers.FP;
-            break;
-        case GETRV:
-            M[--registers.SP] = registers.RV;
+        }
+    }
+    return uses;
+}
+
+// true when imm may be the address of code: a literal or a jump target
+static bool _EmitCNamesAddress(Instr in) {
+    switch ((Op) in.op) {
+    case OP_PUSH: case OP_CONST: case OP_JMP_IMM: case OP_CALL_IMM:
+    case OP_CMP_JLT: case OP_CMP_JGT: case OP_CMP_JEQ: case OP_CMP_JLE: case OP_CMP_JGE: case OP_CMP_JNE:
+    case OP_JLT_IMM: case OP_JGT_IMM: case OP_JEQ_IMM: case OP_JLE_IMM: case OP_JGE_IMM: case OP_JNE_IMM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Writes the translated program as a standalone C file: every word a jump
+// can reach gets a label, literal jump targets become direct gotos and
+// computed jumps (JMP, CALL, RET) go through a table of label addresses.
+// Registers, tables and exits the program never uses are left out, so the
+// C compiles cleanly with -Wall -Wextra.
+// Needs GNU C (labels as values). The code is taken from the program image
+// at translation time, so a SAVE into the program region marks the blocks
+// covering the word and entering a marked block stops the run. A block
+// runs straight on from a word no other word falls through to or that a
+// literal or jump of the program names, so the check costs a test per
+// block, not per word.
+bool EmitC(FILE* out) {
+    Word size = decoded.size;
+    _EmitCUses uses = _EmitCScan();
+    uint8_t* starts = (uint8_t*) calloc((size_t) size + 1, 1);
+    uint8_t* named = (uint8_t*) calloc((size_t) size + 1, 1); // a goto of the C names the word
+    Word* blockOf = (Word*) malloc(((size_t) size + 1) * sizeof(Word));
+    Word* blockEnd = (Word*) malloc(((size_t) size + 1) * sizeof(Word));
+    if (!starts || !named || !blockOf || !blockEnd) {
+        free(starts);
+        free(named);
+        free(blockOf);
+        free(blockEnd);
+        return true;
+    }
+    starts[0] = 1;
+    for (Word i = 0; i < size; i++) {
+        Instr in = decoded.code[i];
+        if (!_EmitCFallsThrough(in)) {
+            starts[i + 1] = 1;
+            if (i + in.len <= size) starts[i + in.len] = 1;
+        }
+        if (_EmitCNamesAddress(in) && (uint32_t) (in.imm - RESERVED) < (uint32_t) size) {
+            starts[in.imm - RESERVED] = 1;
+            if (in.op != OP_PUSH && in.op != OP_CONST) named[in.imm - RESERVED] = 1;
+        }
+        // superinstructions and optimizer slots go on with goto, bar the two jumps
+        if (in.op > OP_HALT && in.op != OP_JMP_IMM && in.op != OP_CALL_IMM && i + in.len <= size) {
+            named[i + in.len] = 1;
+        }
+    }
+    // the words of a block are on its straight path, the last one may
+    // cover words past the start of the next block
+    Word nBlocks = 0;
+    for (Word i = 0; i < size; i++) {
+        if (starts[i]) blockEnd[nBlocks++] = 0;
+        blockOf[i] = nBlocks - 1;
+        Word end = RESERVED + i + decoded.code[i].len;
+        if (blockEnd[nBlocks - 1] < end) blockEnd[nBlocks - 1] = end;
+    }
+
+    fprintf(out,
+        "// generated by bipca --emit-c\n"
+        "#include <stdint.h>\n"
+        "#include <stdio.h>\n"
+        "\n"
+        "#define SIZE %d\n"
+        "#define RESERVED %d\n"
+        "#define PROGRAM_SIZE %d\n"
+        "// two's complement arithmetic without signed overflow\n"
+        "#define WRAP(x, op, y) ((int32_t) ((uint32_t) (x) op (uint32_t) (y)))\n"
+        "\n"
+        "// guard words, ROT on an empty stack reads M[SP + 2]\n"
+        "static int32_t M[SIZE + 3] = {", SIZE, RESERVED, RESERVED + size);
+    for (Word i = 0; i < size; i++) {
+        if (i == 0) fprintf(out, "\n    [RESERVED] = ");
+        else if (i % 16 == 0) fprintf(out, "\n    ");
+        fprintf(out, "%d,", M[RESERVED + i]);
+    }
+    fprintf(out, "\n};\n");
+    // only what the program refers to, so the C compiles without warnings
+    if (size > 0) fprintf(out, "\nstatic uint8_t rewritten[%d];\n", nBlocks + 1);
+    if (uses.save || uses.indirect) {
+        fprintf(out, "static const int32_t blockOf[PROGRAM_SIZE - RESERVED + 1] = {");
+        for (Word i = 0; i < size; i++) fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : "", blockOf[i]);
+        fprintf(out, "\n};\n");
+    }
+    if (uses.save) {
+        fprintf(out, "static const int32_t blockEnd[%d] = {", nBlocks + 1);
+        for (Word b = 0; b < nBlocks; b++) fprintf(out, "%s%d,", b % 16 == 0 ? "\n    " : "", blockEnd[b]);
+        fprintf(out,
+            "\n};\n"
+            "\n"
+            "// marks the blocks whose code covers the word at a\n"
+            "static void Rewrite(int32_t a) {\n"
+            "    for (int32_t b = blockOf[a - RESERVED]; b >= 0 && blockEnd[b] > a; b--) rewritten[b] = 1;\n"
+            "}\n");
+    }
+    fprintf(out, "\nint main(void) {\n    int32_t SP = SIZE;\n");
+    if (uses.fp) fprintf(out, "    int32_t FP = (int32_t) 0x%X;\n", UNDEF);
+    if (uses.rv) fprintf(out, "    int32_t RV = (int32_t) 0x%X;\n", UNDEF);
+    fprintf(out, "    int32_t x, y, z, a;\n");
+    if (uses.halt) fprintf(out, "    int32_t result;\n");
+    if (uses.indirect) {
+        fprintf(out, "    static void* const labels[PROGRAM_SIZE - RESERVED + 1] = {\n");
+        for (Word i = 0; i < size; i++) {
+            fprintf(out, "%s&&L%d,", i % 8 == 0 ? "\n        " : " ", RESERVED + i);
+        }
+        fprintf(out, "\n    };\n");
+    }
+    fprintf(out, "    (void) x; (void) y; (void) z;%s\n\n", size == 0 ? " (void) SP; (void) M;" : "");
+
+    for (Word i = 0; i < size; i++) {
+        Instr in = decoded.code[i];
+        Word at = RESERVED + i;
+        Word next = at + in.len;
+        if (uses.indirect || named[i]) fprintf(out, "L%d: ", at);
+        if (starts[i]) fprintf(out, "if (rewritten[%d]) { a = %d; goto rewritten_code; } ", blockOf[i], at);
+        switch ((Op) in.op) {
+        case OP_UNKNOWN:
+            fprintf(out, "fprintf(stderr, \"error: \"); "
+                         "printf(\"unknown instruction with code %%d\\n\", %d); "
+                         "result = -1; goto halt;", in.imm);
             break;
-        // case SETIP: === JMP
-        //     break;
-        case SETSP:
-            a = M[registers.SP++];
-            registers.SP = a;
+        case OP_PUSH:   fprintf(out, "M[--SP] = %d;", in.imm); break;
+        case OP_ADD:    fprintf(out, "y = M[SP++]; M[SP] = WRAP(M[SP], +, y);"); break;
+        case OP_SUB:    fprintf(out, "y = M[SP++]; M[SP] = WRAP(M[SP], -, y);"); break;
+        case OP_MUL:    fprintf(out, "y = M[SP++]; M[SP] = WRAP(M[SP], *, y);"); break;
+        case OP_DIV:    fprintf(out, "y = M[SP++]; M[SP] = M[SP] / y;"); break;
+        case OP_MOD:    fprintf(out, "y = M[SP++]; M[SP] = M[SP] %% y;"); break;
+        case OP_NEG:    fprintf(out, "M[SP] = WRAP(0, -, M[SP]);"); break;
+        case OP_BITAND: fprintf(out, "y = M[SP++]; M[SP] &= y;"); break;
+        case OP_BITOR:  fprintf(out, "y = M[SP++]; M[SP] |= y;"); break;
+        case OP_BITXOR: fprintf(out, "y = M[SP++]; M[SP] ^= y;"); break;
+        case OP_BITNOT: fprintf(out, "M[SP] = ~M[SP];"); break;
+        case OP_LSHIFT: fprintf(out, "y = M[SP++]; M[SP] = WRAP(M[SP], <<, y);"); break;
+        case OP_RSHIFT: fprintf(out, "y = M[SP++]; M[SP] = M[SP] >> y;"); break;
+        case OP_DUP:    fprintf(out, "x = M[SP]; M[--SP] = x;"); break;
+        case OP_DROP:   fprintf(out, "SP++;"); break;
+        case OP_SWAP:   fprintf(out, "y = M[SP]; M[SP] = M[SP + 1]; M[SP + 1] = y;"); break;
+        case OP_ROT:
+            fprintf(out, "z = M[SP]; y = M[SP + 1]; x = M[SP + 2]; "
+                         "M[SP + 2] = y; M[SP + 1] = z; M[SP] = x;");
             break;
-        case SETFP:
-            a = M[registers.SP++];
-            registers.FP = a;
+        case OP_OVER:   fprintf(out, "x = M[SP + 1]; M[--SP] = x;"); break;
+        case OP_SDROP:  fprintf(out, "y = M[SP++]; M[SP] = y;"); break;
+        case OP_DROP2:  fprintf(out, "SP += 2;"); break;
+        case OP_LOAD:   fprintf(out, "M[SP] = M[M[SP]];"); break;
+        case OP_SAVE:
+            fprintf(out, "y = M[SP++]; a = M[SP++]; M[a] = y; "
+                         "if ((uint32_t) (a - RESERVED) < (uint32_t) (PROGRAM_SIZE - RESERVED)) "
+                         "{ Rewrite(a); if (a > %d && a < %d) goto rewritten_code; }",
+                    at, blockEnd[blockOf[i]]);
             break;
-        case SETRV:
-            a = M[registers.SP++];
-            registers.RV = a;
+        case OP_GETIP:  fprintf(out, "M[--SP] = %d;", at + 1); break;
+        case OP_GETSP:  fprintf(out, "x = SP; M[--SP] = x;"); break;
+        case OP_GETFP:  fprintf(out, "M[--SP] = FP;"); break;
+        case OP_GETRV:  fprintf(out, "M[--SP] = RV;"); break;
+        case OP_SETSP:  fprintf(out, "SP = M[SP];"); break;
+        case OP_SETFP:  fprintf(out, uses.fp ? "FP = M[SP++];" : "SP++;"); break;
+        case OP_SETRV:  fprintf(out, uses.rv ? "RV = M[SP++];" : "SP++;"); break;
+        case OP_CMP:
+            fprintf(out, "y = M[SP++]; x = M[SP]; M[SP] = x < y ? -1 : (x > y ? 1 : 0);");
             break;
-        case CMP:
-            y = M[registers.SP++];
-            x = M[registers.SP++];
-            M[--registers.SP] = x < y 
-                                ? -1 
-                                : (x > y ? 1 : 0);
+        case OP_JMP:    fprintf(out, "a = M[SP++]; goto indirect;"); break;
+        case OP_JLT:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x < 0) goto indirect;"); break;
+        case OP_JGT:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x > 0) goto indirect;"); break;
+        case OP_JEQ:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x == 0) goto indirect;"); break;
+        case OP_JLE:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x <= 0) goto indirect;"); break;
+        case OP_JGE:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x >= 0) goto indirect;"); break;
+        case OP_JNE:    fprintf(out, "a = M[SP++]; x = M[SP++]; if (x != 0) goto indirect;"); break;
+        case OP_CALL:   fprintf(out, "a = M[SP]; M[SP] = %d; goto indirect;", at + 1); break;
+        case OP_RET2:   fprintf(out, "a = M[SP]; SP += 2; goto indirect;"); break;
+        case OP_IN:     fprintf(out, "M[--SP] = (int32_t) getchar();"); break;
+        case OP_OUT:    fprintf(out, "putchar((int) M[SP++]);"); break;
+        case OP_HALT:   fprintf(out, "result = M[SP++]; goto halt;"); break;
+        case OP_LOAD_FP_ADD:
+            fprintf(out, "M[--SP] = M[FP + %d]; goto L%d;", in.imm, next);
             break;
-        case JMP:
-            a = M[registers.SP++];
-            registers.IP = a;
+        case OP_LOAD_FP_SUB:
+            fprintf(out, "M[--SP] = M[FP - %d]; goto L%d;", in.imm, next);
             break;
-        case JLT:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x < 0) registers.IP = a;
+        case OP_ALLOC:
+            fprintf(out, "x = SP; M[x - 1] = x - %d; M[x - 2] = %d; SP = x - %d; goto L%d;",
+                    in.imm, in.imm, in.imm, next);
             break;
-        case JGT:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x > 0) registers.IP = a;
+#define CMP_BRANCH(name, cond) \
+        case OP_CMP_##name: \
+            fprintf(out, "y = M[SP++]; x = M[SP++]; if (x " #cond " y) "); \
+            _EmitCGoto(out, in.imm); \
+            fprintf(out, " goto L%d;", next); \
+            break; \
+        case OP_##name##_IMM: \
+            fprintf(out, "x = M[SP++]; if (x " #cond " 0) "); \
+            _EmitCGoto(out, in.imm); \
+            fprintf(out, " goto L%d;", next); \
             break;
-        case JEQ:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x == 0) registers.IP = a;
+        CMP_BRANCH(JLT, <)
+        CMP_BRANCH(JGT, >)
+        CMP_BRANCH(JEQ, ==)
+        CMP_BRANCH(JLE, <=)
+        CMP_BRANCH(JGE, >=)
+        CMP_BRANCH(JNE, !=)
+#undef CMP_BRANCH
+        case OP_GETFP_ADD:
+            fprintf(out, "M[--SP] = WRAP(FP, +, %d); goto L%d;", in.imm, next);
             break;
-        case JLE:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x <= 0) registers.IP = a;
+        case OP_GETFP_SUB:
+            fprintf(out, "M[--SP] = WRAP(FP, -, %d); goto L%d;", in.imm, next);
             break;
-        case JGE:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x >= 0) registers.IP = a;
+        case OP_JMP_IMM:
+            _EmitCGoto(out, in.imm);
             break;
-        case JNE:
-            a = M[registers.SP++];
-            x = M[registers.SP++];
-            if (x != 0) registers.IP = a;
+        case OP_CALL_IMM:
+            fprintf(out, "M[--SP] = %d; ", next);
+            _EmitCGoto(out, in.imm);
             break;
-        case CALL:
-            a = M[registers.SP++];
-            M[--registers.SP] = registers.IP;
-            registers.IP = a;
+        case OP_ADD_IMM:
+            fprintf(out, "M[SP] = WRAP(M[SP], +, %d); goto L%d;", in.imm, next);
             break;
-        // case RET: === JMP
-        //     break;
-        case RET2:
-            a = M[registers.SP++];
-            registers.SP++;
-            registers.IP = a;
+        case OP_SUB_IMM:
+            fprintf(out, "M[SP] = WRAP(M[SP], -, %d); goto L%d;", in.imm, next);
             break;
-        case IN:
-            M[--registers.SP] = (Word) getchar();
+        case OP_SKIP:
+            fprintf(out, "goto L%d;", next);
             break;
-        case OUT:
-            c = M[registers.SP++];
-            putchar((int) c);
+        case OP_CONST:
+            fprintf(out, "M[--SP] = %d; goto L%d;", in.imm, next);
             break;
-        case HALT:
-            returnValue = M[registers.SP++];
-            goto cleanup_and_return;
         default:
-            if (cmd < 0) {
-                _PrintError();
-                printf("unknown instruction with code %d\n", cmd);
-                returnValue = -1; // return something is better than nothing
-                goto cleanup_and_return;
-            } else {
-                M[--registers.SP] = cmd;
-            }
+            fprintf(out, "/* %s */ result = -1; goto halt;", OpName((Op) in.op));
             break;
         }
+        fprintf(out, "\n");
+    }
 
-        // plugins
-        for (size_t i = 0; i < plugins.size; i++) {
-            Plugin p = plugins.plugins[i];
-            p.AfterExecution(plugins.userDataPointers[i], cmd);
-        }
+    fprintf(out, "    a = PROGRAM_SIZE;\n");
+    if (uses.indirect) {
+        fprintf(out,
+            "indirect:\n"
+            "    if ((uint32_t) (a - RESERVED) < (uint32_t) (PROGRAM_SIZE - RESERVED)) {\n"
+            "        if (rewritten[blockOf[a - RESERVED]]) goto rewritten_code;\n"
+            "        goto *labels[a - RESERVED];\n"
+            "    }\n");
+    }
+    fprintf(out,
+        "    fprintf(stderr, \"error: jump to %%d outside the translated program\\n\", a);\n"
+        "    return 1;\n");
+    if (size > 0) {
+        fprintf(out,
+            "rewritten_code:\n"
+            "    fprintf(stderr, \"error: SAVE rewrote the code at %%d or after it, compiled code cannot run it\\n\", a);\n"
+            "    return 1;\n");
+    }
+    if (uses.halt) {
+        fprintf(out,
+            "halt:\n"
+            "    printf(\"%%d\\n\", result);\n"
+            "    return 0;\n");
+    }
+    fprintf(out, "}\n");
+    free(starts);
+    free(named);
+    free(blockOf);
+    free(blockEnd);
+    fflush(out);
+    return ferror(out) != 0;
+}
+
+// pads out with zeros up to the next section, returns its offset
+static uint64_t _ImageSection(FILE* out) {
+    long at = ftell(out);
+    while (at >= 0 && at % IMAGE_ALIGN) {
+        fputc(0, out);
+        at++;
+    }
+    return at < 0 ? 0 : (uint64_t) at;
+}
+
+// Writes the translated program as an image LoadImage() starts from
+// without translating or decoding: program words, labels, the line table
+// and the decoded program before OptimizeProgram().
+bool EmitImage(FILE* out) {
+    Word programSize = RESERVED;
+    if (GetProgramSize(&programSize)) return true;
+    ImageHeader h = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .byteOrder = IMAGE_BYTE_ORDER,
+        .programSize = programSize,
+        .nFiles = (uint32_t) lines.nFiles,
+        .nRows = (uint32_t) lines.nRows,
+        .nCols = lines.nCols,
+        .nOps = N_OPS,
+    };
+    for (size_t i = 0; i < identMap.capacity; i++) {
+        if (identMap.table[i].hash && identMap.table[i].value.isUserDefined
+            && !identMap.table[i].value.isConstant) h.nSymbols++;
+    }
+    fwrite(&h, sizeof(h), 1, out);
+    h.wordsOffset = _ImageSection(out);
+    fwrite(M + RESERVED, sizeof(Word), (size_t) (programSize - RESERVED), out);
+    h.symbolsOffset = _ImageSection(out);
+    for (size_t i = 0; i < identMap.capacity; i++) {
+        if (!identMap.table[i].hash || !identMap.table[i].value.isUserDefined
+            || identMap.table[i].value.isConstant) continue;
+        ImageSymbol symbol = {
+            .address = identMap.table[i].value.address,
+            .row = (uint32_t) identMap.table[i].value.position.row,
+            .col = (uint32_t) identMap.table[i].value.position.col,
+        };
+        memcpy(symbol.key, identMap.arena + identMap.table[i].key, identMap.table[i].length);
+        fwrite(&symbol, sizeof(symbol), 1, out);
+    }
+    h.filesOffset = _ImageSection(out);
+    fwrite(files, sizeof(files[0]), lines.nFiles, out);
+    h.rowsOffset = _ImageSection(out);
+    fwrite(lines.rows, sizeof(LineRow), lines.nRows, out);
+    h.colsOffset = _ImageSection(out);
+    fwrite(lines.cols, 1, lines.nCols, out);
+    h.decodedOffset = _ImageSection(out);
+    fwrite(decoded.code, sizeof(Instr), (size_t) decoded.size, out);
+    h.size = _ImageSection(out);
+    rewind(out);
+    fwrite(&h, sizeof(h), 1, out);
+    fflush(out);
+    return ferror(out) != 0;
+}
+
+// Maps path read-only, NULL if it cannot be read
+const char* _MapFile(const char* path, size_t* size) {
+#ifdef __linux__
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    *size = (size_t) st.st_size;
+    return (const char*) p;
+#else
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char* p = length > 0 ? (char*) malloc((size_t) length) : NULL;
+    if (p && fread(p, 1, (size_t) length, file) != (size_t) length) {
+        free(p);
+        p = NULL;
+    }
+    fclose(file);
+    if (p) *size = (size_t) length;
+    return p;
+#endif
+}
+
+void _UnmapFile(const char* p, size_t size) {
+#ifdef __linux__
+    munmap((void*) p, size);
+#else
+    (void) size;
+    free((void*) p);
+#endif
+}
 
-        if (p.stepByStepInterpretation) {
-            printf("step %zu completed, press <Enter> to proceed", step);
-            getchar();
+// true when count items of itemSize at offset lie inside an image of size
+static bool _InImage(uint64_t offset, uint64_t count, uint64_t itemSize, uint64_t size) {
+    return offset <= size && count <= (size - offset) / itemSize;
+}
+
+// true when the slot at i is what DecodeRange() makes of the words there:
+// engines index their tables by op and base and step by len unchecked
+static bool _ValidInstr(Instr in, Word i, Word words) {
+    const Word* w = M + RESERVED + i;
+    if (in.op >= N_OPS || in.base != DecodeWord(w[0]) || in.len < 1 || in.len > words - i) return false;
+    if (in.op == in.base) return in.len == 1 && in.imm == w[0];
+    for (size_t k = 0; k < N_SUPERINSTRUCTIONS; k++) {
+        const Superinstruction* si = &superinstructions[k];
+        if (si->op != in.op) continue;
+        if (in.len != si->length) return false;
+        Word imm = 0;
+        for (Word j = 0; j < si->length; j++) {
+            if (si->pattern[j] == PATTERN_LITERAL) {
+                if (w[j] < 0) return false;
+                imm = w[j];
+            } else if (si->pattern[j] != w[j]) {
+                return false;
+            }
         }
-        step++;
+        return in.imm == imm;
     }
+    return false;
+}
 
-    cleanup_and_return:
-    for (size_t i; i < plugins.size; i++) free(plugins.userDataPointers[i]);
-    return returnValue;
+// The loaded line table as GetCoord() reads it: rows of known files in
+// increasing address order inside the program, each with one column
+// per word encoded within cols.
+static bool _ValidLineTable(Word programSize) {
+    for (size_t i = 0; i < lines.nRows; i++) {
+        const LineRow* row = &lines.rows[i];
+        Word rowEnd = i + 1 < lines.nRows ? lines.rows[i + 1].address : programSize;
+        if (row->file >= lines.nFiles || row->address < RESERVED || row->address >= rowEnd
+            || rowEnd > programSize) {
+            return false;
+        }
+        size_t at = row->colIndex;
+        for (Word w = row->address; w < rowEnd; w++) {
+            // GetCoord() shifts by 7 per byte, a size_t takes 10 of them
+            size_t end = at + 10;
+            while (at < lines.nCols && at < end && (lines.cols[at] & 0x80)) at++;
+            if (at >= lines.nCols || at >= end) return false;
+            at++;
+        }
+    }
+    return true;
 }
 
+Error _LoadImage(const char* image, size_t size) {
+    ImageHeader h;
+    if (size < sizeof(h)) return ERR_BAD_IMAGE;
+    memcpy(&h, image, sizeof(h));
+    if (memcmp(h.magic, IMAGE_MAGIC, sizeof(h.magic)) != 0
+        || h.version != IMAGE_VERSION
+        || h.byteOrder != IMAGE_BYTE_ORDER
+        || h.size != size
+        || h.programSize < RESERVED
+        || h.nFiles > MAX_N_FILES
+        || !_InImage(h.wordsOffset, (uint64_t) (h.programSize - RESERVED), sizeof(Word), size)
+        || !_InImage(h.symbolsOffset, h.nSymbols, sizeof(ImageSymbol), size)
+        || !_InImage(h.filesOffset, h.nFiles, sizeof(files[0]), size)
+        || !_InImage(h.rowsOffset, h.nRows, sizeof(LineRow), size)
+        || !_InImage(h.colsOffset, h.nCols, 1, size)) {
+        return ERR_BAD_IMAGE;
+    }
+    if (h.programSize >= SIZE) return ERR_PROGRAM_TOO_BIG;
+
+    memcpy(M + RESERVED, image + h.wordsOffset, (size_t) (h.programSize - RESERVED) * sizeof(Word));
+    InitIdentMap();
+    Error err = NO_ERROR;
+    for (uint32_t i = 0; i < h.nSymbols && !err; i++) {
+        ImageSymbol symbol;
+        memcpy(&symbol, image + h.symbolsOffset + i * sizeof(ImageSymbol), sizeof(symbol));
+        symbol.key[MAX_IDENT_LENGTH] = '\0';
+        err = NewIdent(symbol.key, (IdentInfo) {
+            .address = symbol.address,
+            .isUserDefined = true,
+            .position = {.row = symbol.row, .col = symbol.col},
+        });
+    }
+    if (!err) err = NewIdent("PROGRAM_SIZE", (IdentInfo) {.address = h.programSize, .isUserDefined = false});
+    if (err) return err;
+
+    ResetLineTable();
+    LineRow* rows = (LineRow*) realloc(lines.rows, ((size_t) h.nRows + 1) * sizeof(LineRow));
+    if (rows) lines.rows = rows;
+    uint8_t* cols = (uint8_t*) realloc(lines.cols, (size_t) h.nCols + 1);
+    if (cols) lines.cols = cols;
+    if (!rows || !cols) return ERR_OUT_OF_MEMORY;
+    lines.rowCapacity = (size_t) h.nRows + 1;
+    lines.colCapacity = (size_t) h.nCols + 1;
+    memcpy(lines.rows, image + h.rowsOffset, h.nRows * sizeof(LineRow));
+    memcpy(lines.cols, image + h.colsOffset, (size_t) h.nCols);
+    memcpy(files, image + h.filesOffset, h.nFiles * sizeof(files[0]));
+    for (uint32_t i = 0; i < h.nFiles; i++) files[i][MAX_FILENAME_LENGTH] = '\0';
+    lines.nFiles = h.nFiles;
+    lines.nRows = h.nRows;
+    lines.nCols = (size_t) h.nCols;
+    lines.end = h.nRows ? h.programSize : 0;
+    if (!_ValidLineTable(h.programSize)) return ERR_BAD_IMAGE;
+
+    current = h.programSize;
+    oldCurrent = h.programSize;
+    Word words = h.programSize - RESERVED;
+    if (h.nOps != N_OPS || !_InImage(h.decodedOffset, (uint64_t) words, sizeof(Instr), size)) {
+        return DecodeProgram();
+    }
+    Instr* code = (Instr*) realloc(decoded.code, ((size_t) words + 1) * sizeof(Instr));
+    if (!code) return ERR_OUT_OF_MEMORY;
+    memcpy(code, image + h.decodedOffset, (size_t) words * sizeof(Instr));
+    decoded.code = code;
+    decoded.size = words;
+    decoded.level = 0;
+    for (Word i = 0; i < words; i++) {
+        if (!_ValidInstr(code[i], i, words)) return DecodeProgram();
+    }
+    return NO_ERROR;
+}
+
+// Starts the active VM from an image written by EmitImage() instead of
+// translating: the file is mapped, checked and copied into the VM.
+// Reports its errors, true if any.
+bool LoadImage(const char* path) {
+    if (!M && SetMemorySize(SIZE)) {
+        ReportError(ERR_OUT_OF_MEMORY);
+        return true;
+    }
+    size_t size = 0;
+    const char* image = _MapFile(path, &size);
+    if (!image) {
+        ReportError(ERR_CANT_READ_FILE);
+        return true;
+    }
+    Error err = _LoadImage(image, size);
+    _UnmapFile(image, size);
+    if (err) {
+        ReportError(err);
+        return true;
+    }
+    return false;
+}
+
+// Per-file phase: translates program.text into unit as if it started at
+// address 0. Errors are kept for the link to report.
+bool TranslateProgram(void) {
+    Error err = NO_ERROR;
+    do {
+        err = SinglePass();
+        if (err) {
+            _AddUnitError(err);
+            while (program.observed < program.size && !IsWhitespace(CurrentChar())) {
+                program.observed++;
+            }
+            if (program.observed == program.size) break;            
+        }
+    } while (err);
+    err = ResolveFixups();
+    if (err) _AddUnitError(err);
+    unit->nWords = current;
+    return unit->nErrors > 0;
+}
+
+// translates u on the active VM, which keeps only the keywords after it
+static void _TranslateUnit(TranslationUnit* u) {
+    u->fatal = ReadProgram(u->fileName);
+    if (u->fatal) return;
+    size_t arenaSize = identMap.arenaSize;
+    unit = u;
+    current = 0;
+    ResetLineTable();
+    TranslateProgram();
+    // the unit takes the text and the line table
+    u->text = program.text;
+    u->size = program.size;
+    program.text = NULL;
+    program.size = 0;
+    u->rows = lines.rows;
+    u->nRows = lines.nRows;
+    u->cols = lines.cols;
+    u->nCols = lines.nCols;
+    lines.rows = NULL;
+    lines.cols = NULL;
+    lines.rowCapacity = 0;
+    lines.colCapacity = 0;
+    for (size_t i = 0; i < u->labels.size; i++) {
+        _ForgetIdent(_FixupName(u->text, u->labels.list[i]), u->labels.list[i].length);
+    }
+    // the labels were the only keys added
+    identMap.arenaSize = arenaSize;
+    unit = NULL;
+}
+
+static void _FreeUnit(TranslationUnit* u) {
+    if (u->text) _UnmapFile(u->text, u->size);
+    free(u->words);
+    free(u->rows);
+    free(u->cols);
+    free(u->labels.list);
+    free(u->externs.list);
+    free(u->constants.list);
+    free(u->relocations);
+    free(u->errors);
+}
+
+typedef struct {
+    TranslationUnit* units;
+    size_t size;
+    Word memorySize;
+    Lexer lexer;
+#if BIPCA_THREADS
+    atomic_size_t next;     // first unit no worker has taken yet
+#else
+    size_t next;
+#endif
+} _UnitQueue;
+
+static void* _TranslateWorker(void* arg) {
+    _UnitQueue* queue = (_UnitQueue*) arg;
+    BipcaVM* vm = NewVM();
+    if (!vm) return NULL;
+    vm->size = queue->memorySize;
+    vm->lexer = queue->lexer;
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    InitIdentMap();
+    size_t i;
+#if BIPCA_THREADS
+    while ((i = atomic_fetch_add(&queue->next, 1)) < queue->size) _TranslateUnit(&queue->units[i]);
+#else
+    while ((i = queue->next++) < queue->size) _TranslateUnit(&queue->units[i]);
+#endif
+    BipcaSetActiveVM(previous);
+    FreeVM(vm);
+    return NULL;
+}
+
+static void _TranslateUnits(_UnitQueue* queue, int jobs) {
+#if BIPCA_THREADS
+    if (jobs <= 0) jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0) jobs = 1;
+    if ((size_t) jobs > queue->size) jobs = (int) queue->size;
+    pthread_t* workers = jobs > 1 ? (pthread_t*) malloc((size_t) jobs * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (workers && started < jobs && !pthread_create(&workers[started], NULL, _TranslateWorker, queue))
+        started++;
+    if (started == 0) _TranslateWorker(queue);
+    for (int w = 0; w < started; w++) pthread_join(workers[w], NULL);
+    free(workers);
+#else
+    (void) jobs;
+    _TranslateWorker(queue);
+#endif
+}
+
+// appends the line table of a unit placed at base, as the current file
+static Error _AppendLines(const TranslationUnit* u, Word base) {
+    if (lines.nRows + u->nRows > lines.rowCapacity) {
+        size_t capacity = lines.nRows + u->nRows + lines.rowCapacity;
+        LineRow* rows = (LineRow*) realloc(lines.rows, capacity * sizeof(LineRow));
+        if (!rows) return ERR_OUT_OF_MEMORY;
+        lines.rows = rows;
+        lines.rowCapacity = capacity;
+    }
+    if (lines.nCols + u->nCols > lines.colCapacity) {
+        size_t capacity = lines.nCols + u->nCols + lines.colCapacity;
+        uint8_t* cols = (uint8_t*) realloc(lines.cols, capacity);
+        if (!cols) return ERR_OUT_OF_MEMORY;
+        lines.cols = cols;
+        lines.colCapacity = capacity;
+    }
+    for (size_t i = 0; i < u->nRows; i++) {
+        LineRow row = u->rows[i];
+        row.address += base;
+        row.file = (uint16_t) lines.file;
+        row.colIndex += (uint32_t) lines.nCols;
+        lines.rows[lines.nRows++] = row;
+    }
+    if (u->nCols) memcpy(lines.cols + lines.nCols, u->cols, u->nCols);
+    lines.nCols += u->nCols;
+    if (u->nRows) lines.end = base + u->nWords;
+    lines.lastCol = 0;
+    return NO_ERROR;
+}
+
+// Link phase: places u at current, defines its labels for the files after
+// it and patches its references, reporting its errors on the way.
+static bool _LinkUnit(TranslationUnit* u) {
+    bool errOccured = false;
+    IdentInfo identInfo = {0};
+    program.text = u->text;
+    program.size = u->size;
+    strncpy(program.fileName, u->fileName, MAX_FILENAME_LENGTH);
+    program.fileName[MAX_FILENAME_LENGTH] = '\0';
+    for (size_t i = 0; i < u->nErrors; i++) {
+        program.observed = u->errors[i].observed;
+        _SetPosition(u->errors[i].position);
+        ReportError(u->errors[i].err);
+        errOccured = true;
+    }
+
+    Word base = current;
+    Error err = _ReserveIdents(identMap.size + u->labels.size + 1);
+    size_t term = 0;
+    for (size_t i = 0; i < u->labels.size && !err; i++) {
+        Fixup label = u->labels.list[i];
+        // the terms of a constant over the constants of the files before
+        for (; term < u->constants.size && u->constants.list[term].address == (Word) i; term++) {
+            Fixup f = u->constants.list[term];
+            bool isConstant = _GetIdent(_FixupName(u->text, f), f.length, &identInfo) && identInfo.isConstant;
+            if (isConstant && !_ApplyFixup(&label.address, f, identInfo.address)) continue;
+            program.observed = f.observed;
+            _SetPosition((Position) {.row = f.position.row, .col = f.position.col + f.length});
+            ReportError(isConstant ? ERR_NUMBER_TOO_BIG : ERR_NOT_CONSTANT);
+            errOccured = true;
+        }
+        IdentSlot* slot;
+        bool added;
+        err = _InternIdent(_FixupName(u->text, label), label.length, &slot, &added);
+        if (err) break;
+        if (added) {
+            slot->value = (IdentInfo) {
+                .isUserDefined = true,
+                .isConstant = label.isConstant,
+                .address = label.isConstant ? label.address : base + label.address,
+                .position = label.position,
+            };
+            continue;
+        }
+        program.observed = label.observed;
+        _SetPosition((Position) {.row = label.position.row, .col = label.position.col + 1 + label.length});
+        ReportError(slot->value.isUserDefined ? ERR_LABEL_REDEFINITION : ERR_KEYWORD_REDEFINITION);
+        errOccured = true;
+    }
+    if (err) {
+        ReportError(err);
+        return true;
+    }
+    if ((int64_t) base + u->nWords >= SIZE) {
+        ReportError(ERR_PROGRAM_TOO_BIG);
+        return true;
+    }
+    if (u->nWords) memcpy(M + base, u->words, (size_t) u->nWords * sizeof(Word));
+    for (size_t i = 0; i < u->nRelocations; i++) {
+        Word r = u->relocations[i];
+        if (r >= 0) M[base + r] += base;
+        else M[base + ~r] -= base;
+    }
+    err = NewIdent("PROGRAM_SIZE", (IdentInfo) {.address = base + u->nWords, .isUserDefined = false});
+    if (!err) err = _AppendLines(u, base);
+    if (err) {
+        ReportError(err);
+        return true;
+    }
+    current = base + u->nWords;
+
+    for (size_t i = 0; i < u->externs.size; i++) {
+        Fixup f = u->externs.list[i];
+        bool found = _GetIdent(_FixupName(u->text, f), f.length, &identInfo);
+        if (found && !_ApplyFixup(&M[base + f.address], f, identInfo.address)) continue;
+        program.observed = f.observed;
+        _SetPosition((Position) {.row = f.position.row, .col = f.position.col + f.length});
+        ReportError(found ? ERR_NUMBER_TOO_BIG : ERR_UNKNOWN_IDENT);
+        errOccured = true;
+    }
+    return errOccured;
+}
+
+bool TranslateFromFile(char *filename) {
+    return TranslateFromFiles(1, &filename);
+}
+
+// Translates the files on up to translateJobs threads, then links them
+// in command line order. Labels are global: a file sees the labels of
+// the files before it and its own.
+bool TranslateFromFiles(int nFiles, char *filenames[]) {
+    bool errOccured = false;
+    if (!M && SetMemorySize(SIZE)) {
+        ReportError(ERR_OUT_OF_MEMORY);
+        return true;
+    }
+    InitIdentMap();
+    ResetLineTable();
+    TranslationUnit* units = (TranslationUnit*) calloc((size_t) nFiles + 1, sizeof(TranslationUnit));
+    if (!units) {
+        ReportError(ERR_OUT_OF_MEMORY);
+        return true;
+    }
+    for (int i = 0; i < nFiles; i++) {
+        units[i].fileName = filenames[i];
+        units[i].fatal = ERR_OUT_OF_MEMORY; // until a worker gets to it
+    }
+    _UnitQueue queue = {
+        .units = units, .size = (size_t) nFiles, .memorySize = SIZE, .lexer = bipcaActiveVM->lexer,
+    };
+    _TranslateUnits(&queue, bipcaActiveVM->translateJobs);
+
+    for (int i = 0; i < nFiles; i++) {
+        Error err = units[i].fatal;
+        if (!err) err = InternFile(filenames[i]);
+        if (err) {
+            program.text = NULL;
+            program.size = 0;
+            ResetPosition();
+            ReportError(err);
+            errOccured = true;
+            break;
+        }
+        // as before, the files after one with errors are only read
+        if (!errOccured) errOccured = _LinkUnit(&units[i]);
+        oldCurrent = current;
+    }
+    program.text = NULL;
+    program.size = 0;
+    ResetPosition();
+    for (int i = 0; i < nFiles; i++) _FreeUnit(&units[i]);
+    free(units);
+    if (errOccured) return true;
+    Error err = DecodeProgram();
+    if (err) {
+        ReportError(err);
+        return true;
+    }
+    return false;
+}
+
+#ifdef __linux__
+// MurmurHash64A
+uint64_t _Hash64(const void* data, size_t n, uint64_t seed) {
+    const uint64_t m = 0xC6A4A7935BD1E995ull;
+    const unsigned char* p = (const unsigned char*) data;
+    uint64_t h = seed ^ (n * m);
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    uint64_t k = 0;
+    memcpy(&k, p, n);
+    if (n) {
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+// cache directory into path, created if missing, true on error
+bool _CacheDir(const TranslationCache* cache, char* path, size_t size) {
+    if (cache->dir) {
+        snprintf(path, size, "%s", cache->dir);
+    } else {
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (xdg && *xdg) snprintf(path, size, "%s", xdg);
+        else if (home && *home) snprintf(path, size, "%s/.cache", home);
+        else return true;
+        mkdir(path, 0777);
+        size_t length = strlen(path);
+        snprintf(path + length, size - length, "/bipca");
+    }
+    return mkdir(path, 0777) && errno != EEXIST;
+}
+
+// 128 bits over the format, then every file name and its contents in
+// order, false if a file cannot be read
+bool _CacheKey(int nFiles, char *filenames[], uint64_t key[2]) {
+    key[0] = 0x9E3779B97F4A7C15ull ^ IMAGE_VERSION;
+    key[1] = 0xC2B2AE3D27D4EB4Full ^ ((uint64_t) N_OPS << 32) ^ (uint64_t) N_SUPERINSTRUCTIONS;
+    for (int i = 0; i < nFiles; i++) {
+        size_t size = 0;
+        const char* text = _MapFile(filenames[i], &size);
+        if (!text) {
+            FILE* empty = fopen(filenames[i], "r");
+            if (!empty) return false;
+            fclose(empty);
+        }
+        for (int lane = 0; lane < 2; lane++) {
+            key[lane] = _Hash64(filenames[i], strlen(filenames[i]) + 1, key[lane]);
+            key[lane] = _Hash64(text, text ? size : 0, key[lane]);
+        }
+        if (text) _UnmapFile(text, size);
+    }
+    return true;
+}
+
+// drops the least recently used images until the rest fit in maxBytes
+void _EvictCache(const char* dir, TranslationCache* cache) {
+    uint64_t maxBytes = cache->maxBytes ? cache->maxBytes : TRANSLATION_CACHE_BYTES;
+    for (;;) {
+        DIR* d = opendir(dir);
+        if (!d) return;
+        uint64_t total = 0;
+        char oldest[PATH_MAX] = "";
+        struct timespec oldestTime = {0};
+        struct dirent* entry;
+        char path[PATH_MAX];
+        struct stat st;
+        while ((entry = readdir(d))) {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".bpi") != 0) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+            total += (uint64_t) st.st_size;
+            if (!*oldest || st.st_mtim.tv_sec < oldestTime.tv_sec
+                || (st.st_mtim.tv_sec == oldestTime.tv_sec && st.st_mtim.tv_nsec < oldestTime.tv_nsec)) {
+                snprintf(oldest, sizeof(oldest), "%s", path);
+                oldestTime = st.st_mtim;
+            }
+        }
+        closedir(d);
+        if (total <= maxBytes || !*oldest || unlink(oldest)) return;
+        cache->evictions++;
+    }
+}
+#endif
+
+// TranslateFromFiles() through a cache of images: files already
+// translated with the same names and contents are loaded from their image,
+// others are translated and their image stored. A cache that cannot be
+// used only costs the translation.
+bool TranslateFromFilesCached(int nFiles, char *filenames[], TranslationCache* cache) {
+#ifdef __linux__
+    char dir[PATH_MAX - 64];
+    uint64_t key[2];
+    if (_CacheDir(cache, dir, sizeof(dir)) || !_CacheKey(nFiles, filenames, key)) {
+        return TranslateFromFiles(nFiles, filenames);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 "%016" PRIx64 ".bpi", dir, key[0], key[1]);
+
+    if (!M && SetMemorySize(SIZE)) {
+        ReportError(ERR_OUT_OF_MEMORY);
+        return true;
+    }
+    size_t size = 0;
+    const char* image = _MapFile(path, &size);
+    // the identifiers from before the load, a damaged image leaves its own
+    IdentMap saved = {0};
+    if (image && _CopyIdentMap(&saved, &identMap)) {
+        _UnmapFile(image, size);
+        image = NULL;
+    }
+    if (image) {
+        Error err = _LoadImage(image, size);
+        _UnmapFile(image, size);
+        if (!err) {
+            free(saved.table);
+            free(saved.arena);
+            cache->hits++;
+            utimensat(AT_FDCWD, path, NULL, 0);
+            return false;
+        }
+        // a damaged image, translate as if it never was
+        unlink(path);
+        free(identMap.table);
+        free(identMap.arena);
+        identMap = saved;
+        ResetLineTable();
+        lines.nFiles = 0;
+        _ZeroWords(M, (size_t) SIZE + 1);
+        current = RESERVED;
+        oldCurrent = RESERVED;
+    }
+    cache->misses++;
+    if (TranslateFromFiles(nFiles, filenames)) return true;
+
+    // written aside and renamed, so no one maps half an image
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s/.%d.tmp", dir, (int) getpid());
+    FILE* out = fopen(temporary, "wb");
+    if (out) {
+        bool failed = EmitImage(out);
+        failed = fclose(out) || failed;
+        if (failed || rename(temporary, path)) unlink(temporary);
+        else _EvictCache(dir, cache);
+    }
+    return false;
+#else
+    (void) cache;
+    return TranslateFromFiles(nFiles, filenames);
+#endif
+}
+
+Error AddPlugin(Plugin* p) {
+    if (plugins.size >= N_MAX_PLUGINS) return ERR_TOO_MANY_PLUGINS;
+    plugins.list[plugins.size++] = *p; 
+    return NO_ERROR;
+}
+
+bool PLUGIN_INIT_DUMMY(void** addr) {
+    (void) addr;
+    return false;
+}
+
+void PLUGIN_BEFORE_EXEC_DUMMY(void* addr, Command cmd) {
+    (void) addr;
+    (void) cmd;
+}
+
+void PLUGIN_AFTER_EXEC_DUMMY(void* addr, Command cmd) {
+    (void) addr;
+    (void) cmd;
+}
+
+bool EngineFromName(const char* name, Engine* engine) {
+    if (strcmp(name, "switch") == 0) {
+        *engine = ENGINE_SWITCH;
+    } else if (strcmp(name, "threaded") == 0) {
+        *engine = ENGINE_THREADED;
+    } else if (strcmp(name, "decoded") == 0) {
+        *engine = ENGINE_DECODED;
+    } else if (strcmp(name, "tos") == 0) {
+        *engine = ENGINE_TOS;
+    } else if (strcmp(name, "jit") == 0) {
+        *engine = ENGINE_JIT;
+    } else if (strcmp(name, "trace") == 0) {
+        *engine = ENGINE_TRACE;
+    } else {
+        return true;
+    }
+    return false;
+}
+
+_Static_assert(OP_HALT < 64, "a PLUGIN_OP() bit per base opcode");
+
+// the opcodes a plugin's events are about
+static uint64_t _PluginEventOps(const Plugin* plugin) {
+    uint64_t ops = 0;
+    if (plugin->OnMemoryWrite) ops |= PLUGIN_OP(OP_SAVE);
+    if (plugin->OnCall) ops |= PLUGIN_OP(OP_CALL);
+    if (plugin->OnReturn) ops |= PLUGIN_OP(OP_RET2);
+    if (plugin->OnJump) {
+        ops |= PLUGIN_OP(OP_JMP) | PLUGIN_OP(OP_JLT) | PLUGIN_OP(OP_JGT) | PLUGIN_OP(OP_JEQ)
+               | PLUGIN_OP(OP_JLE) | PLUGIN_OP(OP_JGE) | PLUGIN_OP(OP_JNE);
+    }
+    if (plugin->OnIO) ops |= PLUGIN_OP(OP_IN) | PLUGIN_OP(OP_OUT);
+    return ops;
+}
+
+// fills the per-opcode lists of plugins from their opcodes and events,
+// the dummy callbacks count as none
+static void _BuildPluginHooks(void) {
+    memset(plugins.hooked, 0, sizeof(plugins.hooked));
+    memset(plugins.nBefore, 0, sizeof(plugins.nBefore));
+    memset(plugins.nAfter, 0, sizeof(plugins.nAfter));
+    memset(plugins.nEvents, 0, sizeof(plugins.nEvents));
+    for (size_t i = 0; i < plugins.size; i++) {
+        const Plugin* plugin = &plugins.list[i];
+        uint64_t ops = plugin->opcodes ? plugin->opcodes : ~(uint64_t) 0;
+        bool before = plugin->BeforeExecution && plugin->BeforeExecution != PLUGIN_BEFORE_EXEC_DUMMY;
+        bool after = plugin->AfterExecution && plugin->AfterExecution != PLUGIN_AFTER_EXEC_DUMMY;
+        uint64_t events = _PluginEventOps(plugin);
+        for (Op op = 0; op <= OP_HALT; op++) {
+            if (before && (ops & PLUGIN_OP(op))) plugins.before[op][plugins.nBefore[op]++] = (uint8_t) i;
+            if (after && (ops & PLUGIN_OP(op))) plugins.after[op][plugins.nAfter[op]++] = (uint8_t) i;
+            if (events & PLUGIN_OP(op)) plugins.events[op][plugins.nEvents[op]++] = (uint8_t) i;
+            plugins.hooked[op] = plugins.nBefore[op] || plugins.nAfter[op] || plugins.nEvents[op];
+        }
+    }
+    // a superinstruction runs fused unless a plugin asks for one of its words
+    memset(plugins.unfuse, 0, sizeof(plugins.unfuse));
+    for (size_t k = 0; k < N_SUPERINSTRUCTIONS; k++) {
+        const Superinstruction* s = &superinstructions[k];
+        for (Word j = 0; j < s->length; j++) {
+            Op op = s->pattern[j] == PATTERN_LITERAL ? OP_PUSH : DecodeWord(s->pattern[j]);
+            if (plugins.hooked[op]) plugins.unfuse[s->op] = true;
+        }
+    }
+}
+
+// BeforeExecution of the plugins asking for op, and what its events need
+// to know before the word runs
+static void _BeforeHooks(Op op, Word word) {
+    if (plugins.nEvents[op]) {
+        plugins.eventAt = registers.IP - 1;
+        if (op == OP_SAVE) {
+            plugins.eventAddr = M[registers.SP + 1];
+            plugins.eventValue = M[registers.SP];
+        } else if (op == OP_OUT) {
+            plugins.eventValue = M[registers.SP];
+        }
+    }
+    for (size_t k = 0; k < plugins.nBefore[op]; k++) {
+        size_t i = plugins.before[op][k];
+        plugins.list[i].BeforeExecution(plugins.userDataPointers[i], word);
+    }
+}
+
+// AfterExecution of the plugins asking for op and its events, next is the
+// address of the word to run after it
+static void _AfterHooks(Op op, Word word, Word next) {
+    for (size_t k = 0; k < plugins.nAfter[op]; k++) {
+        size_t i = plugins.after[op][k];
+        plugins.list[i].AfterExecution(plugins.userDataPointers[i], word);
+    }
+    Word from = plugins.eventAt;
+    Word to = next;
+    // a jump to the next word is not told from one not taken
+    if (op >= OP_JMP && op <= OP_JNE && to == from + 1) return;
+    for (size_t k = 0; k < plugins.nEvents[op]; k++) {
+        size_t i = plugins.events[op][k];
+        const Plugin* plugin = &plugins.list[i];
+        void* userData = plugins.userDataPointers[i];
+        switch (op) {
+        case OP_SAVE: plugin->OnMemoryWrite(userData, plugins.eventAddr, plugins.eventValue); break;
+        case OP_CALL: plugin->OnCall(userData, from, to); break;
+        case OP_RET2: plugin->OnReturn(userData, from, to); break;
+        case OP_IN:   plugin->OnIO(userData, IN, M[registers.SP]); break;
+        case OP_OUT:  plugin->OnIO(userData, OUT, plugins.eventValue); break;
+        default:      plugin->OnJump(userData, from, to); break;
+        }
+    }
+}
+
+// Plugin callbacks around one executed word of base opcode op and the
+// step-by-step pause, only the instrumented copies of the engine loops
+// expand them. Opcodes no plugin asked for cost a test.
+#define BIPCA_BEFORE_HOOKS(op, word) \
+    do { \
+        if (plugins.hooked[op]) _BeforeHooks((op), (word)); \
+    } while (0)
+
+#define BIPCA_AFTER_HOOKS(op, word, next) \
+    do { \
+        if (plugins.hooked[op]) _AfterHooks((op), (word), (next)); \
+    } while (0)
+
+#define BIPCA_STEP_HOOK \
+    do { \
+        if (p.stepByStepInterpretation) { \
+            printf("step %zu completed, press <Enter> to proceed", step); \
+            getchar(); \
+        } \
+        step++; \
+    } while (0)
+
+// The reference loop over raw memory words, HOOKED is a constant so the
+// bare copy has no trace of the plugin machinery.
+#define BIPCA_SWITCH_LOOP(HOOKED) \
+    while (true) { \
+        Word cmd = M[registers.IP++]; \
+        Op cmdOp = HOOKED ? DecodeWord(cmd) : OP_PUSH; \
+        if (HOOKED) BIPCA_BEFORE_HOOKS(cmdOp, cmd); \
+        switch (cmd) { \
+        case ADD: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x + y; \
+            break; \
+        case SUB: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x - y; \
+            break; \
+        case MUL: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x * y; \
+            break; \
+        case DIV: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x / y; \
+            break; \
+        case MOD: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x % y; \
+            break; \
+        case NEG: \
+            M[registers.SP] = -M[registers.SP]; \
+            break; \
+        case BITAND: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x & y; \
+            break; \
+        case BITOR: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x | y; \
+            break; \
+        case BITXOR: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x ^ y; \
+            break; \
+        case BITNOT: \
+            M[registers.SP] = ~M[registers.SP]; \
+            break; \
+        case LSHIFT: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x << y; \
+            break; \
+        case RSHIFT: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x >> y; \
+            break; \
+        case DUP: \
+            x = M[registers.SP]; \
+            M[--registers.SP] = x; \
+            break; \
+        case DROP: \
+            registers.SP++; \
+            break; \
+        case SWAP: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = y; \
+            M[--registers.SP] = x; \
+            break; \
+        case ROT: \
+            z = M[registers.SP++]; \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = y; \
+            M[--registers.SP] = z; \
+            M[--registers.SP] = x; \
+            break; \
+        case OVER: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x; \
+            M[--registers.SP] = y; \
+            M[--registers.SP] = x; \
+            break; \
+        case SDROP: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = y; \
+            break; \
+        case DROP2: \
+            registers.SP++; \
+            registers.SP++; \
+            break; \
+        case LOAD: \
+            a = M[registers.SP++]; \
+            M[--registers.SP] = M[a]; \
+            break; \
+        case SAVE: \
+            v = M[registers.SP++]; \
+            a = M[registers.SP++]; \
+            M[a] = v; \
+            break; \
+        case GETIP: \
+            M[--registers.SP] = registers.IP; \
+            break; \
+        case GETSP: \
+            x = registers.SP; \
+            M[--registers.SP] = x; \
+            break; \
+        case GETFP: \
+            M[--registers.SP] = registers.FP; \
+            break; \
+        case GETRV: \
+            M[--registers.SP] = registers.RV; \
+            break; \
+        /* case SETIP: === JMP */ \
+        /*     break; */ \
+        case SETSP: \
+            a = M[registers.SP++]; \
+            registers.SP = a; \
+            break; \
+        case SETFP: \
+            a = M[registers.SP++]; \
+            registers.FP = a; \
+            break; \
+        case SETRV: \
+            a = M[registers.SP++]; \
+            registers.RV = a; \
+            break; \
+        case CMP: \
+            y = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            M[--registers.SP] = x < y  \
+                                ? -1  \
+                                : (x > y ? 1 : 0); \
+            break; \
+        case JMP: \
+            a = M[registers.SP++]; \
+            registers.IP = a; \
+            break; \
+        case JLT: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x < 0) registers.IP = a; \
+            break; \
+        case JGT: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x > 0) registers.IP = a; \
+            break; \
+        case JEQ: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x == 0) registers.IP = a; \
+            break; \
+        case JLE: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x <= 0) registers.IP = a; \
+            break; \
+        case JGE: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x >= 0) registers.IP = a; \
+            break; \
+        case JNE: \
+            a = M[registers.SP++]; \
+            x = M[registers.SP++]; \
+            if (x != 0) registers.IP = a; \
+            break; \
+        case CALL: \
+            a = M[registers.SP++]; \
+            M[--registers.SP] = registers.IP; \
+            registers.IP = a; \
+            break; \
+        /* case RET: === JMP */ \
+        /*     break; */ \
+        case RET2: \
+            a = M[registers.SP++]; \
+            registers.SP++; \
+            registers.IP = a; \
+            break; \
+        case IN: \
+            M[--registers.SP] = (Word) getc(vmStdin); \
+            break; \
+        case OUT: \
+            c = M[registers.SP++]; \
+            putc((int) c, vmStdout); \
+            break; \
+        case HALT: \
+            returnValue = M[registers.SP++]; \
+            goto cleanup_and_return; \
+        default: \
+            if (cmd < 0) { \
+                _PrintError(); \
+                printf("unknown instruction with code %d\n", cmd); \
+                returnValue = -1; /* return something is better than nothing */ \
+                goto cleanup_and_return; \
+            } else { \
+                M[--registers.SP] = cmd; \
+            } \
+            break; \
+        } \
+        if (HOOKED) { \
+            BIPCA_AFTER_HOOKS(cmdOp, cmd, registers.IP); \
+            BIPCA_STEP_HOOK; \
+        } \
+    }
+
+// The engines index a local copy of M: memory does not move during a run.
+#undef M
+#define M memory
+
+// The bare switch loop works on a local copy of the registers: with M a
+// pointer the compiler cannot tell a store to M from a store to SP and
+// would reload and re-store SP around every stack access. Nothing it calls
+// looks at the registers, they are written back when it stops.
+#undef registers
+#define registers regs
+static Word _InterpretSwitchBare(Word* memory, InterpretParams p) {
+    Registers regs = bipcaActiveVM->regs;
+    Word x, y, z, v, a, c;
+    Word returnValue;
+    size_t step = 1;
+
+    BIPCA_SWITCH_LOOP(false)
+
+    cleanup_and_return:
+    bipcaActiveVM->regs = regs;
+    return returnValue;
+}
+#undef registers
+#define registers (bipcaActiveVM->regs)
+
+Word _InterpretSwitch(InterpretParams p) {
+    Word* restrict const memory = bipcaActiveVM->memory;
+    Word x, y, z, v, a, c;
+    Word returnValue;
+    size_t step = 1;
+
+    // decided once, production runs never look at the plugin list again
+    if (plugins.size == 0 && !p.stepByStepInterpretation) {
+        return _InterpretSwitchBare(memory, p);
+    }
+    BIPCA_SWITCH_LOOP(true)
+
+    cleanup_and_return:
+    return returnValue;
+}
+
+// Semantics of every dense opcode, shared by the engines that run the
+// decoded program. A body works on the scratch words x, y, z, v, a, c and
+// on the instruction `in` fetched from address `at` (registers.IP is
+// already at + 1). It either falls through to the next instruction or
+// sets returnValue and jumps to cleanup_and_return. ON_CODE_WRITE(addr)
+// is invoked after a SAVE into the program region.
+#define BIPCA_OP_BODIES(OP) \
+    OP(UNKNOWN, \
+        _PrintError(); \
+        printf("unknown instruction with code %d\n", in.imm); \
+        returnValue = -1; /* return something is better than nothing */ \
+        goto cleanup_and_return;) \
+    OP(PUSH, \
+        M[--registers.SP] = in.imm;) \
+    OP(ADD, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x + y;) \
+    OP(SUB, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x - y;) \
+    OP(MUL, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x * y;) \
+    OP(DIV, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x / y;) \
+    OP(MOD, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x % y;) \
+    OP(NEG, \
+        M[registers.SP] = -M[registers.SP];) \
+    OP(BITAND, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x & y;) \
+    OP(BITOR, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x | y;) \
+    OP(BITXOR, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x ^ y;) \
+    OP(BITNOT, \
+        M[registers.SP] = ~M[registers.SP];) \
+    OP(LSHIFT, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x << y;) \
+    OP(RSHIFT, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x >> y;) \
+    OP(DUP, \
+        x = M[registers.SP]; \
+        M[--registers.SP] = x;) \
+    OP(DROP, \
+        registers.SP++;) \
+    OP(SWAP, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = y; \
+        M[--registers.SP] = x;) \
+    OP(ROT, \
+        z = M[registers.SP++]; \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = y; \
+        M[--registers.SP] = z; \
+        M[--registers.SP] = x;) \
+    OP(OVER, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x; \
+        M[--registers.SP] = y; \
+        M[--registers.SP] = x;) \
+    OP(SDROP, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = y;) \
+    OP(DROP2, \
+        registers.SP++; \
+        registers.SP++;) \
+    OP(LOAD, \
+        a = M[registers.SP++]; \
+        M[--registers.SP] = M[a];) \
+    OP(SAVE, \
+        v = M[registers.SP++]; \
+        a = M[registers.SP++]; \
+        M[a] = v; \
+        if ((uint32_t) (a - RESERVED) < (uint32_t) decoded.size) { \
+            ON_CODE_WRITE(a); \
+        }) \
+    OP(GETIP, \
+        M[--registers.SP] = registers.IP;) \
+    OP(GETSP, \
+        x = registers.SP; \
+        M[--registers.SP] = x;) \
+    OP(GETFP, \
+        M[--registers.SP] = registers.FP;) \
+    OP(GETRV, \
+        M[--registers.SP] = registers.RV;) \
+    OP(SETSP, \
+        a = M[registers.SP++]; \
+        registers.SP = a;) \
+    OP(SETFP, \
+        a = M[registers.SP++]; \
+        registers.FP = a;) \
+    OP(SETRV, \
+        a = M[registers.SP++]; \
+        registers.RV = a;) \
+    OP(CMP, \
+        y = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        M[--registers.SP] = x < y ? -1 : (x > y ? 1 : 0);) \
+    OP(JMP, \
+        a = M[registers.SP++]; \
+        registers.IP = a;) \
+    OP(JLT, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x < 0) registers.IP = a;) \
+    OP(JGT, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x > 0) registers.IP = a;) \
+    OP(JEQ, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x == 0) registers.IP = a;) \
+    OP(JLE, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x <= 0) registers.IP = a;) \
+    OP(JGE, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x >= 0) registers.IP = a;) \
+    OP(JNE, \
+        a = M[registers.SP++]; \
+        x = M[registers.SP++]; \
+        if (x != 0) registers.IP = a;) \
+    OP(CALL, \
+        a = M[registers.SP++]; \
+        M[--registers.SP] = registers.IP; \
+        registers.IP = a;) \
+    OP(RET2, \
+        a = M[registers.SP++]; \
+        registers.SP++; \
+        registers.IP = a;) \
+    OP(IN, \
+        M[--registers.SP] = (Word) getc(vmStdin);) \
+    OP(OUT, \
+        c = M[registers.SP++]; \
+        putc((int) c, vmStdout);) \
+    OP(HALT, \
+        returnValue = M[registers.SP++]; \
+        goto cleanup_and_return;) \
+    /* superinstructions, stores to slots left below SP are skipped */ \
+    OP(LOAD_FP_ADD, \
+        M[--registers.SP] = M[registers.FP + in.imm]; \
+        registers.IP = at + in.len;) \
+    OP(LOAD_FP_SUB, \
+        M[--registers.SP] = M[registers.FP - in.imm]; \
+        registers.IP = at + in.len;) \
+    OP(ALLOC, \
+        /* the two scratch slots may become part of the frame */ \
+        x = registers.SP; \
+        M[x - 1] = x - in.imm; \
+        M[x - 2] = in.imm; \
+        registers.SP = x - in.imm; \
+        registers.IP = at + in.len;) \
+    OP(CMP_JLT, BIPCA_CMP_BRANCH(<)) \
+    OP(CMP_JGT, BIPCA_CMP_BRANCH(>)) \
+    OP(CMP_JEQ, BIPCA_CMP_BRANCH(==)) \
+    OP(CMP_JLE, BIPCA_CMP_BRANCH(<=)) \
+    OP(CMP_JGE, BIPCA_CMP_BRANCH(>=)) \
+    OP(CMP_JNE, BIPCA_CMP_BRANCH(!=)) \
+    OP(GETFP_ADD, \
+        M[--registers.SP] = registers.FP + in.imm; \
+        registers.IP = at + in.len;) \
+    OP(GETFP_SUB, \
+        M[--registers.SP] = registers.FP - in.imm; \
+        registers.IP = at + in.len;) \
+    OP(JMP_IMM, \
+        registers.IP = in.imm;) \
+    OP(CALL_IMM, \
+        M[--registers.SP] = at + in.len; \
+        registers.IP = in.imm;) \
+    OP(JLT_IMM, BIPCA_IMM_BRANCH(<)) \
+    OP(JGT_IMM, BIPCA_IMM_BRANCH(>)) \
+    OP(JEQ_IMM, BIPCA_IMM_BRANCH(==)) \
+    OP(JLE_IMM, BIPCA_IMM_BRANCH(<=)) \
+    OP(JGE_IMM, BIPCA_IMM_BRANCH(>=)) \
+    OP(JNE_IMM, BIPCA_IMM_BRANCH(!=)) \
+    OP(ADD_IMM, \
+        M[registers.SP] += in.imm; \
+        registers.IP = at + in.len;) \
+    OP(SUB_IMM, \
+        M[registers.SP] -= in.imm; \
+        registers.IP = at + in.len;) \
+    OP(SKIP, \
+        registers.IP = at + in.len;) \
+    OP(CONST, \
+        M[--registers.SP] = in.imm; \
+        registers.IP = at + in.len;)
+
+// CMP <label> Jcc
+#define BIPCA_CMP_BRANCH(cond) \
+    y = M[registers.SP++]; \
+    x = M[registers.SP++]; \
+    registers.IP = x cond y ? in.imm : at + in.len;
+
+// <label> Jcc
+#define BIPCA_IMM_BRANCH(cond) \
+    x = M[registers.SP++]; \
+    registers.IP = x cond 0 ? in.imm : at + in.len;
+
+#if BIPCA_COMPUTED_GOTO
+// Direct-threaded engine: every slot of the decoded program gets the
+// address of its handler resolved once before the run, so each handler
+// ends with its own indirect jump instead of going back to a shared switch.
+// Words outside the program region (IP may go anywhere) are decoded on the fly.
+Word _InterpretThreaded(InterpretParams p) {
+    Word* restrict const memory = bipcaActiveVM->memory;
+    Word x, y, z, v, a, c;
+    Word at;
+    Instr in;
+    Word returnValue;
+
+    static void* const handlers[N_OPS] = {
+#define OP(name, body) [OP_##name] = &&do_##name,
+        BIPCA_OP_BODIES(OP)
+#undef OP
+    };
+    static void* const hookedHandlers[N_OPS] = {
+#define OP(name, body) [OP_##name] = &&hooked_##name,
+        BIPCA_OP_BODIES(OP)
+#undef OP
+    };
+
+    // Plugins, step-by-step mode and statistics need callbacks around
+    // instructions: the slots of those opcodes dispatch to hooked_run, which
+    // runs them around a second copy of the handler. The others keep the bare
+    // handler, so a narrow plugin costs nothing on the words it does not ask
+    // for. Decided once, the handlers never check for hooks.
+    bool everyWord = p.stepByStepInterpretation || p.stats;
+    void* slots[N_OPS];
+    for (size_t op = 0; op < N_OPS; op++) {
+        slots[op] = everyWord || plugins.hooked[op] ? &&hooked_run : handlers[op];
+    }
+
+    // step-by-step mode sees every word, so no superinstructions
+    bool fused = !p.noSuperinstructions && !p.stepByStepInterpretation;
+#define THREADED_SLOT(i) \
+    slots[fused && !plugins.unfuse[decoded.code[i].op] ? decoded.code[i].op : decoded.code[i].base]
+
+    Word codeSize = decoded.size;
+    void** code = (void**) malloc((codeSize + 1) * sizeof(void*));
+    if (!code) {
+        _PrintError();
+        fprintf(stderr, "not enough memory for threaded code\n");
+        return -1;
+    }
+    for (Word i = 0; i < codeSize; i++) code[i] = THREADED_SLOT(i);
+
+#define ON_CODE_WRITE(addr) \
+    do { \
+        Word from, to; \
+        RedecodeWord((addr), &from, &to); \
+        for (Word i = from; i < to; i++) code[i] = THREADED_SLOT(i); \
+    } while (0)
+
+#define THREADED_NEXT \
+    do { \
+        at = registers.IP++; \
+        if ((uint32_t) (at - RESERVED) < (uint32_t) codeSize) { \
+            in = decoded.code[at - RESERVED]; \
+            goto *code[at - RESERVED]; \
+        } \
+        in = DecodeInstr(M[at]); \
+        goto *slots[in.op]; \
+    } while (0)
+
+    size_t step = 1;
+    Word last = 0;
+    Op lastOp = OP_PUSH;
+    THREADED_NEXT;
+
+hooked_run:
+    if (!fused || plugins.unfuse[in.op]) in.op = in.base;
+    if (p.stats) p.stats->executed[in.op]++;
+    // imm of a fused slot is its literal, the hooks get the word itself
+    last = M[at];
+    BIPCA_BEFORE_HOOKS(in.op, last);
+    lastOp = in.op;
+    goto *hookedHandlers[in.op];
+hooked_after:
+    BIPCA_AFTER_HOOKS(lastOp, last, registers.IP);
+    BIPCA_STEP_HOOK;
+    THREADED_NEXT;
+
+#define OP(name, body) do_##name: { body } THREADED_NEXT;
+    BIPCA_OP_BODIES(OP)
+#undef OP
+#define OP(name, body) hooked_##name: { body } goto hooked_after;
+    BIPCA_OP_BODIES(OP)
+#undef OP
+
+#undef THREADED_NEXT
+#undef THREADED_SLOT
+#undef ON_CODE_WRITE
+
+    cleanup_and_return:
+    free(code);
+    return returnValue;
+}
+#else
+Word _InterpretThreaded(InterpretParams p) {
+    // no computed goto on this compiler, the switch loop is the best we have
+    return _InterpretDecoded(p);
+}
+#endif // BIPCA_COMPUTED_GOTO
+
+// Runs from the decoded program: the switch is over dense opcodes, so it
+// compiles to a single jump table and literals need no sign test.
+// Words outside the program region are decoded on the fly.
+Word _InterpretDecoded(InterpretParams p) {
+    Word* restrict const memory = bipcaActiveVM->memory;
+    Word x, y, z, v, a, c;
+    Word at;
+    Instr in;
+    Word returnValue;
+
+    // step-by-step mode sees every word, so no superinstructions
+    bool fused = !p.noSuperinstructions && !p.stepByStepInterpretation;
+
+#define ON_CODE_WRITE(addr) \
+    do { \
+        Word from, to; \
+        RedecodeWord((addr), &from, &to); \
+    } while (0)
+
+#define DECODED_LOOP(HOOKED) \
+    while (true) { \
+        at = registers.IP++; \
+        if ((uint32_t) (at - RESERVED) < (uint32_t) decoded.size) { \
+            in = decoded.code[at - RESERVED]; \
+            if (!fused || (HOOKED && plugins.unfuse[in.op])) in.op = in.base; \
+        } else { \
+            in = DecodeInstr(M[at]); \
+        } \
+        if (HOOKED) { \
+            if (p.stats) p.stats->executed[in.op]++; \
+            last = M[at]; \
+            BIPCA_BEFORE_HOOKS(in.op, last); \
+        } \
+        switch (in.op) { \
+        BIPCA_OP_BODIES(DECODED_CASE) \
+        } \
+        if (HOOKED) { \
+            BIPCA_AFTER_HOOKS(in.op, last, registers.IP); \
+            BIPCA_STEP_HOOK; \
+        } \
+    }
+#define DECODED_CASE(name, body) case OP_##name: { body } break;
+
+    // the bare loop is picked once, it has no hooks at all
+    size_t step = 1;
+    Word last = 0; // the word being run, imm of a fused slot is its literal
+    if (plugins.size > 0 || p.stepByStepInterpretation || p.stats) {
+        DECODED_LOOP(true)
+    } else {
+        DECODED_LOOP(false)
+    }
+
+#undef DECODED_CASE
+#undef DECODED_LOOP
+#undef ON_CODE_WRITE
+
+    cleanup_and_return:
+    return returnValue;
+}
+
+// Semantics of the dense opcodes for ENGINE_TOS. The top of the stack
+// lives in `tos` and its home slot M[sp] is stale; every other slot is
+// in memory. IP, SP, FP and RV are the locals ip, sp, fp and rv, they are
+// spilled to `registers` around plugin callbacks and on exit. Slots left
+// below SP are not kept identical to the other engines.
+#define BIPCA_TOS_BODIES(OP) \
+    OP(UNKNOWN, \
+        _PrintError(); \
+        printf("unknown instruction with code %d\n", in.imm); \
+        returnValue = -1; /* return something is better than nothing */ \
+        goto cleanup_and_return;) \
+    OP(PUSH,   TOS_PUSH(in.imm);) \
+    OP(ADD,    y = tos; tos = M[++sp] + y;) \
+    OP(SUB,    y = tos; tos = M[++sp] - y;) \
+    OP(MUL,    y = tos; tos = M[++sp] * y;) \
+    OP(DIV,    y = tos; tos = M[++sp] / y;) \
+    OP(MOD,    y = tos; tos = M[++sp] % y;) \
+    OP(NEG,    tos = -tos;) \
+    OP(BITAND, y = tos; tos = M[++sp] & y;) \
+    OP(BITOR,  y = tos; tos = M[++sp] | y;) \
+    OP(BITXOR, y = tos; tos = M[++sp] ^ y;) \
+    OP(BITNOT, tos = ~tos;) \
+    OP(LSHIFT, y = tos; tos = M[++sp] << y;) \
+    OP(RSHIFT, y = tos; tos = M[++sp] >> y;) \
+    OP(DUP,    M[sp--] = tos;) \
+    OP(DROP,   tos = M[++sp];) \
+    OP(SWAP, \
+        x = M[sp + 1]; \
+        M[sp + 1] = tos; \
+        tos = x;) \
+    OP(ROT, \
+        x = M[sp + 2]; \
+        M[sp + 2] = M[sp + 1]; \
+        M[sp + 1] = tos; \
+        tos = x;) \
+    OP(OVER, \
+        x = M[sp + 1]; \
+        TOS_PUSH(x);) \
+    OP(SDROP,  sp++;) \
+    OP(DROP2, \
+        sp += 2; \
+        tos = M[sp];) \
+    OP(LOAD, \
+        /* the home slot of tos is stale */ \
+        if (tos != sp) tos = M[tos];) \
+    OP(SAVE, \
+        v = tos; \
+        a = M[sp + 1]; \
+        sp += 2; \
+        M[a] = v; \
+        tos = M[sp]; \
+        if ((uint32_t) (a - RESERVED) < (uint32_t) decoded.size) { \
+            ON_CODE_WRITE(a); \
+        }) \
+    OP(GETIP,  TOS_PUSH(ip);) \
+    OP(GETSP, \
+        x = sp; \
+        TOS_PUSH(x);) \
+    OP(GETFP,  TOS_PUSH(fp);) \
+    OP(GETRV,  TOS_PUSH(rv);) \
+    OP(SETSP, \
+        /* the new stack may cover the home slot of tos */ \
+        a = tos; \
+        M[sp] = tos; \
+        sp = a; \
+        tos = M[sp];) \
+    OP(SETFP, \
+        fp = tos; \
+        tos = M[++sp];) \
+    OP(SETRV, \
+        rv = tos; \
+        tos = M[++sp];) \
+    OP(CMP, \
+        y = tos; \
+        x = M[++sp]; \
+        tos = x < y ? -1 : (x > y ? 1 : 0);) \
+    OP(JMP, \
+        ip = tos; \
+        tos = M[++sp];) \
+    OP(JLT, TOS_BRANCH(<)) \
+    OP(JGT, TOS_BRANCH(>)) \
+    OP(JEQ, TOS_BRANCH(==)) \
+    OP(JLE, TOS_BRANCH(<=)) \
+    OP(JGE, TOS_BRANCH(>=)) \
+    OP(JNE, TOS_BRANCH(!=)) \
+    OP(CALL, \
+        a = tos; \
+        tos = ip; \
+        ip = a;) \
+    OP(RET2, \
+        ip = tos; \
+        sp += 2; \
+        tos = M[sp];) \
+    OP(IN, \
+        x = (Word) getc(vmStdin); \
+        TOS_PUSH(x);) \
+    OP(OUT, \
+        c = tos; \
+        tos = M[++sp]; \
+        putc((int) c, vmStdout);) \
+    OP(HALT, \
+        returnValue = tos; \
+        M[sp++] = tos; \
+        goto cleanup_and_return;) \
+    OP(LOAD_FP_ADD, \
+        M[sp] = tos; \
+        tos = M[fp + in.imm]; \
+        sp--; \
+        ip = at + in.len;) \
+    OP(LOAD_FP_SUB, \
+        M[sp] = tos; \
+        tos = M[fp - in.imm]; \
+        sp--; \
+        ip = at + in.len;) \
+    OP(ALLOC, \
+        M[sp] = tos; \
+        M[sp - 1] = sp - in.imm; \
+        M[sp - 2] = in.imm; \
+        sp -= in.imm; \
+        tos = M[sp]; \
+        ip = at + in.len;) \
+    OP(CMP_JLT, TOS_CMP_BRANCH(<)) \
+    OP(CMP_JGT, TOS_CMP_BRANCH(>)) \
+    OP(CMP_JEQ, TOS_CMP_BRANCH(==)) \
+    OP(CMP_JLE, TOS_CMP_BRANCH(<=)) \
+    OP(CMP_JGE, TOS_CMP_BRANCH(>=)) \
+    OP(CMP_JNE, TOS_CMP_BRANCH(!=)) \
+    OP(GETFP_ADD, \
+        TOS_PUSH(fp + in.imm); \
+        ip = at + in.len;) \
+    OP(GETFP_SUB, \
+        TOS_PUSH(fp - in.imm); \
+        ip = at + in.len;) \
+    OP(JMP_IMM, \
+        ip = in.imm;) \
+    OP(CALL_IMM, \
+        TOS_PUSH(at + in.len); \
+        ip = in.imm;) \
+    OP(JLT_IMM, TOS_IMM_BRANCH(<)) \
+    OP(JGT_IMM, TOS_IMM_BRANCH(>)) \
+    OP(JEQ_IMM, TOS_IMM_BRANCH(==)) \
+    OP(JLE_IMM, TOS_IMM_BRANCH(<=)) \
+    OP(JGE_IMM, TOS_IMM_BRANCH(>=)) \
+    OP(JNE_IMM, TOS_IMM_BRANCH(!=)) \
+    OP(ADD_IMM, \
+        tos += in.imm; \
+        ip = at + in.len;) \
+    OP(SUB_IMM, \
+        tos -= in.imm; \
+        ip = at + in.len;) \
+    OP(SKIP, \
+        ip = at + in.len;) \
+    OP(CONST, \
+        TOS_PUSH(in.imm); \
+        ip = at + in.len;)
+
+// spills the old top to its home slot, val must not depend on sp
+#define TOS_PUSH(val) \
+    M[sp--] = tos; \
+    tos = (val);
+
+// <address> Jcc
+#define TOS_BRANCH(cond) \
+    a = tos; \
+    x = M[sp + 1]; \
+    sp += 2; \
+    tos = M[sp]; \
+    if (x cond 0) ip = a;
+
+// CMP <label> Jcc
+#define TOS_CMP_BRANCH(cond) \
+    y = tos; \
+    x = M[sp + 1]; \
+    sp += 2; \
+    tos = M[sp]; \
+    ip = x cond y ? in.imm : at + in.len;
+
+// <label> Jcc
+#define TOS_IMM_BRANCH(cond) \
+    x = tos; \
+    tos = M[++sp]; \
+    ip = x cond 0 ? in.imm : at + in.len;
+
+#if BIPCA_COMPUTED_GOTO
+// Direct-threaded engine that keeps the registers and the top of the stack
+// in locals, so arithmetic does one load and no stores instead of two
+// loads and a store through the global registers.
+Word _InterpretTos(InterpretParams p) {
+    Word* restrict const memory = bipcaActiveVM->memory;
+    Word x, y, v, a, c;
+    Word at;
+    Instr in;
+    Word returnValue;
+    Word ip = registers.IP;
+    Word sp = registers.SP;
+    Word fp = registers.FP;
+    Word rv = registers.RV;
+    Word tos = M[sp];
+
+    static void* const handlers[N_OPS] = {
+#define OP(name, body) [OP_##name] = &&tos_##name,
+        BIPCA_TOS_BODIES(OP)
+#undef OP
+    };
+    static void* const hookedHandlers[N_OPS] = {
+#define OP(name, body) [OP_##name] = &&hooked_##name,
+        BIPCA_TOS_BODIES(OP)
+#undef OP
+    };
+
+    // the opcodes plugins, step-by-step mode and statistics need callbacks
+    // for go through hooked_run, see _InterpretThreaded
+    bool everyWord = p.stepByStepInterpretation || p.stats;
+    void* slots[N_OPS];
+    for (size_t op = 0; op < N_OPS; op++) {
+        slots[op] = everyWord || plugins.hooked[op] ? &&hooked_run : handlers[op];
+    }
+
+    // step-by-step mode sees every word, so no superinstructions
+    bool fused = !p.noSuperinstructions && !p.stepByStepInterpretation;
+#define TOS_SLOT(i) \
+    slots[fused && !plugins.unfuse[decoded.code[i].op] ? decoded.code[i].op : decoded.code[i].base]
+
+    Word codeSize = decoded.size;
+    void** code = (void**) malloc((codeSize + 1) * sizeof(void*));
+    if (!code) {
+        _PrintError();
+        fprintf(stderr, "not enough memory for threaded code\n");
+        return -1;
+    }
+    for (Word i = 0; i < codeSize; i++) code[i] = TOS_SLOT(i);
+
+#define ON_CODE_WRITE(addr) \
+    do { \
+        Word from, to; \
+        RedecodeWord((addr), &from, &to); \
+        for (Word i = from; i < to; i++) code[i] = TOS_SLOT(i); \
+    } while (0)
+
+#define TOS_SPILL \
+    do { \
+        M[sp] = tos; \
+        registers.IP = ip; \
+        registers.SP = sp; \
+        registers.FP = fp; \
+        registers.RV = rv; \
+    } while (0)
+
+#define TOS_FILL \
+    do { \
+        ip = registers.IP; \
+        sp = registers.SP; \
+        fp = registers.FP; \
+        rv = registers.RV; \
+        tos = M[sp]; \
+    } while (0)
+
+#define TOS_NEXT \
+    do { \
+        at = ip++; \
+        if ((uint32_t) (at - RESERVED) < (uint32_t) codeSize) { \
+            in = decoded.code[at - RESERVED]; \
+            goto *code[at - RESERVED]; \
+        } \
+        in = DecodeInstr(M[at]); \
+        goto *slots[in.op]; \
+    } while (0)
+
+    size_t step = 1;
+    Word last = 0;
+    Op lastOp = OP_PUSH;
+    TOS_NEXT;
+
+    // the registers are spilled only for the opcodes a plugin is called for
+hooked_run:
+    if (!fused || plugins.unfuse[in.op]) in.op = in.base;
+    if (p.stats) p.stats->executed[in.op]++;
+    if (plugins.hooked[in.op]) {
+        TOS_SPILL;
+        last = M[at];
+        _BeforeHooks(in.op, last);
+        TOS_FILL;
+    }
+    lastOp = in.op;
+    goto *hookedHandlers[in.op];
+hooked_after:
+    if (plugins.hooked[lastOp]) {
+        TOS_SPILL;
+        _AfterHooks(lastOp, last, ip);
+        TOS_FILL;
+    }
+    BIPCA_STEP_HOOK;
+    TOS_NEXT;
+
+#define OP(name, body) tos_##name: { body } TOS_NEXT;
+    BIPCA_TOS_BODIES(OP)
+#undef OP
+#define OP(name, body) hooked_##name: { body } goto hooked_after;
+    BIPCA_TOS_BODIES(OP)
+#undef OP
+
+    cleanup_and_return:
+    TOS_SPILL;
+    free(code);
+    return returnValue;
+
+#undef TOS_NEXT
+#undef TOS_SLOT
+#undef TOS_FILL
+#undef TOS_SPILL
+#undef ON_CODE_WRITE
+}
+#else
+Word _InterpretTos(InterpretParams p) {
+    // the cached engine is threaded, fall back to the switch over dense opcodes
+    return _InterpretDecoded(p);
+}
+#endif // BIPCA_COMPUTED_GOTO
+
+// Executes the single instruction at registers.IP with the shared opcode
+// bodies, returns true and sets *result on HALT or an unknown instruction.
+// The JIT uses it for everything it does not compile.
+bool _InterpretStep(Word* result) {
+    Word* restrict const memory = bipcaActiveVM->memory;
+    Word x, y, z, v, a, c;
+    Word returnValue;
+    Word at = registers.IP++;
+    Instr in = DecodeInstr(M[at]);
+
+#define ON_CODE_WRITE(addr) _JitCodeWrite(addr)
+
+    switch (in.op) {
+#define OP(name, body) case OP_##name: { body } break;
+    BIPCA_OP_BODIES(OP)
+#undef OP
+    }
+    return false;
+
+#undef ON_CODE_WRITE
+
+    cleanup_and_return:
+    *result = returnValue;
+    return true;
+}
+
+#undef M
+#define M (bipcaActiveVM->memory)
+
+#if BIPCA_JIT
+// Baseline JIT: every basic block of the program region is compiled on
+// first entry into a function that keeps M in rbx, SP in r12, FP in r13d
+// and RV in r14d, runs the block with the same memory stack as the switch
+// loop and returns the next IP. Blocks end at jumps, calls and at anything
+// that is not compiled (HALT, unknown words), which is executed by
+// _InterpretStep(). A SAVE into a page marked in codePages leaves the
+// block so the blocks covering the written word can be thrown away.
+
+#define JIT_BUFFER_SIZE (16 << 20)
+#define JIT_MAX_BLOCK_WORDS 256
+#define TRACE_HOT_THRESHOLD 64 // backward jumps before a loop is recorded
+#define TRACE_MAX_WORDS 1024
+#define TRACE_MAX_WRITES 16    // program words stored to while recording
+#define JIT_MAX_TRACES 256
+
+
+typedef struct {
+    uint8_t* at;
+    uint8_t* end;
+    bool trace;    // exits update jit.stats
+    Word position; // words of the trace iteration done at this point
+} JitBuffer;
+
+void _JitBytes(JitBuffer* b, const uint8_t* bytes, size_t n) {
+    if (b->at + n > b->end) {
+        b->at = b->end + 1; // overflow, checked after the block is emitted
+        return;
+    }
+    memcpy(b->at, bytes, n);
+    b->at += n;
+}
+
+#define JIT_EMIT(b, ...) \
+    _JitBytes(b, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}))
+
+void _JitU32(JitBuffer* b, uint32_t x) {
+    _JitBytes(b, (const uint8_t*) &x, sizeof(x));
+}
+
+void _JitU64(JitBuffer* b, uint64_t x) {
+    _JitBytes(b, (const uint8_t*) &x, sizeof(x));
+}
+
+// <opcode> reg, [rbx + r12*4 + 4*slot], slot is the distance from the top
+void _JitStack(JitBuffer* b, bool wide, uint8_t opcode, int reg, int slot) {
+    JIT_EMIT(b, (uint8_t) (0x42 | (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0)));
+    if (opcode == 0x0F) {
+        JIT_EMIT(b, 0x0F, 0xAF); // imul, the only two-byte opcode used here
+    } else {
+        JIT_EMIT(b, opcode);
+    }
+    if (slot == 0) {
+        JIT_EMIT(b, (uint8_t) (((reg & 7) << 3) | 0x04), 0xA3);
+    } else {
+        JIT_EMIT(b, (uint8_t) (0x40 | ((reg & 7) << 3) | 0x04), 0xA3, (uint8_t) (4 * slot));
+    }
+}
+
+enum { JIT_EAX = 0, JIT_ECX = 1, JIT_EDX = 2, JIT_EDI = 7, JIT_R12 = 12, JIT_R13 = 13, JIT_R14 = 14 };
+
+#define JIT_LOAD(b, reg, slot)  _JitStack(b, false, 0x8B, reg, slot)
+#define JIT_STORE(b, reg, slot) _JitStack(b, false, 0x89, reg, slot)
+#define JIT_INC_SP(b)           JIT_EMIT(b, 0x49, 0xFF, 0xC4)
+#define JIT_DEC_SP(b)           JIT_EMIT(b, 0x49, 0xFF, 0xCC)
+#define JIT_ADD_SP(b, n)        JIT_EMIT(b, 0x49, 0x83, 0xC4, (uint8_t) (n))
+
+#define JIT_REGISTER_OFFSET(reg) \
+    ((uint8_t) ((uint8_t*) &registers.reg - (uint8_t*) &registers))
+
+void _JitPrologue(JitBuffer* b) {
+    JIT_EMIT(b, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56); // push rbx, r12, r13, r14
+    JIT_EMIT(b, 0x48, 0xBB);                               // mov rbx, M
+    _JitU64(b, (uint64_t) (uintptr_t) M);
+    JIT_EMIT(b, 0x48, 0xB8);                               // mov rax, &registers
+    _JitU64(b, (uint64_t) (uintptr_t) &registers);
+    JIT_EMIT(b, 0x4C, 0x63, 0x60, JIT_REGISTER_OFFSET(SP)); // movsxd r12, [rax + SP]
+    JIT_EMIT(b, 0x44, 0x8B, 0x68, JIT_REGISTER_OFFSET(FP)); // mov r13d, [rax + FP]
+    JIT_EMIT(b, 0x44, 0x8B, 0x70, JIT_REGISTER_OFFSET(RV)); // mov r14d, [rax + RV]
+}
+
+// eax holds the next IP
+void _JitEpilogue(JitBuffer* b) {
+    JIT_EMIT(b, 0x48, 0xBA);                                // mov rdx, &registers
+    _JitU64(b, (uint64_t) (uintptr_t) &registers);
+    JIT_EMIT(b, 0x89, 0x42, JIT_REGISTER_OFFSET(IP));       // mov [rdx + IP], eax
+    JIT_EMIT(b, 0x44, 0x89, 0x62, JIT_REGISTER_OFFSET(SP)); // mov [rdx + SP], r12d
+    JIT_EMIT(b, 0x44, 0x89, 0x6A, JIT_REGISTER_OFFSET(FP)); // mov [rdx + FP], r13d
+    JIT_EMIT(b, 0x44, 0x89, 0x72, JIT_REGISTER_OFFSET(RV)); // mov [rdx + RV], r14d
+    JIT_EMIT(b, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); // pop r14, r13, r12, rbx; ret
+}
+
+#define JIT_STATS_OFFSET(field) \
+    ((uint8_t) ((uint8_t*) &jit.stats.field - (uint8_t*) &jit.stats))
+
+// counts a side exit from a trace and the words of its last iteration
+void _TraceCountExit(JitBuffer* b) {
+    JIT_EMIT(b, 0x48, 0xBA);                                  // mov rdx, &jit.stats
+    _JitU64(b, (uint64_t) (uintptr_t) &jit.stats);
+    JIT_EMIT(b, 0x48, 0xFF, 0x42, JIT_STATS_OFFSET(guardExits)); // inc qword [rdx + guardExits]
+    JIT_EMIT(b, 0x48, 0x81, 0x42, JIT_STATS_OFFSET(traced));     // add qword [rdx + traced], position
+    _JitU32(b, (uint32_t) b->position);
+}
+
+void _JitExitTo(JitBuffer* b, Word ip) {
+    JIT_EMIT(b, 0xB8); // mov eax, ip
+    _JitU32(b, (uint32_t) ip);
+    if (b->trace) _TraceCountExit(b);
+    _JitEpilogue(b);
+}
+
+// IN and OUT of compiled code, on the streams of the active VM
+int _JitIn(void) {
+    return getc(vmStdin);
+}
+
+int _JitOut(int c) {
+    return putc(c, vmStdout);
+}
+
+// calls a C function, rbx and r12-r14 are callee-saved
+void _JitCall(JitBuffer* b, uintptr_t function) {
+    JIT_EMIT(b, 0x48, 0x83, 0xEC, 0x08); // sub rsp, 8, four pushes left it misaligned
+    JIT_EMIT(b, 0x48, 0xB8);             // mov rax, function
+    _JitU64(b, (uint64_t) function);
+    JIT_EMIT(b, 0xFF, 0xD0);             // call rax
+    JIT_EMIT(b, 0x48, 0x83, 0xC4, 0x08); // add rsp, 8
+}
+
+// y = top in ecx, x = second in eax, pops both
+void _JitPopOperands(JitBuffer* b) {
+    JIT_LOAD(b, JIT_ECX, 0);
+    JIT_LOAD(b, JIT_EAX, 1);
+    JIT_ADD_SP(b, 2);
+}
+
+// x <op> top for add, sub, and, or, xor and imul, result replaces both
+void _JitBinary(JitBuffer* b, uint8_t opcode) {
+    JIT_LOAD(b, JIT_EAX, 1);
+    _JitStack(b, false, opcode, JIT_EAX, 0);
+    JIT_INC_SP(b);
+    JIT_STORE(b, JIT_EAX, 0);
+}
+
+// a = top, x = second: IP = x <cond> 0 ? a : next
+void _JitBranch(JitBuffer* b, uint8_t cmovcc, Word next) {
+    _JitPopOperands(b);
+    JIT_EMIT(b, 0xBA);                    // mov edx, next
+    _JitU32(b, (uint32_t) next);
+    JIT_EMIT(b, 0x85, 0xC0);              // test eax, eax
+    JIT_EMIT(b, 0x0F, cmovcc, 0xD1);      // cmovcc edx, ecx
+    JIT_EMIT(b, 0x89, 0xD0);              // mov eax, edx
+    _JitEpilogue(b);
+}
+
+// emits the word at address `at`, returns false if it is not compiled
+bool _JitInstr(JitBuffer* b, Word at, Word w, bool* ends) {
+    Word next = at + 1;
+    *ends = false;
+    switch (DecodeWord(w)) {
+    case OP_PUSH:
+        JIT_DEC_SP(b);
+        _JitStack(b, false, 0xC7, 0, 0); // mov [top], imm32
+        _JitU32(b, (uint32_t) w);
+        break;
+    case OP_ADD:    _JitBinary(b, 0x03); break;
+    case OP_SUB:    _JitBinary(b, 0x2B); break;
+    case OP_MUL:    _JitBinary(b, 0x0F); break;
+    case OP_BITAND: _JitBinary(b, 0x23); break;
+    case OP_BITOR:  _JitBinary(b, 0x0B); break;
+    case OP_BITXOR: _JitBinary(b, 0x33); break;
+    case OP_DIV:
+    case OP_MOD:
+        _JitPopOperands(b);
+        JIT_EMIT(b, 0x99, 0xF7, 0xF9); // cdq; idiv ecx
+        JIT_DEC_SP(b);
+        JIT_STORE(b, w == DIV ? JIT_EAX : JIT_EDX, 0);
+        break;
+    case OP_LSHIFT:
+    case OP_RSHIFT:
+        _JitPopOperands(b);
+        JIT_EMIT(b, 0xD3, w == LSHIFT ? 0xE0 : 0xF8); // shl/sar eax, cl
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_NEG:    _JitStack(b, false, 0xF7, 3, 0); break;
+    case OP_BITNOT: _JitStack(b, false, 0xF7, 2, 0); break;
+    case OP_DUP:
+        JIT_LOAD(b, JIT_EAX, 0);
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_DROP:  JIT_INC_SP(b); break;
+    case OP_DROP2: JIT_ADD_SP(b, 2); break;
+    case OP_SWAP:
+        JIT_LOAD(b, JIT_EAX, 0);
+        JIT_LOAD(b, JIT_ECX, 1);
+        JIT_STORE(b, JIT_ECX, 0);
+        JIT_STORE(b, JIT_EAX, 1);
+        break;
+    case OP_ROT:
+        JIT_LOAD(b, JIT_EAX, 0);  // z
+        JIT_LOAD(b, JIT_ECX, 1);  // y
+        JIT_LOAD(b, JIT_EDX, 2);  // x
+        JIT_STORE(b, JIT_ECX, 2);
+        JIT_STORE(b, JIT_EAX, 1);
+        JIT_STORE(b, JIT_EDX, 0);
+        break;
+    case OP_OVER:
+        JIT_LOAD(b, JIT_EAX, 1);
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_SDROP:
+        JIT_LOAD(b, JIT_EAX, 0);
+        JIT_INC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_LOAD:
+        _JitStack(b, true, 0x63, JIT_EAX, 0); // movsxd rax, [top]
+        JIT_EMIT(b, 0x8B, 0x04, 0x83);        // mov eax, [rbx + rax*4]
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_SAVE:
+        JIT_LOAD(b, JIT_EAX, 0);
+        _JitStack(b, true, 0x63, JIT_ECX, 1); // movsxd rcx, [second]
+        JIT_ADD_SP(b, 2);
+        JIT_EMIT(b, 0x89, 0x04, 0x8B);        // mov [rbx + rcx*4], eax
+        JIT_EMIT(b, 0x8D, 0x91);              // lea edx, [rcx - RESERVED]
+        _JitU32(b, (uint32_t) -RESERVED);
+        JIT_EMIT(b, 0x81, 0xFA);              // cmp edx, size
+        _JitU32(b, (uint32_t) jit.size);
+        {
+            JIT_EMIT(b, 0x73, 0x00);          // jae over the exit
+            uint8_t* outside = b->at - 1;
+            JIT_EMIT(b, 0xC1, 0xEA, CODE_PAGE_SHIFT); // shr edx, CODE_PAGE_SHIFT
+            JIT_EMIT(b, 0x48, 0xB8);          // mov rax, codePages.bits
+            _JitU64(b, (uint64_t) (uintptr_t) codePages.bits);
+            JIT_EMIT(b, 0x0F, 0xA3, 0x10);    // bt [rax], edx
+            JIT_EMIT(b, 0x73, 0x00);          // jnc over the exit
+            uint8_t* unmarked = b->at - 1;
+            JIT_EMIT(b, 0x48, 0xBA);          // mov rdx, &jit.codeWrite
+            _JitU64(b, (uint64_t) (uintptr_t) &jit.codeWrite);
+            JIT_EMIT(b, 0x89, 0x0A);          // mov [rdx], ecx
+            _JitExitTo(b, next);
+            if (b->at <= b->end) {
+                *outside = (uint8_t) (b->at - outside - 1);
+                *unmarked = (uint8_t) (b->at - unmarked - 1);
+            }
+        }
+        break;
+    case OP_GETIP:
+        JIT_DEC_SP(b);
+        _JitStack(b, false, 0xC7, 0, 0);
+        _JitU32(b, (uint32_t) next);
+        break;
+    case OP_GETSP:
+        JIT_EMIT(b, 0x44, 0x89, 0xE0); // mov eax, r12d
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_GETFP:
+    case OP_GETRV:
+        JIT_DEC_SP(b);
+        JIT_STORE(b, w == GETFP ? JIT_R13 : JIT_R14, 0);
+        break;
+    case OP_SETSP:
+        _JitStack(b, true, 0x63, JIT_R12, 0); // movsxd r12, [top]
+        break;
+    case OP_SETFP:
+    case OP_SETRV:
+        JIT_LOAD(b, w == SETFP ? JIT_R13 : JIT_R14, 0);
+        JIT_INC_SP(b);
+        break;
+    case OP_CMP:
+        _JitPopOperands(b);
+        JIT_EMIT(b, 0x31, 0xD2);       // xor edx, edx
+        JIT_EMIT(b, 0x39, 0xC8);       // cmp eax, ecx
+        JIT_EMIT(b, 0x0F, 0x9F, 0xC2); // setg dl
+        JIT_EMIT(b, 0x0F, 0x9C, 0xC0); // setl al
+        JIT_EMIT(b, 0x0F, 0xB6, 0xC0); // movzx eax, al
+        JIT_EMIT(b, 0x29, 0xC2);       // sub edx, eax
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EDX, 0);
+        break;
+    case OP_JMP:
+        JIT_LOAD(b, JIT_EAX, 0);
+        JIT_INC_SP(b);
+        _JitEpilogue(b);
+        *ends = true;
+        break;
+    case OP_JLT: _JitBranch(b, 0x4C, next); *ends = true; break;
+    case OP_JGT: _JitBranch(b, 0x4F, next); *ends = true; break;
+    case OP_JEQ: _JitBranch(b, 0x44, next); *ends = true; break;
+    case OP_JLE: _JitBranch(b, 0x4E, next); *ends = true; break;
+    case OP_JGE: _JitBranch(b, 0x4D, next); *ends = true; break;
+    case OP_JNE: _JitBranch(b, 0x45, next); *ends = true; break;
+    case OP_CALL:
+        JIT_LOAD(b, JIT_EAX, 0);
+        _JitStack(b, false, 0xC7, 0, 0); // return address replaces the target
+        _JitU32(b, (uint32_t) next);
+        _JitEpilogue(b);
+        *ends = true;
+        break;
+    case OP_RET2:
+        JIT_LOAD(b, JIT_EAX, 0);
+        JIT_ADD_SP(b, 2);
+        _JitEpilogue(b);
+        *ends = true;
+        break;
+    case OP_IN:
+        _JitCall(b, (uintptr_t) &_JitIn);
+        JIT_DEC_SP(b);
+        JIT_STORE(b, JIT_EAX, 0);
+        break;
+    case OP_OUT:
+        JIT_LOAD(b, JIT_EDI, 0);
+        JIT_INC_SP(b);
+        _JitCall(b, (uintptr_t) &_JitOut);
+        break;
+    default:
+        return false; // HALT and unknown words
+    }
+    return true;
+}
+
+void _JitFlush(void) {
+    jit.used = 0;
+    memset(jit.blocks, 0, (size_t) jit.size * sizeof(JitBlock));
+    memset(jit.unsupported, 0, (size_t) jit.size);
+    memset(jit.traces, 0, (size_t) jit.size * sizeof(JitBlock));
+    memset(jit.hot, 0, (size_t) jit.size * sizeof(int32_t));
+    jit.nTraces = 0;
+    ResetCodePages(jit.size);
+}
+
+// compiles the block starting at addr, NULL if its first word is not compiled
+JitBlock _JitCompile(Word addr) {
+    if (jit.used + JIT_MAX_BLOCK_WORDS * 64 > JIT_BUFFER_SIZE) _JitFlush();
+    JitBuffer b = {
+        .at = jit.buffer + jit.used,
+        .end = jit.buffer + JIT_BUFFER_SIZE,
+    };
+    uint8_t* start = b.at;
+    _JitPrologue(&b);
+    Word at = addr;
+    bool ends = false;
+    while (!ends && at - addr < JIT_MAX_BLOCK_WORDS && at - RESERVED < jit.size) {
+        uint8_t* mark = b.at;
+        if (!_JitInstr(&b, at, M[at], &ends)) {
+            b.at = mark;
+            break;
+        }
+        at++;
+    }
+    if (at == addr || b.at > b.end) {
+        jit.unsupported[addr - RESERVED] = 1;
+        return NULL;
+    }
+    if (!ends) _JitExitTo(&b, at);
+    if (b.at > b.end) {
+        jit.unsupported[addr - RESERVED] = 1;
+        return NULL;
+    }
+    jit.used += (size_t) (b.at - start);
+    jit.blocks[addr - RESERVED] = (JitBlock) (void*) start;
+    jit.blockEnd[addr - RESERVED] = at;
+    MarkCodePages(addr, at);
+    return jit.blocks[addr - RESERVED];
+}
+
+// condition code of a conditional jump (cmovcc/jcc low nibble), -1 otherwise
+int _JitCondition(Op op) {
+    switch (op) {
+    case OP_JLT: return 0xC;
+    case OP_JGT: return 0xF;
+    case OP_JEQ: return 0x4;
+    case OP_JLE: return 0xE;
+    case OP_JGE: return 0xD;
+    case OP_JNE: return 0x5;
+    default:     return -1;
+    }
+}
+
+typedef struct {
+    uint8_t* patch;   // rel32 of the jump to the exit
+    Word ip;          // exit address if reg < 0
+    int reg;          // register holding a computed exit address
+    Word position;
+} TraceExit;
+
+typedef struct {
+    TraceExit exits[2 * TRACE_MAX_WORDS];
+    size_t n;
+} TraceExits;
+
+// leaves the trace if condition code cc holds
+void _TraceGuard(JitBuffer* b, TraceExits* exits, int cc, Word ip, int reg) {
+    JIT_EMIT(b, 0x0F, (uint8_t) (0x80 | cc)); // jcc rel32
+    _JitU32(b, 0);
+    exits->exits[exits->n++] = (TraceExit) {
+        .patch = b->at - 4, .ip = ip, .reg = reg, .position = b->position,
+    };
+}
+
+// a conditional jump whose operands are set: leaves the trace unless it
+// goes where it went while recording
+void _TraceBranch(JitBuffer* b, TraceExits* exits, int cc, Word target, Word fallthrough, Word recorded) {
+    if (recorded == target && target != fallthrough) {
+        _TraceGuard(b, exits, cc ^ 1, fallthrough, -1);
+    } else {
+        _TraceGuard(b, exits, cc, target, -1);
+    }
+}
+
+// a computed jump to eax must go where it went while recording
+void _TraceTarget(JitBuffer* b, TraceExits* exits, Word recorded) {
+    JIT_EMIT(b, 0x3D); // cmp eax, recorded
+    _JitU32(b, (uint32_t) recorded);
+    _TraceGuard(b, exits, 0x5, 0, JIT_EAX);
+}
+
+// Compiles the recorded iteration path[0..length) of the loop at head into
+// native code that loops without returning to the dispatcher. Literal
+// jumps and calls disappear, conditional and computed jumps become guards
+// that leave the trace when they would go elsewhere.
+bool _TraceCompile(Word head, const Word* path, Word length) {
+    static _Thread_local TraceExits exits;
+    exits.n = 0;
+    JitBuffer b = {
+        .at = jit.buffer + jit.used,
+        .end = jit.buffer + JIT_BUFFER_SIZE,
+        .trace = true,
+    };
+    uint8_t* start = b.at;
+    _JitPrologue(&b);
+    uint8_t* loop = b.at;
+
+#define RECORDED_NEXT(k) (j + (k) < length ? path[j + (k)] : head)
+#define FOLLOWS(k) (j + (k) < length && path[j + (k)] == at + (k))
+
+    for (Word j = 0; j < length;) {
+        Word at = path[j];
+        Word w = M[at];
+        Op op = DecodeWord(w);
+
+        // <label> JMP, <label> CALL, <label> Jcc
+        if (op == OP_PUSH && FOLLOWS(1)) {
+            Op jump = DecodeWord(M[at + 1]);
+            int cc = _JitCondition(jump);
+            b.position = j + 2;
+            if (jump == OP_JMP) {
+                j += 2;
+                continue;
+            }
+            if (jump == OP_CALL) {
+                JIT_DEC_SP(&b);
+                _JitStack(&b, false, 0xC7, 0, 0); // mov [top], return address
+                _JitU32(&b, (uint32_t) (at + 2));
+                j += 2;
+                continue;
+            }
+            if (cc >= 0) {
+                JIT_LOAD(&b, JIT_EAX, 0);
+                JIT_INC_SP(&b);
+                JIT_EMIT(&b, 0x85, 0xC0); // test eax, eax
+                _TraceBranch(&b, &exits, cc, w, at + 2, RECORDED_NEXT(2));
+                j += 2;
+                continue;
+            }
+        }
+
+        // CMP <label> Jcc
+        if (op == OP_CMP && FOLLOWS(1) && FOLLOWS(2) && M[at + 1] >= 0
+            && _JitCondition(DecodeWord(M[at + 2])) >= 0) {
+            b.position = j + 3;
+            _JitPopOperands(&b);
+            JIT_EMIT(&b, 0x39, 0xC8); // cmp eax, ecx
+            _TraceBranch(&b, &exits, _JitCondition(DecodeWord(M[at + 2])),
+                         M[at + 1], at + 3, RECORDED_NEXT(3));
+            j += 3;
+            continue;
+        }
+
+        b.position = j + 1;
+        Word recorded = RECORDED_NEXT(1);
+        int cc = _JitCondition(op);
+        if (cc >= 0) {
+            _JitPopOperands(&b);      // a in ecx, x in eax
+            JIT_EMIT(&b, 0x85, 0xC0); // test eax, eax
+            JIT_EMIT(&b, 0x89, 0xC8); // mov eax, ecx
+            if (recorded == at + 1) {
+                _TraceGuard(&b, &exits, cc, 0, JIT_EAX);
+            } else {
+                _TraceGuard(&b, &exits, cc ^ 1, at + 1, -1);
+                _TraceTarget(&b, &exits, recorded);
+            }
+        } else if (op == OP_JMP) {
+            JIT_LOAD(&b, JIT_EAX, 0);
+            JIT_INC_SP(&b);
+            _TraceTarget(&b, &exits, recorded);
+        } else if (op == OP_CALL) {
+            JIT_LOAD(&b, JIT_EAX, 0);
+            _JitStack(&b, false, 0xC7, 0, 0); // return address replaces the target
+            _JitU32(&b, (uint32_t) (at + 1));
+            _TraceTarget(&b, &exits, recorded);
+        } else if (op == OP_RET2) {
+            JIT_LOAD(&b, JIT_EAX, 0);
+            JIT_ADD_SP(&b, 2);
+            _TraceTarget(&b, &exits, recorded);
+        } else {
+            bool ends;
+            if (!_JitInstr(&b, at, w, &ends) || ends) return false;
+        }
+        j++;
+    }
+
+#undef FOLLOWS
+#undef RECORDED_NEXT
+
+    JIT_EMIT(&b, 0x48, 0xBA);                                  // mov rdx, &jit.stats
+    _JitU64(&b, (uint64_t) (uintptr_t) &jit.stats);
+    JIT_EMIT(&b, 0x48, 0x81, 0x42, JIT_STATS_OFFSET(traced));  // add qword [rdx + traced], length
+    _JitU32(&b, (uint32_t) length);
+    JIT_EMIT(&b, 0xE9);                                        // jmp loop
+    _JitU32(&b, (uint32_t) (loop - (b.at + 4)));
+
+    for (size_t k = 0; k < exits.n; k++) {
+        const TraceExit* e = &exits.exits[k];
+        int32_t rel = (int32_t) (b.at - (e->patch + 4));
+        if (b.at <= b.end) memcpy(e->patch, &rel, sizeof(rel));
+        b.position = e->position;
+        if (e->reg < 0) {
+            _JitExitTo(&b, e->ip);
+        } else {
+            _TraceCountExit(&b);
+            _JitEpilogue(&b);
+        }
+    }
+    if (b.at > b.end) return false;
+
+    jit.used += (size_t) (b.at - start);
+    jit.traces[head - RESERVED] = (JitBlock) (void*) start;
+    jit.traceHeads[jit.nTraces] = head;
+    jit.traceLengths[jit.nTraces] = length;
+    jit.nTraces++;
+    jit.stats.traces++;
+    for (Word j = 0; j < length; j++) MarkCodePages(path[j], path[j] + 1);
+    return true;
+}
+
+// Runs one iteration of the loop at head (registers.IP == head) through
+// _InterpretStep(), recording the words it executes, then compiles them.
+// Returns true and sets *result if the program halted meanwhile.
+bool _TraceRecord(Word head, Word* result) {
+    if (jit.used + TRACE_MAX_WORDS * 256 > JIT_BUFFER_SIZE) _JitFlush();
+    if (jit.nTraces >= JIT_MAX_TRACES) {
+        jit.hot[head - RESERVED] = -1;
+        return false;
+    }
+    Word* path = jit.traceWords + (size_t) jit.nTraces * TRACE_MAX_WORDS;
+    Word length = 0;
+    Word written[TRACE_MAX_WRITES];
+    Word nWritten = 0;
+    bool closed = false;
+    while (length < TRACE_MAX_WORDS) {
+        Word at = registers.IP;
+        if ((uint32_t) (at - RESERVED) >= (uint32_t) jit.size) break;
+        Op op = DecodeWord(M[at]);
+        if (op == OP_HALT || op == OP_UNKNOWN) break;
+        if (op == OP_SAVE) {
+            Word a = M[registers.SP + 1];
+            if ((uint32_t) (a - RESERVED) < (uint32_t) jit.size) {
+                if (nWritten == TRACE_MAX_WRITES) break;
+                written[nWritten++] = a;
+            }
+        }
+        path[length++] = at;
+        jit.stats.untraced++;
+        if (_InterpretStep(result)) return true;
+        if (registers.IP == head) {
+            closed = true;
+            break;
+        }
+    }
+    // the trace is compiled from M, so the loop must not rewrite itself
+    for (Word k = 0; closed && k < nWritten; k++) {
+        for (Word j = 0; j < length; j++) {
+            if (path[j] == written[k]) closed = false;
+        }
+    }
+    if (!closed || !_TraceCompile(head, path, length)) jit.hot[head - RESERVED] = -1;
+    return false;
+}
+
+bool _JitInit(void) {
+    if (!jit.buffer) {
+        void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) return true;
+        jit.buffer = (uint8_t*) buffer;
+    }
+    jit.size = decoded.size;
+    jit.blocks = (JitBlock*) realloc(jit.blocks, ((size_t) jit.size + 1) * sizeof(JitBlock));
+    jit.blockEnd = (Word*) realloc(jit.blockEnd, ((size_t) jit.size + 1) * sizeof(Word));
+    jit.unsupported = (uint8_t*) realloc(jit.unsupported, (size_t) jit.size + 1);
+    jit.traces = (JitBlock*) realloc(jit.traces, ((size_t) jit.size + 1) * sizeof(JitBlock));
+    jit.hot = (int32_t*) realloc(jit.hot, ((size_t) jit.size + 1) * sizeof(int32_t));
+    if (!jit.traceWords) {
+        jit.traceWords = (Word*) malloc((size_t) JIT_MAX_TRACES * TRACE_MAX_WORDS * sizeof(Word));
+        jit.traceHeads = (Word*) malloc(JIT_MAX_TRACES * sizeof(Word));
+        jit.traceLengths = (Word*) malloc(JIT_MAX_TRACES * sizeof(Word));
+    }
+    if (!jit.blocks || !jit.blockEnd || !jit.unsupported || !jit.traces || !jit.hot
+        || !jit.traceWords || !jit.traceHeads || !jit.traceLengths) return true;
+    if (ResetCodePages(jit.size)) return true;
+    jit.codeWrite = -1;
+    jit.stats = (TraceStats) {0};
+    _JitFlush();
+    return false;
+}
+#endif // BIPCA_JIT
+
+// drops compiled code that covers addr after it was written, the JIT
+// compiles straight from M and leaves the decoded copy alone
+void _JitCodeWrite(Word addr) {
+#if BIPCA_JIT
+    if (!jit.blocks || !IsCodePage(addr)) return;
+    Word first = addr - RESERVED - (JIT_MAX_BLOCK_WORDS - 1);
+    for (Word i = first < 0 ? 0 : first; i <= addr - RESERVED; i++) {
+        if (jit.blocks[i] && jit.blockEnd[i] > addr) jit.blocks[i] = NULL;
+        jit.unsupported[i] = 0;
+    }
+    for (Word k = 0; k < jit.nTraces; k++) {
+        Word* words = jit.traceWords + (size_t) k * TRACE_MAX_WORDS;
+        bool covers = false;
+        for (Word j = 0; j < jit.traceLengths[k]; j++) {
+            if (words[j] == addr) covers = true;
+        }
+        if (!covers) continue;
+        Word head = jit.traceHeads[k];
+        jit.traces[head - RESERVED] = NULL;
+        jit.hot[head - RESERVED] = 0;
+        // the last trace takes the freed slot
+        Word last = --jit.nTraces;
+        memcpy(words, jit.traceWords + (size_t) last * TRACE_MAX_WORDS,
+               (size_t) jit.traceLengths[last] * sizeof(Word));
+        jit.traceHeads[k] = jit.traceHeads[last];
+        jit.traceLengths[k] = jit.traceLengths[last];
+        k--;
+    }
+#endif // BIPCA_JIT
+}
+
+Word _InterpretJit(InterpretParams p) {
+#if BIPCA_JIT
+    // plugins and step-by-step mode need every instruction
+    if (plugins.size > 0 || p.stepByStepInterpretation || p.stats || _JitInit()) {
+        return _InterpretTos(p);
+    }
+    bool tracing = p.engine == ENGINE_TRACE;
+    Word returnValue;
+    while (true) {
+        Word at = registers.IP;
+        if ((uint32_t) (at - RESERVED) < (uint32_t) jit.size) {
+            JitBlock block = tracing ? jit.traces[at - RESERVED] : NULL;
+            if (block) {
+                block();
+                if (jit.codeWrite >= 0) {
+                    _JitCodeWrite(jit.codeWrite);
+                    jit.codeWrite = -1;
+                }
+                continue;
+            }
+            block = jit.blocks[at - RESERVED];
+            if (!block && !jit.unsupported[at - RESERVED]) block = _JitCompile(at);
+            if (block) {
+                Word end = jit.blockEnd[at - RESERVED];
+                block();
+                if (jit.codeWrite >= 0) {
+                    jit.stats.untraced += (uint64_t) (registers.IP - at);
+                    _JitCodeWrite(jit.codeWrite);
+                    jit.codeWrite = -1;
+                    continue;
+                }
+                jit.stats.untraced += (uint64_t) (end - at);
+                // a taken backward <label> JMP or <label> Jcc closes a loop
+                Word target = registers.IP;
+                if (tracing && target < end - 1 && end - at >= 2 && M[end - 2] == target
+                    && (M[end - 1] == JMP || _JitCondition(DecodeWord(M[end - 1])) >= 0)
+                    && jit.hot[target - RESERVED] >= 0
+                    && ++jit.hot[target - RESERVED] == TRACE_HOT_THRESHOLD
+                    && _TraceRecord(target, &returnValue)) {
+                    break;
+                }
+                continue;
+            }
+        }
+        jit.stats.untraced++;
+        if (_InterpretStep(&returnValue)) break;
+    }
+    if (p.traceStats) *p.traceStats = jit.stats;
+    return returnValue;
+#else
+    return _InterpretTos(p);
+#endif // BIPCA_JIT
+}
+
+Word Interpret(InterpretParams p) {
+    Word returnValue;
+
+    // plugins
+    for (size_t i = 0; i < plugins.size; i++) {
+        const Plugin* plugin = &plugins.list[i];
+        plugins.userDataPointers[i] = NULL;
+        bool err = plugin->InitPlugin && plugin->InitPlugin(plugins.userDataPointers + i);
+        if (err) {
+            _PrintError();
+            fprintf(stderr, "plugin \"%s\" falied to initialize\n", plugin->name);
+            return -1;
+        } else {
+            LOG_DEBUG("plugin \"%s\" initialized\n", plugin->name);
+        }
+    }
+    _BuildPluginHooks();
+
+    // word by word runs read imm of the base op, which optimized slots reuse
+    if (decoded.level > 0
+        && (p.noSuperinstructions || plugins.size > 0 || p.stepByStepInterpretation)) {
+        DecodeRange(0, decoded.size);
+        decoded.level = 0;
+    }
+
+    switch (p.engine) {
+    case ENGINE_THREADED:
+        returnValue = _InterpretThreaded(p);
+        break;
+    case ENGINE_DECODED:
+        returnValue = _InterpretDecoded(p);
+        break;
+    case ENGINE_TOS:
+        returnValue = _InterpretTos(p);
+        break;
+    case ENGINE_JIT:
+    case ENGINE_TRACE:
+        returnValue = _InterpretJit(p);
+        break;
+    case ENGINE_SWITCH:
+    default:
+        returnValue = _InterpretSwitch(p);
+        break;
+    }
+
+    for (size_t i = 0; i < plugins.size; i++) {
+        if (plugins.list[i].FinishPlugin) plugins.list[i].FinishPlugin(plugins.userDataPointers[i]);
+        free(plugins.userDataPointers[i]);
+    }
+    return returnValue;
+}
+
+void PrintDispatchReport(const InterpretStats* stats) {
+    uint64_t dispatches = 0;
+    uint64_t words = 0;
+    for (Op op = 0; op < N_OPS; op++) {
+        Word length = 1;
+        for (size_t k = 0; k < N_SUPERINSTRUCTIONS; k++) {
+            if (superinstructions[k].op == op) length = superinstructions[k].length;
+        }
+        dispatches += stats->executed[op];
+        words += stats->executed[op] * length;
+    }
+
+    printf("-------" TEXT_BOLD("SUPERINSTRUCTIONS") "--------\n");
+    printf("%-12s %6s %12s %12s\n", "name", "sites", "executed", "saved");
+    for (size_t k = 0; k < N_SUPERINSTRUCTIONS; k++) {
+        const Superinstruction* si = &superinstructions[k];
+        size_t sites = 0;
+        for (Word i = 0; i < decoded.size; i++) {
+            if (decoded.code[i].op == si->op) sites++;
+        }
+        uint64_t executed = stats->executed[si->op];
+        if (sites == 0 && executed == 0) continue;
+        printf("%-12s %6zu %12" PRIu64 " %12" PRIu64 "\n",
+               OpName(si->op), sites, executed, executed * (si->length - 1));
+    }
+    printf("words executed: %" PRIu64 ", dispatches: %" PRIu64 ", saved: %" PRIu64 "\n",
+           words, dispatches, words - dispatches);
+    printf("--------------------------------\n");
+}
+
+void PrintTraceReport(const TraceStats* stats) {
+    uint64_t words = stats->traced + stats->untraced;
+    printf("-------------" TEXT_BOLD("TRACES") "-------------\n");
+    printf("traces formed: %" PRIu64 ", guard exits: %" PRIu64 "\n",
+           stats->traces, stats->guardExits);
+    printf("words executed: %" PRIu64 ", in traces: %" PRIu64 " (%.1f%%)\n",
+           words, stats->traced, words ? 100.0 * (double) stats->traced / (double) words : 0.0);
+    printf("--------------------------------\n");
+}
+
+BipcaVM* BipcaActiveVM(void) {
+    return bipcaActiveVM;
+}
+
+// makes vm the VM of the calling thread, returns the one it replaces
+BipcaVM* BipcaSetActiveVM(BipcaVM* vm) {
+    BipcaVM* previous = bipcaActiveVM;
+    bipcaActiveVM = vm ? vm : &bipcaDefaultVM;
+    return previous;
+}
+
+// bytes of zeroed memory, only the pages written to get backed
+void* _ReserveMemory(size_t bytes) {
+#ifdef __linux__
+    void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    return calloc(1, bytes);
+#endif
+}
+
+void _ReleaseMemory(void* p, size_t bytes) {
+    if (!p) return;
+#ifdef __linux__
+    munmap(p, bytes);
+#else
+    (void) bytes;
+    free(p);
+#endif
+}
+
+// Gives the active VM a memory of words words, SP starts at the top.
+// The memory is reserved, not committed, so a large size costs nothing
+// until the program reaches that far. The old memory is dropped:
+// call it before translating. Without a call the first translation
+// reserves DEFAULT_SIZE words.
+Error SetMemorySize(Word words) {
+    if (words <= RESERVED || words == INT32_MAX) return ERR_PROGRAM_TOO_BIG;
+    Word* memory = (Word*) _ReserveMemory(((size_t) words + 1) * sizeof(Word));
+    if (!memory) return ERR_OUT_OF_MEMORY;
+    _ReleaseMemory(M, ((size_t) SIZE + 1) * sizeof(Word));
+    M = memory;
+    SIZE = words;
+    registers.SP = words;
+    return NO_ERROR;
+}
+
+Error VMSetMemorySize(BipcaVM* vm, Word words) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    Error err = SetMemorySize(words);
+    BipcaSetActiveVM(previous);
+    return err;
+}
+
+// A fresh VM, NULL if out of memory. Its memory is reserved by the first
+// translation, VMLoadProgram() or SetMemorySize().
+BipcaVM* NewVM(void) {
+    BipcaVM* vm = (BipcaVM*) calloc(1, sizeof(BipcaVM));
+    if (!vm) return NULL;
+    vm->size = DEFAULT_SIZE;
+    vm->regs = (Registers) {.IP = RESERVED, .SP = DEFAULT_SIZE, .FP = UNDEF, .RV = UNDEF};
+    vm->cursor = RESERVED;
+    vm->oldCursor = RESERVED;
+#if BIPCA_JIT
+    vm->jitState.codeWrite = -1;
+#endif
+    return vm;
+}
+
+void FreeVM(BipcaVM* vm) {
+    if (!vm || vm == &bipcaDefaultVM) return;
+    if (bipcaActiveVM == vm) bipcaActiveVM = &bipcaDefaultVM;
+    _ReleaseMemory(vm->memory, ((size_t) vm->size + 1) * sizeof(Word));
+    free(vm->lineTable.rows);
+    free(vm->lineTable.cols);
+    free(vm->idents.table);
+    free(vm->idents.arena);
+    if (vm->source.text) _UnmapFile(vm->source.text, vm->source.size);
+    free(vm->decodedProgram.code);
+    free(vm->decodedProgram.linked);
+    free(vm->codePageSet.bits);
+#if BIPCA_JIT
+    JitState* j = &vm->jitState;
+    if (j->buffer) munmap(j->buffer, JIT_BUFFER_SIZE);
+    free(j->blocks);
+    free(j->blockEnd);
+    free(j->unsupported);
+    free(j->traces);
+    free(j->hot);
+    free(j->traceWords);
+    free(j->traceHeads);
+    free(j->traceLengths);
+#endif
+    free(vm);
+}
+
+bool VMTranslateFromFiles(BipcaVM* vm, int nFiles, char *filenames[]) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    bool err = TranslateFromFiles(nFiles, filenames);
+    BipcaSetActiveVM(previous);
+    return err;
+}
+
+// plugins run with vm active, so their M and registers are vm's
+Word VMInterpret(BipcaVM* vm, InterpretParams p) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    Word result = Interpret(p);
+    BipcaSetActiveVM(previous);
+    return result;
+}
+
+Error VMAddPlugin(BipcaVM* vm, Plugin* p) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    Error err = AddPlugin(p);
+    BipcaSetActiveVM(previous);
+    return err;
+}
+
+Error VMNewIdent(BipcaVM* vm, const char* key, IdentInfo value) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    Error err = NewIdent(key, value);
+    BipcaSetActiveVM(previous);
+    return err;
+}
+
+bool VMGetIdent(BipcaVM* vm, const char* key, IdentInfo* value) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    bool found = GetIdent(key, value);
+    BipcaSetActiveVM(previous);
+    return found;
+}
+
+void VMInitIdentMap(BipcaVM* vm) {
+    BipcaVM* previous = BipcaSetActiveVM(vm);
+    InitIdentMap();
+    BipcaSetActiveVM(previous);
+}
+
+// Gives vm the program translated into from, so it runs without
+// translating again: identifiers, plugins, the program words with their
+// line table and the decoded copy. from is only read, any number of VMs can
+// load from it at once. Memory past the program is left as it is,
+// VMRestart() clears it.
+Error VMLoadProgram(BipcaVM* vm, const BipcaVM* from) {
+    if (!vm->memory || vm->size != from->size) {
+        Error err = VMSetMemorySize(vm, from->size);
+        if (err) return err;
+    }
+    Word size = from->decodedProgram.size;
+    Error err = _CopyIdentMap(&vm->idents, &from->idents);
+    if (err) return err;
+    LineTable* t = &vm->lineTable;
+    LineRow* rows = (LineRow*) realloc(t->rows, (from->lineTable.nRows + 1) * sizeof(LineRow));
+    if (rows) t->rows = rows;
+    uint8_t* cols = (uint8_t*) realloc(t->cols, from->lineTable.nCols + 1);
+    if (cols) t->cols = cols;
+    if (!rows || !cols) return ERR_OUT_OF_MEMORY;
+    *t = from->lineTable;
+    t->rows = rows;
+    t->cols = cols;
+    t->rowCapacity = t->nRows + 1;
+    t->colCapacity = t->nCols + 1;
+    memcpy(rows, from->lineTable.rows, t->nRows * sizeof(LineRow));
+    memcpy(cols, from->lineTable.cols, t->nCols);
+    vm->pluginSet = from->pluginSet;
+    vm->cursor = from->cursor;
+    vm->oldCursor = from->oldCursor;
+    DecodedProgram* d = &vm->decodedProgram;
+    if (!d->code || d->size != size) {
+        free(d->code);
+        free(d->linked);
+        d->code = (Instr*) malloc((size_t) (size + 1) * sizeof(Instr));
+        d->linked = (uint8_t*) malloc((size_t) size + 1);
+        if (!d->code || !d->linked) return ERR_OUT_OF_MEMORY;
+    }
+    VMRestart(vm, from);
+    return NO_ERROR;
+}
+
+// zeroes words, handing whole pages back to the kernel where it can
+void _ZeroWords(Word* words, size_t n) {
+#ifdef __linux__
+    const uintptr_t page = 4096;
+    uintptr_t begin = ((uintptr_t) words + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) (words + n)) & ~(page - 1);
+    if (end > begin && !madvise((void*) begin, end - begin, MADV_DONTNEED)) {
+        memset(words, 0, begin - (uintptr_t) words);
+        memset((void*) end, 0, (uintptr_t) (words + n) - end);
+        return;
+    }
+#endif
+    memset(words, 0, n * sizeof(Word));
+}
+
+// Puts vm back where VMLoadProgram(vm, from) left it: the program and its
+// decoded copy as translated, zeroed data and stack, fresh registers.
+// Used between runs of one program over many inputs.
+void VMRestart(BipcaVM* vm, const BipcaVM* from) {
+    Word size = from->decodedProgram.size + RESERVED;
+    memcpy(vm->memory, from->memory, (size_t) size * sizeof(Word));
+    _ZeroWords(vm->memory + size, (size_t) (vm->size + 1 - size));
+    const DecodedProgram* d = &from->decodedProgram;
+    memcpy(vm->decodedProgram.code, d->code, (size_t) d->size * sizeof(Instr));
+    if (d->linked) memcpy(vm->decodedProgram.linked, d->linked, (size_t) d->size);
+    else memset(vm->decodedProgram.linked, 0, (size_t) d->size);
+    vm->decodedProgram.size = d->size;
+    vm->decodedProgram.level = d->level;
+    vm->regs = (Registers) {.IP = RESERVED, .SP = vm->size, .FP = UNDEF, .RV = UNDEF};
+}
+
+#undef lines
+#undef files
+#undef identMap
+#undef program
+#undef current
+#undef oldCurrent
+#undef unit
+#undef plugins
+#undef decoded
+#undef codePages
+#undef jit
+#undef vmStdin
+#undef vmStdout
+
 #endif // BIPCA_IMPLEMENTATION
\ No newline at end of file
@@ -11,11 +11,15 @@ To create a plugin one must define three functions:
   Function that runs Before interpretating instruction.
 3. `void AfterExecution(void* userData, Command cmd)`
   Function that runs After interpretating instruction.
+Any of them may be NULL. A plugin may also ask only for some opcodes, take
+events (calls, returns, jumps, memory writes, I/O) and have
+`void FinishPlugin(void* userData)` run once the program halted, see
+`Plugin` in bipca.h.
 
 ## SOME USEFUL NOTES
 
 - All memory is words, `Word` type is an alias for `int32_t`;
-- virtual machine memory size is `SIZE`;
+- virtual machine memory size is `SIZE`, set at run time by SetMemorySize();
 - memory is an array of size `SIZE` and of type `Word` called `M`;
 - `RESERVED` number of words at the start of `M` are reserved so program
   starts at `M[RESERVED]`. This words should be always equal 0;
@@ -24,39 +28,743 @@ To create a plugin one must define three functions:
   it should not. **Note:** program size is not the <<actual>> size of a program,
   but a largest index such that M[index] is a part of translated program.
   So, `RESERVED` number of always-zero-words are de facto the part of the program; 
-- registers are stored in the global anonymous struct called `registers`;
+- registers are stored in the struct called `registers`;
+- `M`, `registers` and the translator's tables belong to the active VM
+  (`BipcaActiveVM()`), plugins always run on the VM that interprets;
 - `void PrintInstructionCoords(Word instructionIndex)` prints location of the
   instruction placed at M[instructionIndex] in format `file:row:col: `;
-- to access the instruction that is about to be executed in `BeforeExecution()`
-  check `M[registers.IP]` value;
+- `bool GetCoord(Word address, Coord* c)` looks that location up, the file
+  name is `BIPCA_FILES[c->filenameIndex]`;
+- in `BeforeExecution()` IP already points past the instruction that is
+  about to be executed, it is at `M[registers.IP - 1]`;
 - error messages mimics gcc style so a number of helpful macros and function like
   `PrintInstructionCoords()` mentioned above are provided.
 */
 
+#include <stdarg.h>
+
 #include "bipca.h"
 
+/////////////////////////
+// a-la static verifier
+/////////////////////////
+
+/*
+Abstract interpretation of the stack over [RESERVED, PROGRAM_SIZE). Every
+function (the program entry and each constant CALL target) is walked block
+by block, a block runs straight until a jump, call, return or the start of
+another block. A stack word is Top, a constant, an address on the stack,
+the return address or the caller's FP; FP is tracked the same way, so the
+usual `GETFP GETSP SETFP` frames and `GETSP n SUB SETSP` locals resolve.
+A function is verified when its depth agrees wherever paths join, all its
+returns leave the same depth and it has no computed jumps or calls. Its
+summary (words taken from the caller, depth left on return) is applied at
+every call site, recursion is solved by iterating the summaries to a fixed
+point. A store through a pointer that may reach the stack forgets every
+tracked word, the return address included, so a function doing one and
+returning afterwards is not verified.
+*/
+
+#define VERIFY_ARG_SLOTS 16      // caller words tracked below the return address
+#define VERIFY_SLOTS 48          // words tracked above it
+#define VERIFY_MAX_ITERATIONS 64
+
+typedef enum {
+    VERIFY_TOP,
+    VERIFY_UNDEF,  // allocated by SETSP, never written
+    VERIFY_CONST,
+    VERIFY_STACK,  // the stack word at height n
+    VERIFY_RET,    // the function's return address
+    VERIFY_FP0,    // FP of the caller
+} VerifyKind;
+
+typedef struct {
+    uint8_t kind;
+    Word n;
+} VerifyValue;
+
+// depth is the height of the top word, the return address sits at 0
+typedef struct {
+    Word depth;
+    VerifyValue fp;
+    VerifyValue slots[VERIFY_ARG_SLOTS + VERIFY_SLOTS];
+} VerifyState;
+
+typedef struct {
+    Word entry;
+    bool verified;
+    bool returns;    // effect is known
+    bool fpRestored; // every return leaves the caller's FP
+    bool reachesCaller; // may address the caller's words, not only pop them
+    Word effect;     // depth change of the caller once the call returns
+    Word need;       // caller words the function pops
+    Word low;        // lowest depth reached
+    Word high;       // highest depth reached, callees excluded
+    Word peak;       // highest depth with callees, -1 when unbounded
+    Word reasonAt;
+    char reason[96];
+} VerifyFunction;
+
+typedef struct {
+    int caller;
+    int callee;
+    Word depth; // height of the return address in the caller
+} VerifyCall;
+
+typedef struct {
+    int function;
+    Word from;
+    Word to;
+} VerifyRange;
+
+typedef struct {
+    Word programSize;
+    VerifyFunction* functions;
+    size_t nFunctions;
+    VerifyCall* calls;
+    size_t nCalls;
+    VerifyRange* ranges;
+    size_t nRanges;
+    size_t capFunctions, capCalls, capRanges;
+    uint8_t* proven;   // per word of the program region
+    uint8_t* written;  // constant SAVE targets
+    bool dynamic;      // a computed jump or call is reachable
+    Word peak;         // deepest stack from the entry, -1 when unbounded
+} StackProof;
+
+typedef struct {
+    Word start;
+    bool reached;
+    VerifyState in;
+} _VerifyBlock;
+
+typedef struct {
+    StackProof* proof;
+    int function;
+    VerifyFunction f; // summary being built, callers see the last pass's
+    VerifyState s;
+    Word at;
+    int32_t* blockAt;
+    _VerifyBlock* blocks;
+    size_t nBlocks;
+    size_t capBlocks;
+    size_t* work;
+    size_t nWork;
+    size_t capWork;
+} _Verifier;
+
+#define _VERIFY_CAPACITY(ptr, n, cap) \
+    ((n) < (cap) || ((cap) = (cap) ? 2 * (cap) : 64, \
+                     ((ptr) = realloc((ptr), (cap) * sizeof(*(ptr)))) != NULL))
+
+static void _VerifyFail(_Verifier* v, const char* fmt, ...) {
+    VerifyFunction* f = &v->f;
+    if (!f->verified) return;
+    f->verified = false;
+    f->reasonAt = v->at;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(f->reason, sizeof(f->reason), fmt, args);
+    va_end(args);
+}
+
+static VerifyValue* _VerifySlot(VerifyState* s, Word height) {
+    Word i = height + VERIFY_ARG_SLOTS;
+    if (i < 0 || i >= VERIFY_ARG_SLOTS + VERIFY_SLOTS) return NULL;
+    return &s->slots[i];
+}
+
+static void _VerifyPush(_Verifier* v, VerifyValue x) {
+    VerifyFunction* f = &v->f;
+    VerifyValue* slot = _VerifySlot(&v->s, ++v->s.depth);
+    if (slot) *slot = x;
+    if (v->s.depth > f->high) f->high = v->s.depth;
+}
+
+static VerifyValue _VerifyPop(_Verifier* v) {
+    VerifyFunction* f = &v->f;
+    VerifyValue* slot = _VerifySlot(&v->s, v->s.depth--);
+    if (v->s.depth < f->low) f->low = v->s.depth;
+    VerifyValue x = slot ? *slot : (VerifyValue) {VERIFY_TOP, 0};
+    if (x.kind == VERIFY_UNDEF) _VerifyFail(v, "pops a word that was never written");
+    return x;
+}
+
+static VerifyValue _VerifyJoin(VerifyValue a, VerifyValue b) {
+    if (a.kind == VERIFY_UNDEF || b.kind == VERIFY_UNDEF) return (VerifyValue) {VERIFY_UNDEF, 0};
+    if (a.kind == b.kind && a.n == b.n) return a;
+    return (VerifyValue) {VERIFY_TOP, 0};
+}
+
+static const char* _VerifyName(Word entry) {
+    if (entry == RESERVED) return "program entry";
+    for (size_t i = 0; i < BIPCA_IDENTS.capacity; i++) {
+        if (BIPCA_IDENTS.table[i].hash && BIPCA_IDENTS.table[i].value.isUserDefined
+            && !BIPCA_IDENTS.table[i].value.isConstant && BIPCA_IDENTS.table[i].value.address == entry) {
+            return BIPCA_IDENTS.arena + BIPCA_IDENTS.table[i].key;
+        }
+    }
+    return "function";
+}
+
+// index of the function entered at entry, added on first sight
+static int _VerifyFunctionAt(StackProof* proof, Word entry) {
+    for (size_t i = 0; i < proof->nFunctions; i++) {
+        if (proof->functions[i].entry == entry) return (int) i;
+    }
+    if (!_VERIFY_CAPACITY(proof->functions, proof->nFunctions, proof->capFunctions)) return -1;
+    proof->functions[proof->nFunctions] = (VerifyFunction) {.entry = entry, .verified = true};
+    return (int) proof->nFunctions++;
+}
+
+// merges the state into the block starting at addr, queueing it on change
+static bool _VerifyEdge(_Verifier* v, Word addr, const VerifyState* s) {
+    if (addr < RESERVED || addr >= v->proof->programSize) {
+        _VerifyFail(v, "jumps outside the program to %d", addr);
+        return false;
+    }
+    int32_t b = v->blockAt[addr - RESERVED];
+    if (b < 0) {
+        if (!_VERIFY_CAPACITY(v->blocks, v->nBlocks, v->capBlocks)) return true;
+        b = (int32_t) v->nBlocks++;
+        v->blocks[b] = (_VerifyBlock) {.start = addr, .reached = true, .in = *s};
+        v->blockAt[addr - RESERVED] = b;
+    } else {
+        _VerifyBlock* block = &v->blocks[b];
+        if (block->in.depth != s->depth) {
+            Word at = v->at;
+            v->at = addr;
+            _VerifyFail(v, "stack depth differs where paths join (%d and %d)",
+                        block->in.depth, s->depth);
+            v->at = at;
+            return false;
+        }
+        bool changed = false;
+        VerifyValue fp = _VerifyJoin(block->in.fp, s->fp);
+        changed |= fp.kind != block->in.fp.kind || fp.n != block->in.fp.n;
+        block->in.fp = fp;
+        for (size_t i = 0; i < VERIFY_ARG_SLOTS + VERIFY_SLOTS; i++) {
+            VerifyValue x = _VerifyJoin(block->in.slots[i], s->slots[i]);
+            changed |= x.kind != block->in.slots[i].kind || x.n != block->in.slots[i].n;
+            block->in.slots[i] = x;
+        }
+        if (!changed) return false;
+    }
+    if (!_VERIFY_CAPACITY(v->work, v->nWork, v->capWork)) return true;
+    v->work[v->nWork++] = (size_t) b;
+    return false;
+}
+
+static VerifyValue _VerifyConst(Word n) {
+    return (VerifyValue) {VERIFY_CONST, n};
+}
+
+static const VerifyValue _verifyTop = {VERIFY_TOP, 0};
+
+// applies the summary of the callee at target, false when the path ends
+static bool _VerifyCall(_Verifier* v, VerifyValue target) {
+    StackProof* proof = v->proof;
+    if (target.kind != VERIFY_CONST) {
+        proof->dynamic = true;
+        _VerifyFail(v, "computed call");
+        return false;
+    }
+    if (target.n < RESERVED || target.n >= proof->programSize) {
+        _VerifyFail(v, "calls outside the program at %d", target.n);
+        return false;
+    }
+    int g = _VerifyFunctionAt(proof, target.n);
+    if (g < 0 || !_VERIFY_CAPACITY(proof->calls, proof->nCalls, proof->capCalls)) {
+        _VerifyFail(v, "out of memory");
+        return false;
+    }
+    proof->calls[proof->nCalls++] = (VerifyCall) {v->function, g, v->s.depth + 1};
+    VerifyFunction callee = proof->functions[g];
+    if (!callee.verified) {
+        _VerifyFail(v, "calls %s, which is not verified", _VerifyName(callee.entry));
+        return false;
+    }
+    if (!callee.returns) return false;
+
+    VerifyFunction* f = &v->f;
+    Word depth = v->s.depth;
+    if (depth - callee.need < f->low) f->low = depth - callee.need;
+    Word after = depth + callee.effect;
+    for (Word h = depth - callee.need + 1; h <= (after > depth ? after : depth); h++) {
+        VerifyValue* slot = _VerifySlot(&v->s, h);
+        if (slot) *slot = _verifyTop;
+    }
+    v->s.depth = after;
+    if (after > f->high) f->high = after;
+    if (!callee.fpRestored) v->s.fp = _verifyTop;
+    if (callee.reachesCaller) f->reachesCaller = true;
+    return true;
+}
+
+static void _VerifyReturn(_Verifier* v, VerifyValue target) {
+    VerifyFunction* f = &v->f;
+    if (target.kind != VERIFY_RET) {
+        if (target.kind != VERIFY_CONST) v->proof->dynamic = true;
+        _VerifyFail(v, "computed jump");
+        return;
+    }
+    Word effect = v->s.depth + 1;
+    if (f->returns && f->effect != effect) {
+        _VerifyFail(v, "returns leave different depths (%d and %d)", f->effect, effect);
+        return;
+    }
+    f->returns = true;
+    f->effect = effect;
+    if (v->s.fp.kind != VERIFY_FP0) f->fpRestored = false;
+}
+
+// interprets the block b, the successors are merged into their blocks
+static bool _VerifyBlockRun(_Verifier* v, size_t b) {
+    StackProof* proof = v->proof;
+    VerifyFunction* f = &v->f;
+    Word start = v->blocks[b].start;
+    v->s = v->blocks[b].in;
+    VerifyValue x, y, z;
+    for (v->at = start; ; v->at++) {
+        Word at = v->at;
+        if (at >= proof->programSize) {
+            _VerifyFail(v, "runs past the end of the program");
+            break;
+        }
+        if (at != start && v->blockAt[at - RESERVED] >= 0) {
+            if (_VerifyEdge(v, at, &v->s)) return true;
+            break;
+        }
+        Word w = M[at];
+        if (w >= 0) {
+            _VerifyPush(v, _VerifyConst(w));
+            continue;
+        }
+        bool next = true;
+        switch ((Command) w) {
+        case ADD:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            if (x.kind == VERIFY_CONST && y.kind == VERIFY_CONST) {
+                _FoldConstant(&x.n, y.n, ADD);
+            } else if (x.kind == VERIFY_STACK && y.kind == VERIFY_CONST) {
+                x.n -= y.n;
+            } else if (x.kind == VERIFY_CONST && y.kind == VERIFY_STACK) {
+                x = (VerifyValue) {VERIFY_STACK, y.n - x.n};
+            } else {
+                if (x.kind == VERIFY_STACK || y.kind == VERIFY_STACK) f->reachesCaller = true;
+                x = _verifyTop;
+            }
+            _VerifyPush(v, x);
+            break;
+        case SUB:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            if (x.kind == VERIFY_CONST && y.kind == VERIFY_CONST) {
+                _FoldConstant(&x.n, y.n, SUB);
+            } else if (x.kind == VERIFY_STACK && y.kind == VERIFY_CONST) {
+                x.n += y.n;
+            } else if (x.kind == VERIFY_STACK && y.kind == VERIFY_STACK) {
+                x = _VerifyConst(y.n - x.n);
+            } else {
+                if (x.kind == VERIFY_STACK) f->reachesCaller = true;
+                x = _verifyTop;
+            }
+            _VerifyPush(v, x);
+            break;
+        case MUL: case DIV: case MOD: case BITAND: case BITOR: case BITXOR:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            if (x.kind != VERIFY_CONST || y.kind != VERIFY_CONST || !_FoldConstant(&x.n, y.n, w)) {
+                x = _verifyTop;
+            }
+            _VerifyPush(v, x);
+            break;
+        case LSHIFT: case RSHIFT: case CMP:
+            _VerifyPop(v); _VerifyPop(v);
+            _VerifyPush(v, _verifyTop);
+            break;
+        case LOAD:
+            x = _VerifyPop(v);
+            if (x.kind == VERIFY_STACK && x.n <= 0) f->reachesCaller = true;
+            _VerifyPush(v, _verifyTop);
+            break;
+        case NEG: case BITNOT:
+            _VerifyPop(v);
+            _VerifyPush(v, _verifyTop);
+            break;
+        case DUP:
+            x = _VerifyPop(v);
+            _VerifyPush(v, x); _VerifyPush(v, x);
+            break;
+        case DROP: case SETRV: case OUT:
+            _VerifyPop(v);
+            break;
+        case SWAP:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            _VerifyPush(v, y); _VerifyPush(v, x);
+            break;
+        case ROT:
+            z = _VerifyPop(v); y = _VerifyPop(v); x = _VerifyPop(v);
+            _VerifyPush(v, y); _VerifyPush(v, z); _VerifyPush(v, x);
+            break;
+        case OVER:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            _VerifyPush(v, x); _VerifyPush(v, y); _VerifyPush(v, x);
+            break;
+        case SDROP:
+            y = _VerifyPop(v); _VerifyPop(v);
+            _VerifyPush(v, y);
+            break;
+        case DROP2:
+            _VerifyPop(v); _VerifyPop(v);
+            break;
+        case SAVE:
+            y = _VerifyPop(v); x = _VerifyPop(v);
+            if (x.kind == VERIFY_STACK && x.n <= 0) f->reachesCaller = true;
+            if (x.kind == VERIFY_STACK) {
+                VerifyValue* slot = _VerifySlot(&v->s, x.n);
+                if (slot) *slot = y;
+            } else if (x.kind == VERIFY_CONST && x.n < proof->programSize) {
+                if (x.n >= RESERVED) proof->written[x.n - RESERVED] = 1;
+            } else {
+                for (size_t i = 0; i < VERIFY_ARG_SLOTS + VERIFY_SLOTS; i++) {
+                    if (v->s.slots[i].kind != VERIFY_UNDEF) v->s.slots[i] = _verifyTop;
+                }
+            }
+            break;
+        case GETIP:
+            _VerifyPush(v, _VerifyConst(at + 1));
+            break;
+        case GETSP:
+            _VerifyPush(v, (VerifyValue) {VERIFY_STACK, v->s.depth});
+            break;
+        case GETFP:
+            if (v->s.fp.kind == VERIFY_FP0) f->reachesCaller = true;
+            _VerifyPush(v, v->s.fp);
+            break;
+        case GETRV: case IN:
+            _VerifyPush(v, _verifyTop);
+            break;
+        case SETSP:
+            x = _VerifyPop(v);
+            if (x.kind != VERIFY_STACK) {
+                _VerifyFail(v, "sets SP to a value not derived from SP");
+                next = false;
+                break;
+            }
+            for (Word h = v->s.depth + 1; h <= x.n; h++) {
+                VerifyValue* slot = _VerifySlot(&v->s, h);
+                if (slot) *slot = (VerifyValue) {VERIFY_UNDEF, 0};
+            }
+            v->s.depth = x.n;
+            if (x.n > f->high) f->high = x.n;
+            if (x.n < f->low) f->low = x.n;
+            break;
+        case SETFP:
+            v->s.fp = _VerifyPop(v);
+            break;
+        case JMP:
+            x = _VerifyPop(v);
+            if (x.kind == VERIFY_CONST) {
+                if (_VerifyEdge(v, x.n, &v->s)) return true;
+            } else {
+                _VerifyReturn(v, x);
+            }
+            next = false;
+            break;
+        case RET2:
+            x = _VerifyPop(v);
+            _VerifyPop(v);
+            _VerifyReturn(v, x);
+            next = false;
+            break;
+        case JLT: case JGT: case JEQ: case JLE: case JGE: case JNE:
+            x = _VerifyPop(v);
+            _VerifyPop(v);
+            if (x.kind != VERIFY_CONST) {
+                proof->dynamic = true;
+                _VerifyFail(v, "computed branch");
+                next = false;
+            } else if (_VerifyEdge(v, x.n, &v->s)) {
+                return true;
+            }
+            break;
+        case CALL:
+            next = _VerifyCall(v, _VerifyPop(v));
+            break;
+        case HALT:
+            _VerifyPop(v);
+            next = false;
+            break;
+        default:
+            _VerifyFail(v, "unknown instruction %d", w);
+            next = false;
+            break;
+        }
+        if (!next || !f->verified) break;
+    }
+    if (!_VERIFY_CAPACITY(proof->ranges, proof->nRanges, proof->capRanges)) return true;
+    proof->ranges[proof->nRanges++] = (VerifyRange) {v->function, start, v->at + 1};
+    return false;
+}
+
+// walks one function, its summary is replaced once the walk is done
+static bool _VerifyFunction(_Verifier* v, int function) {
+    StackProof* proof = v->proof;
+    VerifyFunction* f = &v->f;
+    Word entry = proof->functions[function].entry;
+    *f = (VerifyFunction) {.entry = entry, .verified = true, .fpRestored = true};
+    for (size_t i = 0; i < v->nBlocks; i++) v->blockAt[v->blocks[i].start - RESERVED] = -1;
+    v->nBlocks = 0;
+    v->nWork = 0;
+    v->function = function;
+    v->at = entry;
+
+    VerifyState s = {.fp = {VERIFY_FP0, 0}};
+    for (size_t i = 0; i < VERIFY_ARG_SLOTS + VERIFY_SLOTS; i++) s.slots[i] = _verifyTop;
+    // the program entry starts on an empty stack, functions on their return address
+    if (entry != RESERVED) *_VerifySlot(&s, 0) = (VerifyValue) {VERIFY_RET, 0};
+    if (_VerifyEdge(v, entry, &s)) return true;
+    while (v->nWork > 0 && f->verified) {
+        if (_VerifyBlockRun(v, v->work[--v->nWork])) return true;
+    }
+    if (entry == RESERVED && f->verified && f->low < 0) {
+        v->at = entry;
+        _VerifyFail(v, "pops an empty stack");
+    }
+    f->need = f->low < -1 ? -1 - f->low : 0;
+    proof->functions[function] = *f;
+    return false;
+}
+
+// highest depth of function i with its callees, -1 when unbounded
+static Word _VerifyPeak(StackProof* proof, int i, uint8_t* mark) {
+    VerifyFunction* f = &proof->functions[i];
+    if (mark[i] == 2) return f->peak;
+    if (mark[i] == 1) return -1;
+    mark[i] = 1;
+    Word peak = f->high;
+    for (size_t k = 0; k < proof->nCalls && peak >= 0; k++) {
+        if (proof->calls[k].caller != i) continue;
+        Word callee = _VerifyPeak(proof, proof->calls[k].callee, mark);
+        if (callee < 0) peak = -1;
+        else if (proof->calls[k].depth + callee > peak) peak = proof->calls[k].depth + callee;
+    }
+    mark[i] = 2;
+    f->peak = peak;
+    return peak;
+}
+
+// a literal word not consumed right away by CALL, JMP or a branch
+static bool _VerifyEscapes(Word at, Word size) {
+    if (M[at] < RESERVED) return false;
+    Word next = at + 1 < size ? M[at + 1] : 0;
+    switch (next) {
+    case CALL: case JMP: case JLT: case JGT: case JEQ: case JLE: case JGE: case JNE:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Builds the proof for the translated program, true on error.
+bool VerifyStack(StackProof* proof) {
+    *proof = (StackProof) {0};
+    if (GetProgramSize(&proof->programSize)) return true;
+    Word size = proof->programSize - RESERVED;
+    _Verifier v = {.proof = proof};
+    proof->proven = (uint8_t*) calloc((size_t) size + 1, 1);
+    proof->written = (uint8_t*) calloc((size_t) size + 1, 1);
+    v.blockAt = (int32_t*) malloc(((size_t) size + 1) * sizeof(int32_t));
+    if (!proof->proven || !proof->written || !v.blockAt) return true;
+    for (Word i = 0; i < size; i++) v.blockAt[i] = -1;
+    if (_VerifyFunctionAt(proof, RESERVED) < 0) return true;
+
+    // every pass walks all functions against the summaries of the last one
+    bool converged = false;
+    for (int pass = 0; pass < VERIFY_MAX_ITERATIONS && !converged; pass++) {
+        proof->nCalls = proof->nRanges = 0;
+        proof->dynamic = false;
+        memset(proof->written, 0, (size_t) size);
+        converged = true;
+        for (size_t i = 0; i < proof->nFunctions; i++) {
+            VerifyFunction old = proof->functions[i];
+            size_t nFunctions = proof->nFunctions;
+            if (_VerifyFunction(&v, (int) i)) return true;
+            VerifyFunction* f = &proof->functions[i];
+            if (old.verified != f->verified || old.returns != f->returns
+                || old.effect != f->effect || old.need != f->need
+                || old.fpRestored != f->fpRestored || old.reachesCaller != f->reachesCaller
+                || nFunctions != proof->nFunctions) {
+                converged = false;
+            }
+        }
+    }
+    free(v.blockAt);
+    free(v.blocks);
+    free(v.work);
+    for (size_t i = 0; i < proof->nFunctions && !converged; i++) {
+        VerifyFunction* f = &proof->functions[i];
+        if (!f->verified) continue;
+        f->verified = false;
+        f->reasonAt = f->entry;
+        snprintf(f->reason, sizeof(f->reason), "stack effect does not settle");
+    }
+
+    // code the program writes to or may reach through a computed jump
+    Word* escaped = (Word*) calloc((size_t) size + 1, sizeof(Word));
+    if (!escaped) return true;
+    for (Word at = RESERVED; at < proof->programSize; at++) {
+        if (M[at] < proof->programSize && _VerifyEscapes(at, proof->programSize)) {
+            escaped[M[at] - RESERVED] = at;
+        }
+    }
+    bool selfModifying = false;
+    for (size_t r = 0; r < proof->nRanges; r++) {
+        const VerifyRange* range = &proof->ranges[r];
+        VerifyFunction* f = &proof->functions[range->function];
+        for (Word at = range->from; at < range->to && at < proof->programSize; at++) {
+            if (proof->written[at - RESERVED]) selfModifying = true;
+            if (proof->dynamic && f->verified && escaped[at - RESERVED]) {
+                f->verified = false;
+                f->reasonAt = escaped[at - RESERVED];
+                snprintf(f->reason, sizeof(f->reason),
+                         "address %d is taken, a computed jump may enter there", at);
+            }
+        }
+    }
+    free(escaped);
+
+    // a function is only as safe as its callers and callees
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t k = 0; k < proof->nCalls; k++) {
+            VerifyFunction* caller = &proof->functions[proof->calls[k].caller];
+            VerifyFunction* callee = &proof->functions[proof->calls[k].callee];
+            if (caller->verified && !callee->verified) {
+                caller->verified = false;
+                caller->reasonAt = caller->entry;
+                snprintf(caller->reason, sizeof(caller->reason),
+                         "calls %s, which is not verified", _VerifyName(callee->entry));
+                changed = true;
+            } else if (!caller->verified && callee->verified) {
+                callee->verified = false;
+                callee->reasonAt = callee->entry;
+                snprintf(callee->reason, sizeof(callee->reason),
+                         "called from %s, which is not verified", _VerifyName(caller->entry));
+                changed = true;
+            }
+        }
+    }
+
+    uint8_t* mark = (uint8_t*) calloc(proof->nFunctions, 1);
+    if (!mark) return true;
+    proof->peak = _VerifyPeak(proof, 0, mark);
+    for (size_t i = 0; i < proof->nFunctions; i++) _VerifyPeak(proof, (int) i, mark);
+    free(mark);
+
+    if (selfModifying) {
+        for (size_t i = 0; i < proof->nFunctions; i++) {
+            VerifyFunction* f = &proof->functions[i];
+            if (!f->verified) continue;
+            f->verified = false;
+            f->reasonAt = f->entry;
+            snprintf(f->reason, sizeof(f->reason), "the program writes to its own code");
+        }
+    }
+    // a word shared with an unverified function stays checked
+    for (size_t r = 0; r < proof->nRanges; r++) {
+        const VerifyRange* range = &proof->ranges[r];
+        if (!proof->functions[range->function].verified) continue;
+        for (Word at = range->from; at < range->to && at < proof->programSize; at++) {
+            proof->proven[at - RESERVED] = 1;
+        }
+    }
+    for (size_t r = 0; r < proof->nRanges; r++) {
+        const VerifyRange* range = &proof->ranges[r];
+        if (proof->functions[range->function].verified) continue;
+        for (Word at = range->from; at < range->to && at < proof->programSize; at++) {
+            proof->proven[at - RESERVED] = 0;
+        }
+    }
+    return false;
+}
+
+bool IsStackProven(const StackProof* proof, Word addr) {
+    return addr >= RESERVED && addr < proof->programSize && proof->proven[addr - RESERVED];
+}
+
+// For OptimizeProgram(): a `CALL RET` may jump to the function at entry
+// when it leaves the caller's words alone, the return address included,
+// and returns with nothing pushed. It then runs the same one word lower.
+bool CanTailCall(Word entry, void* data) {
+    const StackProof* proof = (const StackProof*) data;
+    for (size_t i = 0; i < proof->nFunctions; i++) {
+        const VerifyFunction* f = &proof->functions[i];
+        if (f->entry != entry) continue;
+        return f->verified && f->returns && f->need == 0 && f->effect == 0
+            && f->fpRestored && !f->reachesCaller;
+    }
+    return false;
+}
+
+void FreeStackProof(StackProof* proof) {
+    free(proof->functions);
+    free(proof->calls);
+    free(proof->ranges);
+    free(proof->proven);
+    free(proof->written);
+    *proof = (StackProof) {0};
+}
+
+void PrintStackProof(const StackProof* proof) {
+    printf("-----------" TEXT_BOLD("STACK PROOF") "----------\n");
+    size_t verified = 0;
+    for (size_t i = 0; i < proof->nFunctions; i++) {
+        const VerifyFunction* f = &proof->functions[i];
+        if (f->verified) {
+            verified++;
+            continue;
+        }
+        PrintInstructionCoords(f->reasonAt);
+        printf("%s not verified: %s\n", _VerifyName(f->entry), f->reason);
+    }
+    Word proven = 0;
+    for (Word i = 0; i < proof->programSize - RESERVED; i++) proven += proof->proven[i];
+    printf("functions verified: %zu of %zu, words proven: %d of %d\n",
+           verified, proof->nFunctions, proven, proof->programSize - RESERVED);
+    if (proof->peak >= 0) {
+        printf("stack depth bounded by %d words\n", proof->peak);
+    } else {
+        printf("stack depth unbounded (recursion)\n");
+    }
+    printf("--------------------------------\n");
+}
+
 /////////////////////////
 // a-la valgrind 
 /////////////////////////
 typedef struct {
-    bool isDefined[SIZE];
     bool isDefIP;
     bool isDefSP;
     bool isDefFP;
     bool isDefRV;
     Word progSize;
+    StackProof proof;  // stack checks are skipped where it holds
+    bool checkStack;
+    bool isDefined[];  // SIZE entries
 } MemOverseerData;
 
 bool InitMemOverseer(void** userData) { 
-    MemOverseerData* od = (MemOverseerData*) calloc(1, sizeof(MemOverseerData));
+    MemOverseerData* od = (MemOverseerData*) calloc(1, sizeof(MemOverseerData) + (size_t) SIZE);
     if (!od) { return true; }
     if (GetProgramSize(&od->progSize)) { return true; }
+    if (VerifyStack(&od->proof)) { return true; }
     // od->isDefined = {false, false, ..., false} 'cause of calloc()
     *userData = (void*) od;
     return false;
 }
 
 bool CheckStackPop(MemOverseerData* od, int n) {
+    if (!od->checkStack) return false;
     Word from = registers.SP;
     Word to = registers.SP + n;
     bool underflowFlag = false;
@@ -87,12 +795,15 @@ void BeforeExecMemOverseer(void* userData, Command cmd) {
         printf("    RESERVED = %d\n", RESERVED);
         printf("    PROGRAM_SIZE = %d\n", od->progSize);
     }
-    // check SP
-    if (!(od->progSize < registers.SP)) {
+    // check SP, proven code keeps it within the words it pushed
+    bool proven = IsStackProven(&od->proof, registers.IP);
+    bool bounded = od->proof.peak >= 0 && od->proof.peak < SIZE - od->progSize;
+    od->checkStack = !proven;
+    if (!(proven && bounded) && !(od->progSize < registers.SP)) {
         printf(TEXT_BOLD_CYAN("WARNING:") " stack overflow, SP <= PROGRAM_SIZE\n");
         printf("    SP = %d\n", registers.SP);
         printf("    PROGRAM_SIZE = %d\n", od->progSize);
-    } else if (!(registers.SP <= SIZE)) {
+    } else if (!proven && !(registers.SP <= SIZE)) {
         printf(TEXT_BOLD_CYAN("WARNING:") " stack underflow, SP > SIZE\n");
         printf("    SP = %d\n", registers.SP);
         printf("    SIZE = %d\n", SIZE);
@@ -434,10 +1145,10 @@ void AfterExecMemoryDump(void* userData, Command cmd) {
     (void) userData;
     (void) cmd;
     CheckReservedMemoryAndRegisters();
-    size_t minZerosWindow = 8;
-    size_t i = RESERVED;
-    size_t zeros_start = 0;
-    size_t zeros_end = 0;
+    Word minZerosWindow = 8;
+    Word i = RESERVED;
+    Word zeros_start = 0;
+    Word zeros_end = 0;
     printf("-------" TEXT_BOLD("MAIN MEMORY START") "--------\n");
     while (i < SIZE) {
         if (M[i] == 0) {
@@ -447,23 +1158,23 @@ void AfterExecMemoryDump(void* userData, Command cmd) {
             }
             zeros_end = i - 1;
             if (zeros_end - zeros_start + 1 > minZerosWindow) {
-                printf("[%08lX] %8X  (%d)\n", zeros_start, M[zeros_start], M[zeros_start]);
+                printf("[%08X] %8X  (%d)\n", zeros_start, M[zeros_start], M[zeros_start]);
                 printf("...\n");
-                printf("[%08lX] %8X  (%d)\n", zeros_end, M[zeros_end], M[zeros_end]);
+                printf("[%08X] %8X  (%d)\n", zeros_end, M[zeros_end], M[zeros_end]);
             } else {
-                for (size_t j = zeros_start; j < zeros_end + 1; j++) {
-                    printf("[%08lX] %8X  (%d)\n", i, M[j], M[j]);
+                for (Word j = zeros_start; j < zeros_end + 1; j++) {
+                    printf("[%08X] %8X  (%d)\n", i, M[j], M[j]);
                 }
             }
             
             continue;
         } else {
             if (registers.SP == i) {
-                printf(TEXT_BOLD("[%08lX] %8X  (%d)") TEXT_BOLD_GREEN(" < SP") "\n", i, M[i], M[i]);    
+                printf(TEXT_BOLD("[%08X] %8X  (%d)") TEXT_BOLD_GREEN(" < SP") "\n", i, M[i], M[i]);    
             } else if (registers.IP == i) {
-                printf(TEXT_BOLD("[%08lX] %8X  (%d)") TEXT_BOLD_GREEN(" < IP") "\n", i, M[i], M[i]);    
+                printf(TEXT_BOLD("[%08X] %8X  (%d)") TEXT_BOLD_GREEN(" < IP") "\n", i, M[i], M[i]);    
             } else {
-                printf("[%08lX] %8X  (%d)\n", i, M[i], M[i]);
+                printf("[%08X] %8X  (%d)\n", i, M[i], M[i]);
             }
             i++;
             continue;
@@ -484,4 +1195,306 @@ Plugin MemoryDumpPlugin = (Plugin) {
     .InitPlugin = PLUGIN_INIT_DUMMY,
     .BeforeExecution = PLUGIN_BEFORE_EXEC_DUMMY,
     .AfterExecution = AfterExecMemoryDump,
-};
\ No newline at end of file
+};
+
+/////////////////////////
+// a-la perf
+/////////////////////////
+
+// Counts the executed words by address, by opcode and by calling context:
+// a tree of the call chains seen so far, a node counting the words run
+// while it is the innermost call. The shadow call stack follows CALL and
+// the returns to the address after it: RET2, and JMP as RET is encoded.
+// Nothing is printed until the program halts. With profilerPeriod above 1
+// the words are sampled instead: one in period on average, the gaps drawn
+// at random so a loop of period words is not always caught at one word.
+// The call tree stays exact, only the counts are samples.
+
+#define PROFILER_HOT_WORDS 10
+#define PROFILER_NONE SIZE_MAX
+
+const char* profilerFoldedPath = NULL; // folded stacks for flamegraph.pl, if set
+uint32_t profilerPeriod = 1;           // words per sample, 1 counts every word
+
+typedef struct {
+    Word entry;          // address the call went to, RESERVED for the root
+    size_t function;
+    size_t parent;
+    size_t firstChild;   // 0 for none, the root is nobody's child
+    size_t nextSibling;
+    uint64_t calls;
+    uint64_t self;       // words run while innermost
+} ProfilerNode;
+
+typedef struct {
+    Word returnTo;
+    size_t caller;       // node to go back to
+} ProfilerFrame;
+
+typedef struct {
+    Word entry;
+    const char* name;    // label at entry, NULL if there is none
+    uint64_t calls;
+    uint64_t inclusive;  // recursive calls are counted once
+    uint64_t exclusive;
+} ProfilerFunction;
+
+typedef struct {
+    ProfilerNode* nodes;
+    size_t nNodes;
+    size_t capNodes;
+    ProfilerFrame* stack;
+    size_t depth;
+    size_t capStack;
+    ProfilerFunction* functions;
+    size_t nFunctions;
+    size_t capFunctions;
+    size_t innermost;    // node of the running call
+    bool outOfMemory;    // calls past it are counted in their callers
+    uint64_t outside;    // words run beyond the program
+    uint32_t period;
+    uint32_t countdown;  // words to the next sample
+    uint64_t random;     // xorshift state of the gaps
+    uint64_t perOp[N_OPS];
+    Word nWords;
+    uint64_t perWord[];  // nWords entries
+} ProfilerData;
+
+// room for n items of size bytes, false when out of memory
+static bool _ProfilerReserve(void** items, size_t* cap, size_t n, size_t size) {
+    if (n <= *cap) return true;
+    size_t grown = *cap ? 2 * *cap : 64;
+    void* p = realloc(*items, grown * size);
+    if (!p) return false;
+    *items = p;
+    *cap = grown;
+    return true;
+}
+
+static size_t _ProfilerNewNode(ProfilerData* pd, Word entry, size_t parent) {
+    size_t f = 0;
+    while (f < pd->nFunctions && pd->functions[f].entry != entry) f++;
+    if (f == pd->nFunctions) {
+        if (!_ProfilerReserve((void**) &pd->functions, &pd->capFunctions, f + 1, sizeof(ProfilerFunction))) {
+            return PROFILER_NONE;
+        }
+        pd->functions[pd->nFunctions++] = (ProfilerFunction) {.entry = entry};
+    }
+    if (!_ProfilerReserve((void**) &pd->nodes, &pd->capNodes, pd->nNodes + 1, sizeof(ProfilerNode))) {
+        return PROFILER_NONE;
+    }
+    size_t n = pd->nNodes++;
+    pd->nodes[n] = (ProfilerNode) {.entry = entry, .function = f, .parent = parent};
+    if (parent != PROFILER_NONE) {
+        pd->nodes[n].nextSibling = pd->nodes[parent].firstChild;
+        pd->nodes[parent].firstChild = n;
+    }
+    return n;
+}
+
+bool InitProfiler(void** userData) {
+    Word programSize;
+    if (GetProgramSize(&programSize)) return true;
+    ProfilerData* pd = (ProfilerData*) calloc(1, sizeof(ProfilerData) + ((size_t) programSize + 1) * sizeof(uint64_t));
+    if (!pd) return true;
+    *userData = (void*) pd;
+    pd->nWords = programSize + 1;
+    pd->period = profilerPeriod > 1 ? profilerPeriod : 1;
+    pd->countdown = pd->period;
+    pd->random = 0x9E3779B97F4A7C15ull;
+    return _ProfilerNewNode(pd, RESERVED, PROFILER_NONE) == PROFILER_NONE;
+}
+
+void BeforeExecProfiler(void* userData, Command cmd) {
+    ProfilerData* pd = (ProfilerData*) userData;
+    if (--pd->countdown) return;
+    if (pd->period > 1) {
+        // gaps of 1 .. 2 * period - 1 words, period on average
+        pd->random ^= pd->random << 13;
+        pd->random ^= pd->random >> 7;
+        pd->random ^= pd->random << 17;
+        pd->countdown = 1 + (uint32_t) (pd->random % (2 * (uint64_t) pd->period - 1));
+    } else {
+        pd->countdown = 1;
+    }
+    Word at = registers.IP - 1;
+    if ((uint32_t) at < (uint32_t) pd->nWords) pd->perWord[at]++;
+    else pd->outside++;
+    pd->perOp[DecodeWord(cmd)]++;
+    pd->nodes[pd->innermost].self++;
+}
+
+void OnCallProfiler(void* userData, Word from, Word to) {
+    ProfilerData* pd = (ProfilerData*) userData;
+    size_t child = pd->nodes[pd->innermost].firstChild;
+    while (child && pd->nodes[child].entry != to) child = pd->nodes[child].nextSibling;
+    if (!child) child = _ProfilerNewNode(pd, to, pd->innermost);
+    if (child == PROFILER_NONE
+        || !_ProfilerReserve((void**) &pd->stack, &pd->capStack, pd->depth + 1, sizeof(ProfilerFrame))) {
+        pd->outOfMemory = true;
+        return;
+    }
+    pd->stack[pd->depth++] = (ProfilerFrame) {from + 1, pd->innermost};
+    pd->innermost = child;
+    pd->nodes[child].calls++;
+}
+
+// RET2 and any jump back to where the innermost call came from
+void OnReturnProfiler(void* userData, Word from, Word to) {
+    (void) from;
+    ProfilerData* pd = (ProfilerData*) userData;
+    if (pd->depth > 0 && pd->stack[pd->depth - 1].returnTo == to) {
+        pd->innermost = pd->stack[--pd->depth].caller;
+    }
+}
+
+static const char* _ProfilerName(const ProfilerFunction* f, char buf[static 16]) {
+    if (f->name) return f->name;
+    if (f->entry == RESERVED) return "[program]";
+    snprintf(buf, 16, "[@%d]", f->entry);
+    return buf;
+}
+
+static int _ProfilerByInclusive(const void* a, const void* b) {
+    uint64_t x = ((const ProfilerFunction*) a)->inclusive;
+    uint64_t y = ((const ProfilerFunction*) b)->inclusive;
+    return (x < y) - (x > y);
+}
+
+// Walks the tree once: sums the functions, writes a folded stack per node
+// that ran words itself, true when out of memory.
+static bool _ProfilerWalk(ProfilerData* pd, FILE* folded) {
+    uint64_t* total = (uint64_t*) malloc(pd->nNodes * sizeof(uint64_t));
+    size_t* onPath = (size_t*) calloc(pd->nFunctions, sizeof(size_t));
+    size_t* path = (size_t*) malloc(pd->nNodes * sizeof(size_t));
+    if (!total || !onPath || !path) {
+        free(total);
+        free(onPath);
+        free(path);
+        return true;
+    }
+    // children are created after their parents
+    for (size_t n = 0; n < pd->nNodes; n++) total[n] = pd->nodes[n].self;
+    for (size_t n = pd->nNodes - 1; n > 0; n--) total[pd->nodes[n].parent] += total[n];
+
+    size_t depth = 0;
+    size_t n = 0;
+    while (true) {
+        const ProfilerNode* node = &pd->nodes[n];
+        ProfilerFunction* f = &pd->functions[node->function];
+        if (onPath[node->function]++ == 0) f->inclusive += total[n];
+        f->exclusive += node->self;
+        f->calls += node->calls;
+        path[depth++] = n;
+        if (folded && node->self > 0) {
+            for (size_t i = 0; i < depth; i++) {
+                char buf[16];
+                if (i > 0) fputc(';', folded);
+                fputs(_ProfilerName(&pd->functions[pd->nodes[path[i]].function], buf), folded);
+            }
+            fprintf(folded, " %" PRIu64 "\n", node->self);
+        }
+        if (node->firstChild) {
+            n = node->firstChild;
+            continue;
+        }
+        while (depth > 0) {
+            size_t done = path[--depth];
+            onPath[pd->nodes[done].function]--;
+            if (depth > 0 && pd->nodes[done].nextSibling) break;
+        }
+        if (depth == 0) break;
+        n = pd->nodes[path[depth]].nextSibling;
+    }
+    free(total);
+    free(onPath);
+    free(path);
+    return false;
+}
+
+void FinishProfiler(void* userData) {
+    ProfilerData* pd = (ProfilerData*) userData;
+    if (!pd) return;
+
+    for (size_t i = 0; i < BIPCA_IDENTS.capacity; i++) {
+        const IdentSlot* slot = &BIPCA_IDENTS.table[i];
+        if (!slot->hash || !slot->value.isUserDefined || slot->value.isConstant) continue;
+        for (size_t f = 0; f < pd->nFunctions; f++) {
+            if (!pd->functions[f].name && pd->functions[f].entry == slot->value.address) {
+                pd->functions[f].name = BIPCA_IDENTS.arena + slot->key;
+            }
+        }
+    }
+
+    FILE* folded = NULL;
+    if (profilerFoldedPath) {
+        folded = fopen(profilerFoldedPath, "w");
+        if (!folded) fprintf(stderr, "unable to write \"%s\"\n", profilerFoldedPath);
+    }
+    bool err = _ProfilerWalk(pd, folded);
+    if (folded) fclose(folded);
+
+    uint64_t words = pd->outside;
+    for (Word i = 0; i < pd->nWords; i++) words += pd->perWord[i];
+    printf("-------------" TEXT_BOLD("PROFILE") "------------\n");
+    if (pd->period > 1) {
+        printf("words sampled: %" PRIu64 ", one in %" PRIu32 ", %" PRIu64 " beyond the program\n",
+               words, pd->period, pd->outside);
+    } else {
+        printf("words executed: %" PRIu64 ", %" PRIu64 " beyond the program\n", words, pd->outside);
+    }
+    if (err || pd->outOfMemory) {
+        printf(TEXT_BOLD_CYAN("WARNING:") " out of memory, the counts by label are incomplete\n");
+    }
+
+    qsort(pd->functions, pd->nFunctions, sizeof(ProfilerFunction), _ProfilerByInclusive);
+    printf("%-24s %10s %14s %14s  %s\n", "label", "calls", "inclusive", "exclusive", "location");
+    for (size_t f = 0; f < pd->nFunctions; f++) {
+        const ProfilerFunction* fn = &pd->functions[f];
+        char buf[16];
+        printf("%-24s %10" PRIu64 " %14" PRIu64 " %14" PRIu64 "  ",
+               _ProfilerName(fn, buf), fn->calls, fn->inclusive, fn->exclusive);
+        Coord c;
+        if (GetCoord(fn->entry, &c)) printf("%s:%zu\n", BIPCA_FILES[c.filenameIndex], c.pos.row + 1);
+        else printf("<no source>\n");
+    }
+
+    const char* counted = pd->period > 1 ? "samples" : "executed";
+    printf("%-24s %14s\n", "opcode", counted);
+    for (Op op = 0; op < N_OPS; op++) {
+        if (pd->perOp[op]) printf("%-24s %14" PRIu64 "\n", OpName(op), pd->perOp[op]);
+    }
+
+    Word hot[PROFILER_HOT_WORDS];
+    size_t nHot = 0;
+    for (Word i = 0; i < pd->nWords; i++) {
+        if (!pd->perWord[i]) continue;
+        size_t k = nHot;
+        if (k < PROFILER_HOT_WORDS) nHot++;
+        else if (pd->perWord[hot[--k]] >= pd->perWord[i]) continue;
+        for (; k > 0 && pd->perWord[hot[k - 1]] < pd->perWord[i]; k--) hot[k] = hot[k - 1];
+        hot[k] = i;
+    }
+    printf("%-24s %14s\n", "hottest words", counted);
+    for (size_t k = 0; k < nHot; k++) {
+        Coord c;
+        printf("[%08X] %-13s %14" PRIu64 "  ", hot[k], OpName(DecodeWord(M[hot[k]])), pd->perWord[hot[k]]);
+        if (GetCoord(hot[k], &c)) printf("%s:%zu:%zu\n", BIPCA_FILES[c.filenameIndex], c.pos.row + 1, c.pos.col + 1);
+        else printf("<no source>\n");
+    }
+    printf("--------------------------------\n");
+
+    free(pd->nodes);
+    free(pd->stack);
+    free(pd->functions);
+}
+
+Plugin ProfilerPlugin = (Plugin) {
+    .name = "Profiler",
+    .InitPlugin = InitProfiler,
+    .BeforeExecution = BeforeExecProfiler,
+    .OnCall = OnCallProfiler,
+    .OnReturn = OnReturnProfiler,
+    .OnJump = OnReturnProfiler,
+    .FinishPlugin = FinishProfiler,
+};
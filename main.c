@@ -1,10 +1,174 @@
 #include "c-flags/single-header/c-flags.h"
 #include <inttypes.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define BIPCA_IMPLEMENTATION
 #include "bipca.h"
 #include "chemodan.h"
 
+// --batch: the program translated once, run over every file of a
+// directory by a pool of threads, each with a VM of its own
+typedef struct {
+    const BipcaVM* image;     // translated program, only read by the workers
+    InterpretParams params;
+    const char* inputDir;
+    const char* outputDir;
+    char** names;
+    size_t size;
+    atomic_size_t next;       // first input no worker has taken yet
+    double* latencies;        // seconds per input, -1 when it failed
+    size_t* bytes;            // input sizes
+} Batch;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static int CompareNames(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static int CompareLatencies(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// regular files of dir sorted by name, true on error
+static bool ListInputs(const char* dir, char*** names, size_t* size) {
+    DIR* d = opendir(dir);
+    if (!d) return true;
+    size_t capacity = 64;
+    *names = (char**) malloc(capacity * sizeof(char*));
+    *size = 0;
+    char path[PATH_MAX];
+    struct dirent* entry;
+    struct stat st;
+    while (*names && (entry = readdir(d))) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+        if (*size == capacity) {
+            capacity *= 2;
+            char** grown = (char**) realloc(*names, capacity * sizeof(char*));
+            if (!grown) break;
+            *names = grown;
+        }
+        (*names)[(*size)++] = strdup(entry->d_name);
+    }
+    closedir(d);
+    if (!*names) return true;
+    qsort(*names, *size, sizeof(char*), CompareNames);
+    return false;
+}
+
+static void* BatchWorker(void* arg) {
+    Batch* batch = (Batch*) arg;
+    BipcaVM* vm = NewVM();
+    if (!vm || VMLoadProgram(vm, batch->image)) {
+        fprintf(stderr, "not enough memory for a batch worker\n");
+        FreeVM(vm);
+        return NULL;
+    }
+    BipcaSetActiveVM(vm);
+    char inputPath[PATH_MAX], outputPath[PATH_MAX];
+    size_t i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->size) {
+        double start = Now();
+        snprintf(inputPath, sizeof(inputPath), "%s/%s", batch->inputDir, batch->names[i]);
+        snprintf(outputPath, sizeof(outputPath), "%s/%s", batch->outputDir, batch->names[i]);
+        FILE* in = fopen(inputPath, "r");
+        FILE* out = fopen(outputPath, "w");
+        if (!in || !out) {
+            fprintf(stderr, "unable to open \"%s\"\n", in ? outputPath : inputPath);
+            if (in) fclose(in);
+            if (out) fclose(out);
+            continue;
+        }
+        VMRestart(vm, batch->image);
+        vm->input = in;
+        vm->output = out;
+        fprintf(out, "%d\n", Interpret(batch->params));
+        batch->bytes[i] = (size_t) ftell(in);
+        fclose(in);
+        fclose(out);
+        batch->latencies[i] = Now() - start;
+    }
+    BipcaSetActiveVM(NULL);
+    FreeVM(vm);
+    return NULL;
+}
+
+// runs the translated program once per file of inputDir, the output and
+// result of each run go to the file of the same name in outputDir
+static bool RunBatch(const char* inputDir, const char* outputDir, int jobs, InterpretParams params) {
+    Batch batch = {.image = BipcaActiveVM(), .params = params,
+                   .inputDir = inputDir, .outputDir = outputDir};
+    if (ListInputs(inputDir, &batch.names, &batch.size)) {
+        fprintf(stderr, "unable to read directory \"%s\"\n", inputDir);
+        return true;
+    }
+    if (mkdir(outputDir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "unable to create directory \"%s\"\n", outputDir);
+        return true;
+    }
+    batch.latencies = (double*) malloc((batch.size + 1) * sizeof(double));
+    batch.bytes = (size_t*) calloc(batch.size + 1, sizeof(size_t));
+    if (!batch.latencies || !batch.bytes) {
+        fprintf(stderr, "not enough memory for %zu inputs\n", batch.size);
+        return true;
+    }
+    for (size_t i = 0; i < batch.size; i++) batch.latencies[i] = -1;
+    if (jobs <= 0) jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0) jobs = 1;
+    if ((size_t) jobs > batch.size) jobs = batch.size > 0 ? (int) batch.size : 1;
+
+    double start = Now();
+    pthread_t* workers = (pthread_t*) malloc((size_t) jobs * sizeof(pthread_t));
+    int started = 0;
+    while (workers && started < jobs && !pthread_create(&workers[started], NULL, BatchWorker, &batch))
+        started++;
+    if (started == 0) BatchWorker(&batch);
+    for (int w = 0; w < started; w++) pthread_join(workers[w], NULL);
+    double elapsed = Now() - start;
+
+    size_t done = 0, bytes = 0;
+    for (size_t i = 0; i < batch.size; i++) {
+        if (batch.latencies[i] < 0) continue;
+        batch.latencies[done++] = batch.latencies[i];
+        bytes += batch.bytes[i];
+    }
+    qsort(batch.latencies, done, sizeof(double), CompareLatencies);
+    printf("-------------" TEXT_BOLD("BATCH") "--------------\n");
+    printf("inputs: %zu of %zu, workers: %d, elapsed: %.3f s\n", done, batch.size, started ? started : 1, elapsed);
+    printf("throughput: %.1f inputs/s, %.2f MB/s\n",
+           elapsed > 0 ? (double) done / elapsed : 0.0,
+           elapsed > 0 ? (double) bytes / elapsed / 1e6 : 0.0);
+    if (done > 0) {
+        static const double percentiles[] = {50, 90, 99, 100};
+        printf("latency:");
+        for (size_t k = 0; k < sizeof(percentiles) / sizeof(percentiles[0]); k++) {
+            size_t rank = (size_t) (percentiles[k] / 100.0 * (double) (done - 1) + 0.5);
+            printf(" p%g %.3f ms", percentiles[k], batch.latencies[rank] * 1e3);
+        }
+        printf("\n");
+    }
+    printf("--------------------------------\n");
+    for (size_t i = 0; i < batch.size; i++) free(batch.names[i]);
+    free(batch.names);
+    free(batch.latencies);
+    free(batch.bytes);
+    free(workers);
+    return done != batch.size;
+}
+
 int main(int argc, char *argv[]) {
     if (argc > 0)
         c_flags_set_application_name(argv[0]);
@@ -14,7 +178,25 @@ int main(int argc, char *argv[]) {
 
     bool *isMemOverseerEnabled = c_flag_bool("memoverseer", "mo", "enable MemOverseer plugin", false);
     bool *isMemDumpEnabled = c_flag_bool("memorydump", "md", "enable MemoryDump plugin", false);
+    char **profile = c_flag_string("profile", "pf", "enable Profiler plugin, folded stacks for flamegraph.pl go to this file", "");
+    int *profilePeriod = c_flag_int("profile-period", "pp", "with --profile, sample one word in this many instead of counting each", 1);
     bool *interpretStepByStep = c_flag_bool("stepbystep", "s", "enable step-by-step interpretation", false);
+    bool *noSuperinstructions = c_flag_bool("nosuper", "ns", "do not fuse superinstructions", false);
+    bool *showStats = c_flag_bool("stats", "st", "report executed dispatches", false);
+    bool *verify = c_flag_bool("verify", "vf", "report functions whose stack depth is not statically verified", false);
+    bool *showTraceStats = c_flag_bool("tracestats", "ts", "report traces formed by the trace engine", false);
+    char **engineName = c_flag_string("engine", "e", "execution engine: switch, threaded, decoded, tos, jit, trace", "switch");
+    char **lexerName = c_flag_string("lexer", "lx", "lexer scanners: auto, scalar, sse2, avx2", "auto");
+    int *optimize = c_flag_int("optimize", "O", "peephole level: 0 off, 1 folds and jump chains, 2 also tail calls", 0);
+    char **emitC = c_flag_string("emit-c", "ec", "write the program as C to this file instead of running it", "");
+    char **emitImage = c_flag_string("emit-image", "ei", "write the translated program as an image to this file instead of running it", "");
+    char **image = c_flag_string("image", "i", "run the program image in this file instead of translating sources", "");
+    char **batchDir = c_flag_string("batch", "b", "run the program once per file of this directory, the file as its input", "");
+    char **batchOut = c_flag_string("batch-out", "bo", "directory for the --batch outputs, <batch>.out by default", "");
+    int *jobs = c_flag_int("jobs", "j", "worker threads of --batch and of translating many files, 0 for one per CPU", 0);
+    int *memoryWords = c_flag_int("memory-words", "mw", "words of VM memory, the stack starts at the top", DEFAULT_SIZE);
+    bool *noCache = c_flag_bool("no-cache", "nc", "always translate, do not use the translation cache", false);
+    bool *verbose = c_flag_bool("verbose", "v", "report translation cache hits, misses and evictions", false);
     bool *help = c_flag_bool("help", "h", "show this message", false);
 
     c_flags_parse(&argc, &argv, false);
@@ -24,16 +206,97 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    if (argc == 0) {
+    if (**image && argc > 0) {
+        printf("ERROR: --image runs a translated program, no file paths expected\n\n");
+        c_flags_usage();
+        return 1;
+    }
+    if (argc == 0 && !**image) {
         printf("ERROR: required file path not specified\n\n");
         c_flags_usage();
         return 1;
     }
 
+    Engine engine;
+    if (EngineFromName(*engineName, &engine)) {
+        printf("ERROR: unknown engine \"%s\"\n\n", *engineName);
+        c_flags_usage();
+        return 1;
+    }
+
+    Lexer lexer;
+    if (LexerFromName(*lexerName, &lexer)) {
+        printf("ERROR: unknown lexer \"%s\"\n\n", *lexerName);
+        c_flags_usage();
+        return 1;
+    }
+
     Error err;
-    err = TranslateFromFiles(argc, argv);
+    BipcaActiveVM()->translateJobs = *jobs;
+    BipcaActiveVM()->lexer = lexer;
+    err = SetMemorySize(*memoryWords);
+    if (err) {
+        fprintf(stderr, "unable to reserve %d words of memory\n", *memoryWords);
+        return 1;
+    }
+    TranslationCache cache = {0};
+    if (**image) err = LoadImage(*image);
+    else if (*noCache) err = TranslateFromFiles(argc, argv);
+    else err = TranslateFromFilesCached(argc, argv, &cache);
     if (err) return 1;
-    PrintProgram();
+    if (*verbose && !**image && !*noCache) {
+        LOG_INFO("translation cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+                 cache.hits, cache.misses, cache.evictions);
+    }
+    if (**emitImage) {
+        FILE* out = fopen(*emitImage, "wb");
+        if (!out || EmitImage(out)) {
+            fprintf(stderr, "unable to write \"%s\"\n", *emitImage);
+            if (out) fclose(out);
+            return 1;
+        }
+        fclose(out);
+        return 0;
+    }
+    if (*optimize > 0) {
+        // tail calls only go to functions the stack proof clears
+        StackProof proof = {0};
+        bool failed = *optimize >= 2 && VerifyStack(&proof);
+        failed = failed || OptimizeProgram(*optimize, *optimize >= 2 ? CanTailCall : NULL, &proof);
+        FreeStackProof(&proof);
+        if (failed) {
+            fprintf(stderr, "not enough memory to optimize the program\n");
+            return 1;
+        }
+    }
+    if (**emitC) {
+        FILE* out = fopen(*emitC, "w");
+        if (!out || EmitC(out)) {
+            fprintf(stderr, "unable to write \"%s\"\n", *emitC);
+            if (out) fclose(out);
+            return 1;
+        }
+        fclose(out);
+        return 0;
+    }
+    if (**batchDir && *interpretStepByStep) {
+        fprintf(stderr, "--batch runs without a terminal, step-by-step is not available\n");
+        return 1;
+    }
+    if (**batchDir && **profile) {
+        fprintf(stderr, "--batch runs the program on many threads at once, --profile is not available\n");
+        return 1;
+    }
+    if (!**batchDir) PrintProgram();
+    if (*verify) {
+        StackProof proof;
+        if (VerifyStack(&proof)) {
+            fprintf(stderr, "not enough memory to verify the program\n");
+            return 1;
+        }
+        PrintStackProof(&proof);
+        FreeStackProof(&proof);
+    }
     if (*isMemOverseerEnabled) {
         err = AddPlugin(&MemOverseerPlugin);
         if (err) {
@@ -48,6 +311,42 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
-    printf("%d\n", Interpret((InterpretParams) { .stepByStepInterpretation = *interpretStepByStep}));
+    if (*profilePeriod < 1) {
+        fprintf(stderr, "--profile-period takes a positive number of words\n");
+        return 1;
+    }
+    if (**profile) {
+        profilerFoldedPath = *profile;
+        profilerPeriod = (uint32_t) *profilePeriod;
+        err = AddPlugin(&ProfilerPlugin);
+        if (err) {
+            fprintf(stderr, "plugin Profiler failed to initialize\n");
+            return 1;
+        }
+    }
+    InterpretStats stats = {0};
+    TraceStats traceStats = {0};
+    if (**batchDir) {
+        char outputDir[PATH_MAX];
+        if (**batchOut) snprintf(outputDir, sizeof(outputDir), "%s", *batchOut);
+        else {
+            size_t length = strlen(*batchDir);
+            while (length > 1 && (*batchDir)[length - 1] == '/') length--;
+            snprintf(outputDir, sizeof(outputDir), "%.*s.out", (int) length, *batchDir);
+        }
+        return RunBatch(*batchDir, outputDir, *jobs, (InterpretParams) {
+            .engine = engine,
+            .noSuperinstructions = *noSuperinstructions,
+        });
+    }
+    printf("%d\n", Interpret((InterpretParams) {
+        .stepByStepInterpretation = *interpretStepByStep,
+        .engine = engine,
+        .noSuperinstructions = *noSuperinstructions,
+        .stats = *showStats ? &stats : NULL,
+        .traceStats = &traceStats,
+    }));
+    if (*showStats) PrintDispatchReport(&stats);
+    if (*showTraceStats) PrintTraceReport(&traceStats);
     return 0;
 }
@@ -0,0 +1,13 @@
+; named constants and expressions folded into one word by the translator
+=COUNT 3
+=LAST COUNT+-1
+=SECOND -2+COUNT
+
+; the last word of the table plus the second one plus the table size
+_table+LAST LOAD
+_table+SECOND LOAD ADD
+_end+-_table ADD
+HALT
+
+:_table 10 20 30
+:_end
@@ -0,0 +1,8 @@
+; constants the translator must reject, each with its own error: sums
+; leaving the Word range and, last in the file, a constant with no value
+=BIG 2147483647
+BIG+1 HALT
+=SMALL -2147483647+-2
+LATER+1
+=LATER 2147483647
+=EMPTY
@@ -0,0 +1,3 @@
+; named constants the file after it builds on, see constants_splitted2.asm
+=COUNT 3
+=STEP 10
@@ -0,0 +1,10 @@
+; constants over those of constants_splitted1.asm, translate the two files
+; together: the last word of the table plus LAST plus STEP
+=LAST COUNT+-1
+=TOP LAST+STEP
+
+_table+LAST LOAD
+TOP ADD
+HALT
+
+:_table 10 20 30
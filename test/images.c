@@ -0,0 +1,188 @@
+// Damaged program images: a slot of the decoded section that does not
+// match its words must not reach the engines, the program is decoded anew.
+// A line table GetCoord() could not walk makes the image bad. A damaged
+// image in the translation cache is translated over, as if it was not there.
+// build: cc -O2 -o images test/images.c
+// usage: ./images, from the repository root; exits non-zero on a failure
+
+#include <dirent.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define BIPCA_IMPLEMENTATION
+#include "../bipca.h"
+
+#define SOURCE "test/gcd.asm"
+#define EXPECTED 12
+
+static char* image;
+static size_t imageSize;
+
+// writes the image, with its rows passed through DamageRows() if any, to
+// path; true on error
+static bool WriteImage(char* path, void (*DamageRows)(LineRow*, uint32_t), void (*Damage)(Instr*)) {
+    ImageHeader h;
+    memcpy(&h, image, sizeof(h));
+    char* copy = malloc(imageSize);
+    memcpy(copy, image, imageSize);
+    if (DamageRows) DamageRows((LineRow*) (copy + h.rowsOffset), h.nCols);
+    if (Damage) Damage((Instr*) (copy + h.decodedOffset));
+    int fd = mkstemp(path);
+    FILE* out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool failed = !out || fwrite(copy, 1, imageSize, out) != imageSize;
+    if (out) fclose(out);
+    free(copy);
+    return failed;
+}
+
+// runs the image with its first decoded slot passed through Damage()
+static bool RunDamaged(const char* name, void (*Damage)(Instr*), Engine engine) {
+    char path[] = "/tmp/bipca-images-XXXXXX";
+    bool failed = WriteImage(path, NULL, Damage);
+
+    BipcaVM* vm = NewVM();
+    BipcaSetActiveVM(vm);
+    Word result = -1;
+    if (!failed && !LoadImage(path)) result = Interpret((InterpretParams) {.engine = engine});
+    BipcaSetActiveVM(NULL);
+    FreeVM(vm);
+    unlink(path);
+    if (result != EXPECTED) {
+        fprintf(stderr, "%s: result %d, expected %d\n", name, result, EXPECTED);
+        return true;
+    }
+    return false;
+}
+
+static void BadOp(Instr* in) { in->op = 200; }
+static void BadBase(Instr* in) { in->base = N_OPS; }
+static void ZeroLength(Instr* in) { in->len = 0; }
+static void LongLength(Instr* in) { in->len = 4; }
+static void WrongImm(Instr* in) { in->imm += 1; }
+static void FusedOp(Instr* in) { in->op = OP_CALL_IMM; }
+
+// loads the image with its rows passed through DamageRows(), which must fail
+static bool RejectsRows(const char* name, void (*DamageRows)(LineRow*, uint32_t)) {
+    ImageHeader h;
+    memcpy(&h, image, sizeof(h));
+    char path[] = "/tmp/bipca-images-XXXXXX";
+    bool failed = h.nRows < 2 || WriteImage(path, DamageRows, NULL);
+    BipcaVM* vm = NewVM();
+    BipcaSetActiveVM(vm);
+    // the rejection reports itself, "not a program image"
+    if (!failed && !LoadImage(path)) failed = true;
+    BipcaSetActiveVM(NULL);
+    FreeVM(vm);
+    unlink(path);
+    if (failed) fprintf(stderr, "rows %s: image loaded\n", name);
+    return failed;
+}
+
+static void ColumnsPastEnd(LineRow* rows, uint32_t nCols) {
+    ImageHeader h;
+    memcpy(&h, image, sizeof(h));
+    for (uint32_t i = 0; i < h.nRows; i++) rows[i].colIndex = nCols;
+}
+static void RowsSwapped(LineRow* rows, uint32_t nCols) {
+    (void) nCols;
+    Word address = rows[0].address;
+    rows[0].address = rows[1].address;
+    rows[1].address = address;
+}
+static void RowBeforeProgram(LineRow* rows, uint32_t nCols) {
+    (void) nCols;
+    rows[0].address = 0;
+}
+
+// translates SOURCE through cache in a fresh VM and runs it
+static Word RunCached(TranslationCache* cache) {
+    char* paths[] = {SOURCE};
+    BipcaVM* vm = NewVM();
+    BipcaSetActiveVM(vm);
+    Word result = -1;
+    if (!TranslateFromFilesCached(1, paths, cache)) result = Interpret((InterpretParams) {.engine = ENGINE_DECODED});
+    BipcaSetActiveVM(NULL);
+    FreeVM(vm);
+    return result;
+}
+
+// caches the image, points a line of it at a file it does not have and
+// translates again
+static bool RunCorruptCache(void) {
+    char dir[] = "/tmp/bipca-cache-XXXXXX";
+    if (!mkdtemp(dir)) return true;
+    TranslationCache cache = {.dir = dir};
+    bool failed = RunCached(&cache) != EXPECTED;
+
+    char path[PATH_MAX] = "";
+    DIR* d = opendir(dir);
+    for (struct dirent* e; d && (e = readdir(d));) {
+        if (strstr(e->d_name, ".bpi")) snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    }
+    if (d) closedir(d);
+    FILE* f = *path ? fopen(path, "r+b") : NULL;
+    ImageHeader h;
+    uint16_t file = 99;
+    failed |= !f || fread(&h, sizeof(h), 1, f) != 1 || !h.nRows
+        || fseek(f, (long) (h.rowsOffset + offsetof(LineRow, file)), SEEK_SET)
+        || fwrite(&file, sizeof(file), 1, f) != 1;
+    if (f) fclose(f);
+
+    Word result = RunCached(&cache);
+    if (result != EXPECTED || cache.hits || cache.misses != 2) {
+        fprintf(stderr, "corrupt cache: result %d, %" PRIu64 " hits, %" PRIu64 " misses\n",
+                result, cache.hits, cache.misses);
+        failed = true;
+    }
+    d = opendir(dir);
+    for (struct dirent* e; d && (e = readdir(d));) {
+        if (*e->d_name == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+    return failed;
+}
+
+int main(void) {
+    char* paths[] = {SOURCE};
+    if (TranslateFromFiles(1, paths)) return 1;
+    char path[] = "/tmp/bipca-images-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* out = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+    if (!out || EmitImage(out)) return 1;
+    fseek(out, 0, SEEK_END);
+    imageSize = (size_t) ftell(out);
+    image = malloc(imageSize);
+    rewind(out);
+    if (fread(image, 1, imageSize, out) != imageSize) return 1;
+    fclose(out);
+    unlink(path);
+
+    static const struct { const char* name; void (*Damage)(Instr*); } damages[] = {
+        { "op",     BadOp },
+        { "base",   BadBase },
+        { "len 0",  ZeroLength },
+        { "len 4",  LongLength },
+        { "imm",    WrongImm },
+        { "fused",  FusedOp },
+    };
+    static const Engine engines[] = { ENGINE_THREADED, ENGINE_DECODED, ENGINE_TOS };
+    bool failed = false;
+    for (size_t d = 0; d < sizeof(damages) / sizeof(damages[0]); d++) {
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+            failed |= RunDamaged(damages[d].name, damages[d].Damage, engines[e]);
+        }
+    }
+    if (!failed) printf("damaged decoded sections: ok\n");
+    bool rowsFailed = RejectsRows("columns past the end", ColumnsPastEnd);
+    rowsFailed |= RejectsRows("swapped", RowsSwapped);
+    rowsFailed |= RejectsRows("before the program", RowBeforeProgram);
+    if (!rowsFailed) printf("damaged line tables: ok\n");
+    failed |= rowsFailed;
+    free(image);
+    if (RunCorruptCache()) failed = true;
+    else printf("corrupt cache: ok\n");
+    return failed;
+}
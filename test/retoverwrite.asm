@@ -0,0 +1,9 @@
+; f overwrites its own return address through a pointer it loaded from
+; memory and "returns" into M with an empty stack: --verify must not prove
+; f, and --memoverseer must report the stack underflow at M
+f CALL
+1 2 3 M JMP
+:M DROP DROP DROP 0 HALT
+:f GETSP 1000 SWAP SAVE
+   1000 LOAD M SAVE
+   JMP
@@ -0,0 +1,29 @@
+; self-modifying code, expected result 87
+; the loop rewrites its own `op` word: ADD for the first three passes,
+; then MUL (-40), then SUB (-2); acc = 1 +3 +3 +3 *3 *3 -3 = 87.
+; the final jump is retargeted from `wrong` to `done` before it runs.
+main JMP
+
+:i 0
+
+:main
+    1 ; acc
+:loop
+    3
+:op ADD
+    i LOAD 1 ADD DUP i SWAP SAVE ; acc i
+
+    DUP 3 CMP not3 JNE
+    op 0 40 SUB SAVE
+:not3
+    DUP 5 CMP not5 JNE
+    op 0 2 SUB SAVE
+:not5
+    6 CMP loop JLT ; acc
+
+    exit_jump done SAVE
+:exit_jump wrong JMP
+:wrong
+    DROP 0 HALT
+:done
+    HALT
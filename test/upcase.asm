@@ -0,0 +1,24 @@
+; copies the input to the output with a..z upper-cased,
+; returns the number of characters read
+
+main JMP
+
+:upcase
+    0 SETRV
+    :upcase_loop
+    IN                          ; ... ra c
+    DUP upcase_end JLT          ; EOF
+    GETRV 1 ADD SETRV
+    DUP 97 CMP upcase_put JLT
+    DUP 122 CMP upcase_put JGT
+    32 SUB
+    :upcase_put
+    OUT
+    upcase_loop JMP
+    :upcase_end
+    DROP
+    RET
+
+:main
+    upcase CALL
+    GETRV HALT